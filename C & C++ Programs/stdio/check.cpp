@@ -0,0 +1,1097 @@
+//-----------------------------------------------------------------------------
+// File:        check.cpp
+// Classes:     FILE
+//
+// Functions:   expect()
+//              slurp()
+//              same()
+//              checkMmap()
+//              checkFgets()
+//              checkFormat()
+//              checkAsync()
+//              checkUring()
+//              checkSeek()
+//              checkCache()
+//              checkCopy()
+//              checkMemory()
+//              checkDirect()
+//              checkScan()
+//              checkUpdate()
+//              checkShared()
+//              checkParallel()
+//              checkChecksum()
+//              checkZip()
+//              peekAll()
+//              checkPeek()
+//              checkGetc()
+//              checkLine()
+//              lockWaiter()
+//              lineWriter()
+//              checkLock()
+//              checkBypass()
+//              checkBuffer()
+//              checkStats()
+//              scratch()
+//              checkGetline()
+//              main()
+//
+// Description: Behaviour checks of the stream modes of stdio.cpp, where
+//              eval.cpp only times them: each check reads or writes through
+//              one mode and compares the bytes with what plain read( ) sees.
+//              Build and run it from this directory, which holds hamlet.txt:
+//                  g++ check.cpp -o check -lpthread && ./check
+//              Each failed check is printed, and the exit status is 1 if
+//              any failed.
+//----------------------------------------------------------------------------
+#include "stdio.h"     // fopen, fread
+#include <fcntl.h>     // open
+#include <sys/types.h> // read
+#include <unistd.h>    // read, unlink, usleep
+#include <sys/stat.h>  // fstat
+#include <stdlib.h>    // free
+#include <errno.h>     // errno
+#include <string.h>    // memcmp
+#include <pthread.h>   // pthread_create, pthread_join
+
+#define SOURCE "hamlet.txt" // the file the read checks compare against
+#define SCRATCH "check.tmp" // the file the write checks write, then remove
+
+int checks = 0;    // checks made so far
+int failures = 0;  // checks failed so far
+
+// Counts a check, and prints it if it failed.
+void expect( bool passed, const char *what ) {
+  checks++;
+  if ( !passed ) {
+    printf( "FAILED: %s\n", what );
+    failures++;
+  }
+}
+
+// Reads a whole file with read( ), so the checks have a reference that does
+// not go through stdio.cpp. Returns NULL if it cannot; the caller delete[]s
+// the data.
+char *slurp( const char *path, long *length ) {
+  *length = 0;
+  int fd = open( path, O_RDONLY );
+  struct stat fileStat;
+  if ( fd == -1 || fstat( fd, &fileStat ) != 0 ) {
+    if ( fd != -1 )
+      close( fd );
+    return NULL;
+  }
+  char *data = new char[fileStat.st_size + 1];
+  long bytesRead;
+  while ( *length < fileStat.st_size &&
+	  ( bytesRead = read( fd, &data[*length],
+			      fileStat.st_size - *length ) ) > 0 )
+    *length += bytesRead;
+  close( fd );
+  return data;
+}
+
+// Tells whether the file at path holds exactly length bytes of data.
+bool same( const char *path, const char *data, long length ) {
+  long fileLength;
+  char *file = slurp( path, &fileLength );
+  bool equal = ( file != NULL && fileLength == length &&
+		 memcmp( file, data, length ) == 0 );
+  delete [] file;
+  return equal;
+}
+
+// 'm' maps the file: a whole read, a seek and single characters all see the
+// file's bytes.
+void checkMmap( const char *data, long length ) {
+  FILE *file = fopen( SOURCE, "rm" );
+  expect( file != NULL && file->map != NULL, "rm maps the file" );
+  if ( file == NULL )
+    return;
+  char *copy = new char[length + 1];
+  expect( (long)fread( copy, 1, length + 1, file ) == length &&
+	  memcmp( copy, data, length ) == 0, "rm reads the whole file" );
+  expect( feof( file ), "rm reaches the end of the file" );
+  expect( fseek( file, length / 2, SEEK_SET ) == 0 &&
+	  ftell( file ) == length / 2, "rm seeks to the middle" );
+  expect( fgetc( file ) == (unsigned char)data[length / 2],
+	  "rm reads a character after the seek" );
+  fclose( file );
+  delete [] copy;
+}
+
+// fgets returns the file line by line, and an empty string when it has room
+// for the terminator only.
+void checkFgets( const char *data, long length ) {
+  FILE *file = fopen( SOURCE, "r" );
+  if ( file == NULL ) {
+    expect( false, "fgets opens the file" );
+    return;
+  }
+  char line[256] = "x";
+  expect( fgets( line, 1, file ) == line && line[0] == '\0',
+	  "fgets with size 1 returns an empty string" );
+  expect( fgets( line, 0, file ) == NULL, "fgets with size 0 returns NULL" );
+  long at = 0;
+  bool match = true;
+  while ( match && fgets( line, sizeof( line ), file ) != NULL ) {
+    long lineLength = strlen( line );
+    match = ( at + lineLength <= length &&
+	      memcmp( line, &data[at], lineLength ) == 0 &&
+	      ( line[lineLength - 1] == '\n' ||
+		lineLength == sizeof( line ) - 1 || at + lineLength == length ) );
+    at += lineLength;
+  }
+  expect( match && at == length, "fgets reads the file line by line" );
+  expect( fgets( line, sizeof( line ), file ) == NULL,
+	  "fgets returns NULL at the end of the file" );
+  fclose( file );
+}
+
+// snprintf formats as C does, and truncates to its size while returning the
+// full length.
+void checkFormat( const char *, long ) {
+  char text[64];
+  int total = snprintf( text, sizeof( text ), "[%5d|%-4s|%04x|%+d|%c%%]",
+			42, "ab", 255, 7, 'z' );
+  expect( total == 23 && strcmp( text, "[   42|ab  |00ff|+7|z%]" ) == 0,
+	  "snprintf formats widths, flags and conversions" );
+  expect( snprintf( text, sizeof( text ), "%ld %lu %lld", -9000000000L,
+		    4000000000UL, -1LL ) == 25 &&
+	  strcmp( text, "-9000000000 4000000000 -1" ) == 0,
+	  "snprintf formats long and long long" );
+  expect( snprintf( text, sizeof( text ), "%hd %hhd %hu %hhx", 70000, 200,
+		    70000, 0x1ff ) == 16 &&
+	  strcmp( text, "4464 -56 4464 ff" ) == 0,
+	  "snprintf narrows h and hh arguments" );
+  expect( snprintf( text, sizeof( text ), "%zu %zd", (size_t)5000000000UL,
+		    (ssize_t)-5 ) == 13 &&
+	  strcmp( text, "5000000000 -5" ) == 0,
+	  "snprintf formats size_t" );
+  expect( snprintf( text, sizeof( text ), "%.3s|%*d", "abcdef", 4, 9 ) == 8 &&
+	  strcmp( text, "abc|   9" ) == 0,
+	  "snprintf takes a precision and a * width" );
+  expect( snprintf( text, 5, "%s", "truncated" ) == 9 &&
+	  strcmp( text, "trun" ) == 0,
+	  "snprintf truncates and returns the full length" );
+}
+
+// Write-behind writes every byte in order, and setvbuf leaves its buffers
+// alone.
+void checkAsync( const char *data, long length ) {
+  FILE *file = fopen( SCRATCH, "w" );
+  if ( file == NULL ) {
+    expect( false, "setasync opens the file" );
+    return;
+  }
+  expect( setasync( file, 2 ) == 0, "setasync starts write-behind" );
+  for ( long at = 0; at < length; at += 1000 )
+    fwrite( &data[at], 1, ( length - at < 1000 ) ? length - at : 1000, file );
+  expect( setvbuf( file, NULL, _IOFBF, 0 ) == -1,
+	  "setvbuf is refused with write-behind on" );
+  expect( fclose( file ) == 0, "fclose waits for write-behind" );
+  expect( same( SCRATCH, data, length ), "write-behind writes the data" );
+
+  file = fopen( "/dev/full", "w" );
+  if ( file != NULL ) {
+    setasync( file, 2 );
+    fputs( "no room\n", file );
+    errno = 0;
+    expect( fclose( file ) == EOF && errno == ENOSPC,
+	    "fclose reports a failed background write" );
+  }
+}
+
+// 'u' writes and reads through io_uring, or read( ) and write( ) where the
+// kernel has none, with the same bytes either way.
+void checkUring( const char *data, long length ) {
+  FILE *file = fopen( SCRATCH, "wu" );
+  if ( file == NULL ) {
+    expect( false, "wu opens the file" );
+    return;
+  }
+  for ( long at = 0; at < length; at += 3000 )
+    fwrite( &data[at], 1, ( length - at < 3000 ) ? length - at : 3000, file );
+  expect( fclose( file ) == 0, "wu flushes at fclose" );
+  expect( same( SCRATCH, data, length ), "wu writes the data" );
+
+  file = fopen( SCRATCH, "ru" );
+  if ( file == NULL ) {
+    expect( false, "ru opens the file" );
+    return;
+  }
+  char *copy = new char[length + 1];
+  long got = 0;
+  int c;
+  while ( ( c = fgetc( file ) ) != EOF && got < length )
+    copy[got++] = c;
+  expect( got == length && memcmp( copy, data, length ) == 0,
+	  "ru reads the data" );
+  fclose( file );
+  delete [] copy;
+}
+
+// fseek within the buffer keeps it, and fgetpos and fsetpos come back to the
+// same byte.
+void checkSeek( const char *data, long length ) {
+  FILE *file = fopen( SOURCE, "r" );
+  if ( file == NULL || length < 1000 ) {
+    expect( false, "fseek opens the file" );
+    if ( file != NULL )
+      fclose( file );
+    return;
+  }
+  char copy[100];
+  fread( copy, 1, 100, file );
+  fiostats before, after;
+  fstats( file, &before );
+  expect( fseek( file, -60, SEEK_CUR ) == 0 && ftell( file ) == 40,
+	  "fseek moves back within the buffer" );
+  expect( fgetc( file ) == (unsigned char)data[40],
+	  "fgetc reads the byte fseek moved to" );
+  fstats( file, &after );
+  expect( after.seekhits == before.seekhits + 1 && after.reads == before.reads,
+	  "an in-buffer fseek reads nothing" );
+  fpos_t pos = 0;
+  expect( fgetpos( file, &pos ) == 0 && pos == 41, "fgetpos reports 41" );
+  fseek( file, length - 10, SEEK_SET );
+  expect( fsetpos( file, &pos ) == 0 && fgetc( file ) ==
+	  (unsigned char)data[41], "fsetpos returns to the saved position" );
+  expect( fseek( file, -5, SEEK_END ) == 0 && ftell( file ) == length - 5,
+	  "fseek from the end" );
+  fclose( file );
+}
+
+// The block cache serves reads after fseek with the file's bytes, and a
+// block read again is a hit.
+void checkCache( const char *data, long length ) {
+  FILE *file = fopen( SOURCE, "r" );
+  if ( file == NULL ) {
+    expect( false, "setcache opens the file" );
+    return;
+  }
+  expect( setcache( file, 4 ) == 0, "setcache sets up 4 blocks" );
+  char copy[200];
+  bool match = true;
+  unsigned long state = 1;
+  for ( int i = 0; i < 200; i++ ) {
+    state = state * 6364136223846793005UL + 1442695040888963407UL;
+    long at = (long)( ( state >> 33 ) % length );
+    long want = ( length - at < 200 ) ? length - at : 200;
+    match = match && fseek( file, at, SEEK_SET ) == 0 &&
+      (long)fread( copy, 1, 200, file ) == want &&
+      memcmp( copy, &data[at], want ) == 0;
+  }
+  expect( match, "cached reads after fseek see the file's bytes" );
+  fseek( file, 0, SEEK_SET );
+  fgetc( file );
+  fseek( file, length - 1, SEEK_SET );   // another block
+  fgetc( file );
+  fcachestats before, after;
+  fcachestat( file, &before );
+  fseek( file, 0, SEEK_SET );
+  expect( fgetc( file ) == (unsigned char)data[0], "fgetc after fseek to 0" );
+  fcachestat( file, &after );
+  expect( after.hits == before.hits + 1 && after.misses == before.misses,
+	  "a cached block is read once" );
+  expect( setcache( file, 0 ) == 0 && fgetc( file ) == (unsigned char)data[1],
+	  "setcache off keeps the position" );
+  fclose( file );
+}
+
+// fcopy copies from the position of src to its end, the bytes src has
+// already buffered included.
+void checkCopy( const char *data, long length ) {
+  FILE *source = fopen( SOURCE, "r" );
+  FILE *copy = fopen( SCRATCH, "w" );
+  if ( source == NULL || copy == NULL ) {
+    expect( false, "fcopy opens both files" );
+    if ( source != NULL )
+      fclose( source );
+    if ( copy != NULL )
+      fclose( copy );
+    return;
+  }
+  fgetc( source );   // the rest of the first buffer is src's to write
+  expect( fcopy( copy, source, -1 ) == length - 1, "fcopy copies the rest" );
+  expect( ftell( copy ) == length - 1, "fcopy moves dst past the copy" );
+  fclose( source );
+  fclose( copy );
+  expect( same( SCRATCH, &data[1], length - 1 ), "fcopy writes the bytes" );
+}
+
+// open_memstream grows to hold what is written, and fmemopen reads and
+// writes a fixed block of memory.
+void checkMemory( const char *data, long length ) {
+  char *text = NULL;
+  size_t size = 0;
+  FILE *file = open_memstream( &text, &size );
+  if ( file == NULL ) {
+    expect( false, "open_memstream opens a stream" );
+    return;
+  }
+  fprintf( file, "%d-%s", 12, "ab" );
+  expect( fflush( file ) == 0 && size == 5 && strcmp( text, "12-ab" ) == 0,
+	  "open_memstream holds the data after fflush" );
+  fwrite( data, 1, length, file );
+  fclose( file );
+  expect( text != NULL && (long)size == length + 5 && text[size] == '\0' &&
+	  memcmp( &text[5], data, length ) == 0,
+	  "open_memstream grows to hold the file" );
+  free( text );
+
+  char memory[16] = "0123456789";
+  file = fmemopen( memory, sizeof( memory ), "r" );
+  char copy[16];
+  expect( file != NULL && fseek( file, 4, SEEK_SET ) == 0 &&
+	  fread( copy, 1, 3, file ) == 3 && memcmp( copy, "456", 3 ) == 0,
+	  "fmemopen reads after fseek" );
+  if ( file != NULL ) {
+    expect( fputs( "XY", file ) == EOF && fputc( 'Z', file ) == EOF &&
+	    fclose( file ) == 0 && strcmp( memory, "0123456789" ) == 0,
+	    "fmemopen r refuses writes to the memory" );
+  }
+  file = fmemopen( memory, 8, "w" );
+  if ( file != NULL ) {
+    fputs( "abcdefghijkl", file );
+    fclose( file );
+  }
+  expect( file != NULL && memcmp( memory, "abcdefg", 7 ) == 0 &&
+	  memcmp( &memory[8], "89", 2 ) == 0,
+	  "fmemopen writes stop at the end of the memory" );
+}
+
+// 'd' writes and reads unaligned lengths and positions with O_DIRECT, or
+// normally where the file system has no O_DIRECT.
+void checkDirect( const char *data, long length ) {
+  FILE *file = fopen( SCRATCH, "wd" );
+  if ( file == NULL ) {
+    expect( false, "wd opens the file" );
+    return;
+  }
+  for ( long at = 0; at < length; at += 777 )
+    fwrite( &data[at], 1, ( length - at < 777 ) ? length - at : 777, file );
+  expect( fclose( file ) == 0, "wd flushes at fclose" );
+  expect( same( SCRATCH, data, length ), "wd writes the data" );
+
+  file = fopen( SCRATCH, "rd" );
+  if ( file == NULL ) {
+    expect( false, "rd opens the file" );
+    return;
+  }
+  char *copy = new char[length + 1];
+  long at = length / 3 + 1;
+  expect( fseek( file, at, SEEK_SET ) == 0 &&
+	  (long)fread( copy, 1, length, file ) == length - at &&
+	  memcmp( copy, &data[at], length - at ) == 0,
+	  "rd reads from an unaligned position" );
+  fclose( file );
+  delete [] copy;
+}
+
+// fscanf, fread_int and fread_double parse numbers and words from the
+// buffer, and leave what ends them unread.
+void checkScan( const char *, long ) {
+  FILE *file = fopen( SCRATCH, "w" );
+  if ( file == NULL ) {
+    expect( false, "fscanf writes its input" );
+    return;
+  }
+  fputs( "12 -7 3.25 word 1f,99\n-40,2.5e3 0x1.8p3", file );
+  fclose( file );
+  file = fopen( SCRATCH, "r" );
+  if ( file == NULL ) {
+    expect( false, "fscanf opens its input" );
+    return;
+  }
+  int small = 0, hex = 0, last = 0;
+  long big = 0;
+  double real = 0;
+  char word[16] = "";
+  expect( fscanf( file, "%d %ld %lf %15s %x,%d", &small, &big, &real, word,
+		  &hex, &last ) == 6 && small == 12 && big == -7 &&
+	  real == 3.25 && strcmp( word, "word" ) == 0 && hex == 0x1f &&
+	  last == 99, "fscanf converts each kind" );
+  long integer = 0;
+  expect( fread_int( file, &integer ) == 1 && integer == -40 &&
+	  fgetc( file ) == ',', "fread_int leaves the ',' unread" );
+  expect( fread_double( file, &real ) == 1 && real == 2500.0,
+	  "fread_double reads an exponent" );
+  expect( fscanf( file, "%la", &real ) == 0, "%a is not supported" );
+  fclose( file );
+
+  file = fopen( SCRATCH, "w" );
+  if ( file == NULL ) {
+    expect( false, "fscanf writes its input" );
+    return;
+  }
+  fputs( "0xg 0xg 0x1A 017 -0x10 9", file );
+  fclose( file );
+  file = fopen( SCRATCH, "r" );
+  if ( file == NULL ) {
+    expect( false, "fscanf opens its input" );
+    return;
+  }
+  expect( fscanf( file, "%x", &hex ) == 1 && hex == 0 &&
+	  fgetc( file ) == 'x' && fgetc( file ) == 'g',
+	  "%x reads 0xg as 0 and leaves xg unread" );
+  expect( fscanf( file, "%i", &hex ) == 1 && hex == 0 &&
+	  fgetc( file ) == 'x' && fgetc( file ) == 'g',
+	  "%i reads 0xg as 0 and leaves xg unread" );
+  int octal = 0, negative = 0, decimal = 0;
+  expect( fscanf( file, "%i %i %i %i", &hex, &octal, &negative,
+		  &decimal ) == 4 && hex == 0x1A && octal == 017 &&
+	  negative == -0x10 && decimal == 9,
+	  "%i takes the base from the prefix" );
+  fclose( file );
+}
+
+// An r+ stream reads a record, seeks back and writes it over, and a w+
+// stream reads back what it wrote.
+void checkUpdate( const char *data, long length ) {
+  FILE *file = fopen( SCRATCH, "w+" );
+  if ( file == NULL ) {
+    expect( false, "w+ opens the file" );
+    return;
+  }
+  fwrite( data, 1, length, file );
+  char *copy = new char[length + 1];
+  expect( fseek( file, 0, SEEK_SET ) == 0 &&
+	  (long)fread( copy, 1, length, file ) == length &&
+	  memcmp( copy, data, length ) == 0, "w+ reads back what it wrote" );
+  fclose( file );
+
+  file = fopen( SCRATCH, "r+" );
+  if ( file == NULL ) {
+    expect( false, "r+ opens the file" );
+    delete [] copy;
+    return;
+  }
+  char record[64];
+  long at = 0;
+  bool whole = true;
+  while ( whole && at < length ) {
+    long size = ( length - at < 64 ) ? length - at : 64;
+    whole = ( (long)fread( record, 1, size, file ) == size &&
+	      fseek( file, -size, SEEK_CUR ) == 0 );
+    for ( long i = 0; i < size; i++ )
+      record[i] ^= 1;
+    whole = whole && (long)fwrite( record, 1, size, file ) == size;
+    at += size;
+  }
+  fclose( file );
+  for ( long i = 0; i < length; i++ )
+    copy[i] = data[i] ^ 1;
+  expect( whole && same( SCRATCH, copy, length ),
+	  "r+ writes each record over the one it read" );
+  delete [] copy;
+
+  // a write-back that fails keeps the window and its dirty bytes
+  file = fopen( SCRATCH, "r+" );
+  int full = open( "/dev/full", O_WRONLY );
+  if ( file == NULL || full == -1 || !file->update ) {
+    expect( false, "r+ opens an update stream" );
+    if ( file != NULL )
+      fclose( file );
+    if ( full != -1 )
+      close( full );
+    return;
+  }
+  int real = dup( file->fd );
+  fputs( "CHANGED", file );
+  dup2( full, file->fd );
+  expect( fseek( file, length / 2, SEEK_SET ) == EOF && ftell( file ) == 7,
+	  "fseek fails and stays put when the write-back fails" );
+  dup2( real, file->fd );
+  expect( fseek( file, length / 2, SEEK_SET ) == 0,
+	  "fseek writes the dirty bytes back once it can" );
+  fputs( "AGAIN", file );
+  dup2( full, file->fd );
+  errno = 0;
+  expect( fclose( file ) == EOF && errno == ENOSPC,
+	  "fclose reports a failed write-back" );
+  close( full );
+  long fileLength;
+  char *changed = slurp( SCRATCH, &fileLength );
+  expect( changed != NULL && memcmp( changed, "CHANGED", 7 ) == 0 &&
+	  ( changed[length / 2] ^ 1 ) == data[length / 2],
+	  "only the bytes written back reach the file" );
+  delete [] changed;
+  close( real );
+}
+
+// Two cursors on one file keep positions of their own.
+void checkShared( const char *data, long length ) {
+  FILE *first = fopen_shared( SOURCE, 0 );
+  FILE *second = fopen_shared( SOURCE, 0 );
+  if ( first == NULL || second == NULL ) {
+    expect( false, "fopen_shared opens two cursors" );
+    if ( first != NULL )
+      fclose( first );
+    if ( second != NULL )
+      fclose( second );
+    return;
+  }
+  expect( first->share == second->share, "the cursors share the file" );
+  char one[100], two[100];
+  fseek( second, length / 2, SEEK_SET );
+  expect( fread( one, 1, 100, first ) == 100 &&
+	  fread( two, 1, 100, second ) == 100 &&
+	  memcmp( one, data, 100 ) == 0 &&
+	  memcmp( two, &data[length / 2], 100 ) == 0,
+	  "each cursor reads at its own position" );
+  expect( ftell( first ) == 100 && ftell( second ) == length / 2 + 100,
+	  "each cursor keeps its own position" );
+  fclose( first );
+  expect( fgetc( second ) == (unsigned char)data[length / 2 + 100],
+	  "a cursor reads on after another is closed" );
+  fclose( second );
+}
+
+// fread_parallel reads a file of several megabytes into an unaligned buffer
+// in pieces, and fsplitlines splits a file at line starts.
+void checkParallel( const char *data, long length ) {
+  const int copies = 20;   // enough for more than one reading thread
+  FILE *file = fopen( SCRATCH, "w" );
+  if ( file == NULL ) {
+    expect( false, "fread_parallel writes its input" );
+    return;
+  }
+  for ( int i = 0; i < copies; i++ )
+    fwrite( data, 1, length, file );
+  fclose( file );
+  file = fopen( SCRATCH, "r" );
+  if ( file == NULL ) {
+    expect( false, "fread_parallel opens its input" );
+    return;
+  }
+  long total = length * copies;
+  char *copy = new char[total + 2];
+  copy[0] = fgetc( file );
+  long got = fread_parallel( &copy[1], total, file, 4 );
+  bool match = ( got == total - 1 );
+  for ( int i = 0; match && i < copies; i++ )
+    match = ( memcmp( &copy[i * length], data, length ) == 0 );
+  expect( match, "fread_parallel reads every piece" );
+  expect( feof( file ) && ftell( file ) == total,
+	  "fread_parallel leaves the stream at the end" );
+  fclose( file );
+  delete [] copy;
+
+  long bounds[5];
+  file = fopen( SOURCE, "r" );
+  bool lines = ( file != NULL && fsplitlines( file, 4, bounds ) == 4 &&
+		 bounds[0] == 0 && bounds[4] == length );
+  for ( int i = 1; lines && i < 4; i++ )
+    lines = ( bounds[i] > bounds[i - 1] && data[bounds[i] - 1] == '\n' );
+  expect( lines, "fsplitlines splits at line starts" );
+  if ( file != NULL )
+    fclose( file );
+}
+
+// fcrc32c gives the known CRC32C values, and a stream with a checksum sums
+// what it writes and reads.
+void checkChecksum( const char *data, long length ) {
+  char zeros[32], ones[32];
+  memset( zeros, 0, sizeof( zeros ) );
+  memset( ones, 0xFF, sizeof( ones ) );
+  expect( fcrc32c( 0, "123456789", 9 ) == 0xE3069283 &&
+	  fcrc32c( 0, zeros, 32 ) == 0x8A9136AA &&
+	  fcrc32c( 0, ones, 32 ) == 0x62A8AB43 && fcrc32c( 0, "", 0 ) == 0,
+	  "fcrc32c gives the known values" );
+  unsigned whole = fcrc32c( 0, data, length );
+  expect( fcrc32c( fcrc32c( 0, data, 1001 ), &data[1001], length - 1001 ) ==
+	  whole, "fcrc32c continues from a partial checksum" );
+
+  FILE *file = fopen( SCRATCH, "w" );
+  if ( file == NULL ) {
+    expect( false, "setchecksum opens the file" );
+    return;
+  }
+  unsigned crc = 0;
+  expect( setchecksum( file, true ) == 0, "setchecksum starts a checksum" );
+  for ( long at = 0; at < length; at += 5000 )
+    fwrite( &data[at], 1, ( length - at < 5000 ) ? length - at : 5000, file );
+  expect( fclose_checksum( file, &crc ) == 0 && crc == whole,
+	  "fclose_checksum sums what was written" );
+
+  file = fopen( SCRATCH, "r" );
+  if ( file == NULL ) {
+    expect( false, "fclose_verify opens the file" );
+    return;
+  }
+  setchecksum( file, true );
+  expect( fseek( file, 0, SEEK_SET ) == EOF, "fseek is refused" );
+  char line[256];
+  while ( fgets( line, sizeof( line ), file ) != NULL )
+    ;
+  expect( fclose_verify( file, whole ) == 0, "fclose_verify accepts the file" );
+}
+
+// 'z' writes the file as compressed frames and reads it back, from the
+// start, after fseek and after an append.
+void checkZip( const char *data, long length ) {
+  FILE *file = fopen( SCRATCH, "wz" );
+  if ( file == NULL ) {
+    expect( false, "wz opens the file" );
+    return;
+  }
+  for ( long at = 0; at < length; at += 4000 )
+    fwrite( &data[at], 1, ( length - at < 4000 ) ? length - at : 4000, file );
+  expect( ftell( file ) == length, "wz counts the bytes written" );
+  expect( fclose( file ) == 0, "wz flushes at fclose" );
+  struct stat fileStat;
+  expect( stat( SCRATCH, &fileStat ) == 0 && fileStat.st_size < length,
+	  "wz compresses the file" );
+
+  file = fopen( SCRATCH, "az" );
+  if ( file != NULL ) {
+    fputs( "appended\n", file );
+    fclose( file );
+  }
+  expect( file != NULL, "az opens the file" );
+
+  file = fopen( SCRATCH, "rz" );
+  if ( file == NULL ) {
+    expect( false, "rz opens the file" );
+    return;
+  }
+  char *copy = new char[length + 32];
+  expect( (long)fread( copy, 1, length + 32, file ) == length + 9 &&
+	  memcmp( copy, data, length ) == 0 &&
+	  memcmp( &copy[length], "appended\n", 9 ) == 0,
+	  "rz reads every frame, the appended one included" );
+  bool match = true;
+  unsigned long state = 1;
+  for ( int i = 0; i < 100; i++ ) {
+    state = state * 6364136223846793005UL + 1442695040888963407UL;
+    long at = (long)( ( state >> 33 ) % length );
+    long want = ( length - at < 300 ) ? length - at : 300;
+    match = match && fseek( file, at, SEEK_SET ) == 0 &&
+      ftell( file ) == at && (long)fread( copy, 1, want, file ) == want &&
+      memcmp( copy, &data[at], want ) == 0;
+  }
+  expect( match, "rz reads after fseek" );
+  fclose( file );
+  delete [] copy;
+  expect( fopen( SCRATCH, "r+z" ) == NULL, "r+z is refused" );
+}
+
+// Reads a stream through fpeek and fadvance alone, returning how many runs it
+// took, or -1 if a run differs from data.
+long peekAll( FILE *file, const char *data, long length ) {
+  long offset = 0, runs = 0;
+  const char *run;
+  size_t len;
+  while ( ( run = fpeek( file, &len ) ) != NULL ) {
+    if ( offset + (long)len > length || memcmp( run, &data[offset], len ) != 0
+	 || fadvance( file, len ) != 0 )
+      return -1;
+    offset += len;
+    runs++;
+  }
+  return ( offset == length && feof( file ) ) ? runs : -1;
+}
+
+// fpeek lends the buffer in place, refilling it between runs on a buffered
+// and a mapped stream alike, and fadvance refuses to pass the bytes lent out.
+void checkPeek( const char *data, long length ) {
+  FILE *file = fopen( SOURCE, "r" );
+  if ( file == NULL ) {
+    expect( false, "fopen opens the source" );
+    return;
+  }
+  size_t len = 0;
+  const char *run = fpeek( file, &len );
+  expect( run != NULL && len > 0 && (long)len < length &&
+	  memcmp( run, data, len ) == 0, "fpeek lends the first buffer" );
+  errno = 0;
+  expect( fadvance( file, len + 1 ) == EOF && errno == EINVAL &&
+	  ftell( file ) == 0, "fadvance past the peeked bytes fails" );
+  expect( fadvance( file, 1 ) == 0 && fgetc( file ) == (unsigned char)data[1],
+	  "fadvance consumes what it is given" );
+  fseek( file, 0, SEEK_SET );
+  expect( peekAll( file, data, length ) > 1,
+	  "fpeek runs span refills and cover the file" );
+  fclose( file );
+
+  file = fopen( SOURCE, "rm" );
+  expect( file != NULL && file->map != NULL &&
+	  peekAll( file, data, length ) > 0,
+	  "fpeek on rm lends the mapping" );
+  if ( file != NULL )
+    fclose( file );
+}
+
+// The inline getc and putc only touch pos until the buffer runs dry or fills,
+// then hand over to _filbuf and _flsbuf; one character at a time they copy the
+// file across many buffers.
+void checkGetc( const char *data, long length ) {
+  FILE *in = fopen( SOURCE, "r" );
+  FILE *out = fopen( SCRATCH, "w" );
+  if ( in == NULL || out == NULL ) {
+    expect( false, "fopen opens the source and the scratch file" );
+    if ( in != NULL )
+      fclose( in );
+    if ( out != NULL )
+      fclose( out );
+    return;
+  }
+  long count = 0;
+  bool matched = true;
+  int c;
+  while ( ( c = getc( in ) ) != EOF ) {
+    matched = matched && count < length && c == (unsigned char)data[count];
+    if ( putc( c, out ) != c )
+      matched = false;
+    count++;
+  }
+  expect( matched && count == length && feof( in ),
+	  "getc returns every byte of the file in order" );
+  expect( fclose( out ) == 0 && same( SCRATCH, data, length ),
+	  "putc writes every byte of the file in order" );
+  fclose( in );
+}
+
+// stdout set to _IOLBF holds a partial line and writes it out at the '\n',
+// whether it comes through printf or putc. stdout is pointed at the scratch
+// file meanwhile, so nothing is printed until it is put back.
+void checkLine( const char *, long ) {
+  fflush( stdout );
+  int saved = dup( 1 );
+  int fd = open( SCRATCH, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+  if ( saved == -1 || fd == -1 || dup2( fd, 1 ) == -1 ) {
+    expect( false, "stdout is redirected to the scratch file" );
+    if ( saved != -1 )
+      close( saved );
+    if ( fd != -1 )
+      close( fd );
+    return;
+  }
+  close( fd );
+  int mode = stdout->mode;
+  setvbuf( stdout, stdoutBuffer, _IOLBF, BUFSIZ );
+  printf( "partial" );
+  bool held = same( SCRATCH, "", 0 );
+  printf( " line\n" );
+  bool printed = same( SCRATCH, "partial line\n", 13 );
+  putc( 'n', stdout );
+  putc( 'e', stdout );
+  putc( 'x', stdout );
+  putc( 't', stdout );
+  bool unput = same( SCRATCH, "partial line\n", 13 );
+  putc( '\n', stdout );
+  bool put = same( SCRATCH, "partial line\nnext\n", 18 );
+  fflush( stdout );
+  dup2( saved, 1 );
+  close( saved );
+  setvbuf( stdout, stdoutBuffer, mode, BUFSIZ );
+  expect( held, "_IOLBF stdout holds a partial line" );
+  expect( printed, "_IOLBF stdout writes through printf's newline" );
+  expect( unput && put, "_IOLBF stdout writes through putc's newline" );
+}
+
+// A thread that must wait for the stream's lock: it records whether
+// ftrylockfile was refused, then writes its line once flockfile lets it in.
+void *lockWaiter( void *arg ) {
+  FILE *file = (FILE *)arg;
+  bool refused = ( ftrylockfile( file ) != 0 );
+  flockfile( file );
+  fputs( refused ? "waited\n" : "barged\n", file );
+  funlockfile( file );
+  return NULL;
+}
+
+// What a lineWriter thread writes: LINES lines of one letter to file.
+#define LINES 2000
+struct lines {
+  FILE *file;
+  char letter;
+};
+
+// A thread that writes its lines to the shared stream one fputs at a time.
+void *lineWriter( void *arg ) {
+  FILE *file = ( (lines *)arg )->file;
+  char line[64];
+  memset( line, ( (lines *)arg )->letter, sizeof( line ) - 2 );
+  line[sizeof( line ) - 2] = '\n';
+  line[sizeof( line ) - 1] = '\0';
+  for ( int i = 0; i < LINES; i++ )
+    fputs( line, file );
+  return NULL;
+}
+
+// flockfile is recursive, and a second thread sleeps on it until the owner
+// has released every hold; two threads writing lines with fputs never split
+// each other's lines.
+void checkLock( const char *, long ) {
+  FILE *file = fopen( SCRATCH, "w" );
+  if ( file == NULL ) {
+    expect( false, "fopen opens the scratch file" );
+    return;
+  }
+  flockfile( file );
+  flockfile( file );
+  pthread_t waiter;
+  pthread_create( &waiter, NULL, lockWaiter, file );
+  usleep( 20000 );              // time for the waiter to block on the lock
+  funlockfile( file );
+  usleep( 20000 );              // one hold is left: it must still wait
+  fputs( "owner\n", file );
+  funlockfile( file );
+  pthread_join( waiter, NULL );
+  expect( fclose( file ) == 0 && same( SCRATCH, "owner\nwaited\n", 13 ),
+	  "flockfile holds the lock until every hold is released" );
+
+  file = fopen( SCRATCH, "w" );
+  if ( file == NULL ) {
+    expect( false, "fopen opens the scratch file" );
+    return;
+  }
+  lines args[2] = { { file, 'a' }, { file, 'b' } };
+  pthread_t writers[2];
+  for ( int i = 0; i < 2; i++ )
+    pthread_create( &writers[i], NULL, lineWriter, &args[i] );
+  for ( int i = 0; i < 2; i++ )
+    pthread_join( writers[i], NULL );
+  fclose( file );
+  long fileLength;
+  char *text = slurp( SCRATCH, &fileLength );
+  long count[2] = { 0, 0 };
+  bool intact = ( text != NULL && fileLength == 2 * LINES * 63 );
+  for ( long i = 0; intact && i < fileLength; i += 63 ) {
+    intact = ( ( text[i] == 'a' || text[i] == 'b' ) && text[i + 62] == '\n' );
+    for ( int j = 1; intact && j < 62; j++ )
+      intact = ( text[i + j] == text[i] );
+    if ( intact )
+      count[text[i] - 'a']++;
+  }
+  expect( intact && count[0] == LINES && count[1] == LINES,
+	  "fputs from two threads keeps every line whole" );
+  delete [] text;
+}
+
+// A request larger than the buffer bypasses it: fread takes what is buffered
+// and readv( )s the rest straight into the caller's memory, and fwrite
+// writev( )s what is buffered along with the caller's data, so neither copies
+// the bulk of it.
+void checkBypass( const char *data, long length ) {
+  FILE *file = fopen( SOURCE, "r" );
+  if ( file == NULL ) {
+    expect( false, "fopen opens the source" );
+    return;
+  }
+  char *copy = new char[length];
+  copy[0] = fgetc( file );
+  fiostats stats;
+  expect( (long)fread( &copy[1], 1, length - 1, file ) == length - 1 &&
+	  memcmp( copy, data, length ) == 0 && fstats( file, &stats ) == 0 &&
+	  stats.copied < file->size && stats.bytesread == length,
+	  "fread reads a large request around the buffer" );
+  fclose( file );
+  delete [] copy;
+
+  file = fopen( SCRATCH, "w" );
+  if ( file == NULL ) {
+    expect( false, "fopen opens the scratch file" );
+    return;
+  }
+  fputc( data[0], file );
+  expect( (long)fwrite( &data[1], 1, length - 1, file ) == length - 1 &&
+	  fstats( file, &stats ) == 0 && stats.copied == 0 &&
+	  stats.writes == 1 && stats.byteswritten == length &&
+	  fclose( file ) == 0 && same( SCRATCH, data, length ),
+	  "fwrite writes a large request with what is buffered" );
+}
+
+// An adaptive buffer doubles while a file is read straight through and drops
+// back to the size chosen at fopen on a seek, and fbufstat reports each
+// resize in order.
+void checkBuffer( const char *data, long length ) {
+  const int copies = 8;    // long enough a scan for the buffer to grow
+  FILE *file = fopen( SCRATCH, "w" );
+  if ( file == NULL ) {
+    expect( false, "fopen opens the scratch file" );
+    return;
+  }
+  for ( int i = 0; i < copies; i++ )
+    fwrite( data, 1, length, file );
+  fclose( file );
+  file = fopen( SCRATCH, "r" );
+  if ( file == NULL ) {
+    expect( false, "fopen opens the scratch file" );
+    return;
+  }
+  long count = 0;
+  while ( getc( file ) != EOF )
+    count++;
+  fbufstats grown;
+  bool doubled = ( count == length * copies && fbufstat( file, &grown ) == 0 &&
+		   grown.base > 0 && grown.resizes > 0 &&
+		   grown.count == grown.resizes && grown.count <= BUFHISTORY &&
+		   grown.history[grown.count - 1] == grown.size );
+  for ( int i = 0; doubled && i < grown.count; i++ )
+    doubled = ( grown.history[i] ==
+		( i == 0 ? grown.base : grown.history[i - 1] ) * 2 );
+  expect( doubled, "fbufstat shows the buffer doubling on a scan" );
+
+  fbufstats shrunk;
+  expect( fseek( file, 0, SEEK_SET ) == 0 && fgetc( file ) == data[0] &&
+	  fbufstat( file, &shrunk ) == 0 && shrunk.size == grown.base &&
+	  shrunk.resizes == grown.resizes + 1 &&
+	  shrunk.history[shrunk.count - 1] == grown.base,
+	  "fbufstat shows the buffer shrinking back on a seek" );
+  fclose( file );
+}
+
+// fstats( NULL ) totals the counters of every stream closed so far, so a
+// closed stream's counters are added to it exactly once.
+void checkStats( const char *data, long length ) {
+  fiostats before, open, after;
+  fstats( NULL, &before );
+  FILE *file = fopen( SOURCE, "r" );
+  if ( file == NULL ) {
+    expect( false, "fopen opens the source" );
+    return;
+  }
+  char *copy = new char[length];
+  bool whole = ( (long)fread( copy, 1, length, file ) == length &&
+		 memcmp( copy, data, length ) == 0 );
+  fstats( file, &open );
+  fiostats during;
+  fstats( NULL, &during );
+  fclose( file );
+  fstats( NULL, &after );
+  delete [] copy;
+  expect( whole && open.bytesread == length && open.reads > 0,
+	  "fstats counts the reads of an open stream" );
+  expect( during.bytesread == before.bytesread &&
+	  during.reads == before.reads,
+	  "fstats( NULL ) leaves out streams still open" );
+  expect( after.bytesread == before.bytesread + open.bytesread &&
+	  after.reads == before.reads + open.reads &&
+	  after.refills == before.refills + open.refills &&
+	  after.copied == before.copied + open.copied,
+	  "fstats( NULL ) adds a stream's counters when it is closed" );
+}
+
+// Writes text to the scratch file and opens it for reading, or returns NULL.
+FILE *scratch( const char *text, long length ) {
+  FILE *file = fopen( SCRATCH, "w" );
+  if ( file == NULL )
+    return NULL;
+  if ( length > 0 )      // fwrite refuses to write nothing
+    fwrite( text, 1, length, file );
+  fclose( file );
+  return fopen( SCRATCH, "r" );
+}
+
+// getline grows a small buffer to hold a line longer than the stream's
+// buffer and returns a last line without its '\n'; getdelim splits at any
+// character; fcountlines counts an unterminated last line, and an empty file
+// has no lines at all.
+void checkGetline( const char *data, long length ) {
+  const long longLength = 20000;   // longer than the stream's buffer
+  char *text = new char[longLength + 16];
+  memset( text, 'x', longLength );
+  strcpy( &text[longLength], "\nmid\nlast" );
+  long textLength = longLength + 9;
+  FILE *file = scratch( text, textLength );
+  if ( file == NULL ) {
+    expect( false, "fopen opens the scratch file" );
+    delete [] text;
+    return;
+  }
+  size_t size = 16;
+  char *line = (char *)malloc( size );
+  expect( getline( &line, &size, file ) == longLength + 1 &&
+	  size > (size_t)longLength + 1 &&
+	  memcmp( line, text, longLength + 1 ) == 0 &&
+	  line[longLength + 1] == '\0',
+	  "getline grows the buffer for a long line" );
+  expect( getline( &line, &size, file ) == 4 && strcmp( line, "mid\n" ) == 0,
+	  "getline reads the next line into the grown buffer" );
+  expect( getline( &line, &size, file ) == 4 && strcmp( line, "last" ) == 0,
+	  "getline returns a last line without its delimiter" );
+  expect( getline( &line, &size, file ) == EOF && feof( file ),
+	  "getline returns EOF after the last line" );
+  fclose( file );
+  file = fopen( SCRATCH, "r" );
+  expect( file != NULL && fcountlines( file ) == 3,
+	  "fcountlines counts a last line without a newline" );
+  if ( file != NULL )
+    fclose( file );
+  delete [] text;
+
+  file = scratch( "a,bb,ccc", 8 );
+  expect( file != NULL && getdelim( &line, &size, ',', file ) == 2 &&
+	  strcmp( line, "a," ) == 0 &&
+	  getdelim( &line, &size, ',', file ) == 3 &&
+	  strcmp( line, "bb," ) == 0 &&
+	  getdelim( &line, &size, ',', file ) == 3 &&
+	  strcmp( line, "ccc" ) == 0 &&
+	  getdelim( &line, &size, ',', file ) == EOF,
+	  "getdelim splits at its delimiter" );
+  if ( file != NULL )
+    fclose( file );
+
+  file = scratch( "", 0 );
+  expect( file != NULL && getline( &line, &size, file ) == EOF &&
+	  feof( file ), "getline returns EOF on an empty file" );
+  if ( file != NULL )
+    fclose( file );
+  file = scratch( "", 0 );
+  expect( file != NULL && fcountlines( file ) == 0,
+	  "fcountlines finds no lines in an empty file" );
+  if ( file != NULL )
+    fclose( file );
+  free( line );
+
+  long newlines = 0;
+  for ( long i = 0; i < length; i++ )
+    newlines += ( data[i] == '\n' );
+  file = fopen( SOURCE, "r" );
+  expect( file != NULL &&
+	  fcountlines( file ) == newlines + ( data[length - 1] != '\n' ),
+	  "fcountlines counts the lines of the file" );
+  if ( file != NULL )
+    fclose( file );
+}
+
+int main( ) {
+  long length;
+  char *data = slurp( SOURCE, &length );
+  if ( data == NULL || length == 0 ) {
+    printf( "check: cannot read " SOURCE "\n" );
+    return 1;
+  }
+
+  checkMmap( data, length );
+  checkFgets( data, length );
+  checkFormat( data, length );
+  checkAsync( data, length );
+  checkUring( data, length );
+  checkSeek( data, length );
+  checkCache( data, length );
+  checkCopy( data, length );
+  checkMemory( data, length );
+  checkDirect( data, length );
+  checkScan( data, length );
+  checkUpdate( data, length );
+  checkShared( data, length );
+  checkParallel( data, length );
+  checkChecksum( data, length );
+  checkZip( data, length );
+  checkPeek( data, length );
+  checkGetc( data, length );
+  checkLine( data, length );
+  checkLock( data, length );
+  checkBypass( data, length );
+  checkBuffer( data, length );
+  checkStats( data, length );
+  checkGetline( data, length );
+
+  delete [] data;
+  unlink( SCRATCH );
+  printf( "%d checks, %d failed\n", checks, failures );
+  return ( failures > 0 ) ? 1 : 0;
+}
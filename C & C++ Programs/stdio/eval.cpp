@@ -4,12 +4,21 @@
 //
 // Structs:     start
 //              end
+//              result
 //
 // Functions:   startTimer()
 //              stopTimer()
+//              nextRandom()
+//              parseSize()
+//              compareLong()
+//              printFixed()
+//              printStats()
+//              report()
 //              reads()
 //              init_data()
 //              writes()
+//              bench()
+//              corpus()
 //              main()
 //
 // Written by:  Professor Munehiro Fukuda
@@ -17,187 +26,392 @@
 //----------------------------------------------------------------------------
 #include "stdio.h"     // fopen, fread
 #include <fcntl.h>     // open
-#include <sys/time.h>  // gettimeofday
+#include <time.h>      // clock_gettime
 #include <sys/types.h> // read
 #include <sys/uio.h>   // read
 #include <unistd.h>    // read
 #include <sys/stat.h>  // fstat
-#include <stdlib.h>    // rand
+#include <stdlib.h>    // strtol, qsort
 #include <string.h>    // strncpy
 
 #define BUFSIZE 4096
 #define DATASIZE 131072
+#define CORPUSSIZE 4194304  // default size of the scaled up corpus
+#define CACHEBLOCKS 64      // blocks kept by the c iotype
+#define REPS 10             // default number of measured runs
+#define WARMUPS 2           // default number of discarded runs
+#define SEED 20110101UL     // seed of the random testcase, the same every run
 
 using namespace std;
 
-struct timeval start, end;
+// glibc's own stdio, called side by side with ours by the g iotype. Our
+// functions have C++ linkage, so the C names still reach the real ones.
+namespace libc {
+  struct FILE;
+  extern "C" {
+    FILE *fopen( const char *path, const char *mode );
+    int fclose( FILE *stream );
+    size_t fread( void *ptr, size_t size, size_t nmemb, FILE *stream );
+    size_t fwrite( const void *ptr, size_t size, size_t nmemb, FILE *stream );
+    int fgetc( FILE *stream );
+    int fputc( int c, FILE *stream );
+    char *fgets( char *str, int size, FILE *stream );
+    int fputs( const char *str, FILE *stream );
+    int fseek( FILE *stream, long offset, int whence );
+    int fflush( FILE *stream );
+  }
+}
+
+struct timespec start, end;
+
+// the parameters shared by every run
+long datasize  = DATASIZE;  // bytes written by writes, corpus size by corpus
+int  blocksize = BUFSIZE;   // bytes per block transfer
+int  reps      = REPS;      // measured runs per testcase
+int  warmups   = WARMUPS;   // discarded runs before them
+char format    = 't';       // t = text, c = csv, j = json
+int  results   = 0;         // results reported so far
+
+unsigned long seed;         // state of nextRandom( )
+
+// what the last run of a testcase left behind for report( )
+fiostats lastStats;
+bool haveStats;
+fcachestats lastCache;
+bool haveCache;
+
+//-----------------------------------------------------------------------------
+// What bench( ) measured for one testcase: times are in nanoseconds.
+//-----------------------------------------------------------------------------
+struct result {
+  char rw, iotype, testcase;
+  long bytes;       // bytes transferred by each run
+  long median;
+  long p99;
+  long min;
+};
 
 void startTimer( ) {
-  gettimeofday( &start, NULL );
+  clock_gettime( CLOCK_MONOTONIC, &start );
 }
 
-void stopTimer( char rw, char iotype, char testcase, char* filename ) {
+long stopTimer( ) {
+  clock_gettime( CLOCK_MONOTONIC, &end );
+  return ( end.tv_sec - start.tv_sec ) * 1000000000L +
+    ( end.tv_nsec - start.tv_nsec );
+}
 
-  gettimeofday( &end, NULL );
-  const char *str_rw =
-    ( rw == 'r' ) ? "Reads : " :
-    ( rw == 'w' ) ? "Writes: " : "Unknown";
+// A 64-bit LCG, so every run and every iotype sees the same random mix.
+long nextRandom( ) {
+  seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+  return (long)( seed >> 33 );
+}
 
+// Parses a size such as 4096, 64k, 16m or 1g; returns -1 if malformed.
+long parseSize( const char *arg ) {
+  char *rest;
+  long size = strtol( arg, &rest, 10 );
+  if ( *rest == 'k' || *rest == 'K' ) { size <<= 10; rest++; }
+  else if ( *rest == 'm' || *rest == 'M' ) { size <<= 20; rest++; }
+  else if ( *rest == 'g' || *rest == 'G' ) { size <<= 30; rest++; }
+  return ( rest == arg || *rest != '\0' || size <= 0 ) ? -1 : size;
+}
 
-  const char *str_iotype = 
-    ( iotype == 'u' ) ? "Unix   I/O" :
-    ( iotype == 'f' ) ? "C File I/O" : "Unknown";
+int compareLong( const void *a, const void *b ) {
+  long x = *(const long *)a, y = *(const long *)b;
+  return ( x < y ) ? -1 : ( x > y ) ? 1 : 0;
+}
+
+// Prints value / 10 with one decimal; printf has no %f.
+void printFixed( long value ) {
+  printf( "%ld.%ld", value / 10, value % 10 );
+}
+
+void printStats( fiostats &stats ) {
+  printf( "Stats : %ld reads, %ld writes, %ld seeks, %ld bytes in, "
+	  "%ld bytes out\n", stats.reads, stats.writes, stats.seeks,
+	  stats.bytesread, stats.byteswritten );
+  printf( "        %ld refills, %ld flushes, %ld bytes copied, "
+	  "%ld/%ld seek hits/misses\n", stats.refills, stats.flushes,
+	  stats.copied, stats.seekhits, stats.seekmisses );
+}
+
+void report( result &r ) {
+  const char *str_rw =
+    ( r.rw == 'r' ) ? "Reads : " :
+    ( r.rw == 'w' ) ? "Writes: " : "Unknown";
+
+  const char *str_iotype =
+    ( r.iotype == 'u' ) ? "Unix   I/O" :
+    ( r.iotype == 'f' ) ? "C File I/O" :
+    ( r.iotype == 'm' ) ? "C Mmap I/O" :
+    ( r.iotype == 'i' ) ? "C Uring I/O" :
+    ( r.iotype == 'c' ) ? "C Cache I/O" :
+    ( r.iotype == 'd' ) ? "C Direct I/O" :
+    ( r.iotype == 'p' ) ? "C Parallel I/O" :
+    ( r.iotype == 'g' ) ? "Glibc  I/O" : "Unknown";
 
   const char *str_testcase =
-    ( testcase == 'a' ) ? "Read   once     ":
-    ( testcase == 'b' ) ? "Block  transfers" :
-    ( testcase == 'c' ) ? "Char   transfers"  :
-    ( testcase == 'r' ) ? "Random transfers" : "Unknown";
-
-  printf( str_rw );
-  printf( str_iotype );
-  printf( " [" );
-  printf( str_testcase );
-  printf( "] = %d\n",
-	  ( end.tv_sec - start.tv_sec ) * 1000000 + 
-	  (end.tv_usec - start.tv_usec ) );
+    ( r.testcase == 'a' ) ? "Once            ":
+    ( r.testcase == 'b' ) ? "Block  transfers" :
+    ( r.testcase == 'c' ) ? "Char   transfers"  :
+    ( r.testcase == 'r' ) ? "Random transfers" : "Unknown";
+
+  // MB/s at the median, in tenths: bytes * 1000 / ns is MB/s
+  long mbps = ( r.median > 0 ) ? r.bytes * 10000 / r.median : 0;
+
+  if ( format == 'c' ) {
+    if ( results == 0 )
+      printf( "rw,iotype,testcase,bytes,block,runs,median_ns,p99_ns,"
+	      "min_ns,mbps\n" );
+    printf( "%c,%c,%c,%ld,%d,%d,%ld,%ld,%ld,", r.rw, r.iotype, r.testcase,
+	    r.bytes, blocksize, reps, r.median, r.p99, r.min );
+    printFixed( mbps );
+    printf( "\n" );
+  }
+  else if ( format == 'j' ) {
+    printf( ( results == 0 ) ? "[\n" : ",\n" );
+    printf( "  {\"rw\": \"%c\", \"iotype\": \"%c\", \"testcase\": \"%c\", "
+	    "\"bytes\": %ld, \"block\": %d, \"runs\": %d, \"median_ns\": %ld, "
+	    "\"p99_ns\": %ld, \"min_ns\": %ld, \"mbps\": ", r.rw, r.iotype,
+	    r.testcase, r.bytes, blocksize, reps, r.median, r.p99, r.min );
+    printFixed( mbps );
+    printf( "}" );
+  }
+  else {
+    printf( str_rw );
+    printf( str_iotype );
+    printf( " [" );
+    printf( str_testcase );
+    printf( "] median " );
+    printFixed( r.median / 100 );
+    printf( " us, p99 " );
+    printFixed( r.p99 / 100 );
+    printf( " us, " );
+    printFixed( mbps );
+    printf( " MB/s (%d runs)\n", reps );
+    if ( haveStats )
+      printStats( lastStats );
+    if ( haveCache )
+      printf( "Cache : %ld hits, %ld misses, %d%% hit rate\n",
+	      lastCache.hits, lastCache.misses,
+	      (int)( lastCache.hitrate * 100 ) );
+  }
+  results++;
 }
 
-void reads( char iotype, char testcase, char *filename ) {
+// Times one run of a read testcase over the whole file; returns the time in
+// nanoseconds, or -1 if filename cannot be opened. *ran receives the iotype
+// that actually ran, which differs if a mapping or ring could not be set up.
+long reads( char iotype, char testcase, char *filename, char *ran ) {
   int fd = open( filename, O_RDONLY );
   if ( fd == -1 ) {
     printf( "filename(" );
     printf( filename );
     printf( ") not found\n" );
-    return;
+    return -1;
   }
-  FILE *file = ( iotype == 'f' ) ? fopen( filename, "r" ) : NULL;
+  FILE *file = ( iotype == 'f' ) ? fopen( filename, "r" ) :
+               ( iotype == 'm' ) ? fopen( filename, "rm" ) :
+               ( iotype == 'i' ) ? fopen( filename, "ru" ) :
+               ( iotype == 'c' ) ? fopen( filename, "r" ) :
+               ( iotype == 'd' ) ? fopen( filename, "rd" ) :
+               ( iotype == 'p' ) ? fopen( filename, "r" ) : NULL;
+  libc::FILE *cfile = ( iotype == 'g' ) ? libc::fopen( filename, "r" ) : NULL;
+  if ( iotype == 'c' ) setcache( file, CACHEBLOCKS );
+  *ran = ( file != NULL && file->map != NULL ) ? 'm' :
+         ( file != NULL && file->ring != NULL ) ? 'i' :
+         ( file != NULL && file->cache != NULL ) ? 'c' :
+         ( file != NULL && file->direct != 0 ) ? 'd' :
+         ( file != NULL && iotype != 'p' ) ? 'f' : iotype;
+  bool parallel = ( iotype == 'p' ); // fread_parallel for testcase a
+  if ( iotype == 'm' || iotype == 'i' || iotype == 'c' || iotype == 'd' ||
+       iotype == 'p' )
+    iotype = 'f';
 
-  char buffer[BUFSIZE];
+  struct stat fileStat;
+  fstat( fd, &fileStat );
+  char *wholeData = ( testcase == 'a' ) ? new char[fileStat.st_size + 1] : NULL;
+  char *buffer = new char[( blocksize > 80 ) ? blocksize : 80];
+  seed = SEED;
 
   startTimer( );
 
   if ( testcase == 'a' ) {
-    struct stat fileStat;
-    if ( fstat( fd, &fileStat ) >= 0 ) {
-      char wholeData[ fileStat.st_size ];
-      if ( iotype == 'u' ) read( fd, wholeData, fileStat.st_size );
-      if ( iotype == 'f' ) 
+    if ( iotype == 'u' ) read( fd, wholeData, fileStat.st_size );
+    if ( iotype == 'f' && parallel )
+      fread_parallel( wholeData, fileStat.st_size, file, 0 );
+    else if ( iotype == 'f' )
       fread( wholeData, sizeof( char ), fileStat.st_size, file );
-    }
+    if ( iotype == 'g' )
+      libc::fread( wholeData, sizeof( char ), fileStat.st_size, cfile );
   }
   else if ( testcase == 'b' ) {
-    if ( iotype == 'u' ) while ( read( fd, buffer, BUFSIZE ) > 0 );
-    if ( iotype == 'f' ) 
-      while ( fread( buffer, sizeof( char ), BUFSIZE, file ) > 0 );
+    if ( iotype == 'u' ) while ( read( fd, buffer, blocksize ) > 0 );
+    if ( iotype == 'f' )
+      while ( fread( buffer, sizeof( char ), blocksize, file ) > 0 );
+    if ( iotype == 'g' )
+      while ( libc::fread( buffer, sizeof( char ), blocksize, cfile ) > 0 );
   }
   else if ( testcase == 'c' ) {
     if ( iotype == 'u' ) while ( read( fd, buffer, 1 ) > 0 );
     if ( iotype == 'f' ) while ( fgetc( file ) != EOF );
+    if ( iotype == 'g' ) while ( libc::fgetc( cfile ) != EOF );
   }
   else if ( testcase ==  'r' ) {
     while ( true ) {
-      int retval = -1; char *retstr = (char *)-1;
-      switch( rand( ) % 3 ) {
+      int retval = -1; char *retstr = (char *)-1; long hop = 0;
+      switch( nextRandom( ) % 4 ) {
       case 0: // char
 	if ( iotype == 'u' ) retval = read( fd, buffer, 1 );
 	if ( iotype == 'f' ) retval = fgetc( file );
+	if ( iotype == 'g' ) retval = libc::fgetc( cfile );
 	break;
       case 1: // line
 	if ( iotype == 'u' ) retval = read( fd, buffer, 80 );
 	if ( iotype == 'f' ) retstr = fgets( buffer, 80, file );
+	if ( iotype == 'g' ) retstr = libc::fgets( buffer, 80, cfile );
 	break;
       case 2: // block
-	if ( iotype == 'u' ) retval = read( fd, buffer, BUFSIZE );
-	if ( iotype == 'f' ) 
-	  retval = fread( buffer, sizeof( char ), BUFSIZE, file );
+	if ( iotype == 'u' ) retval = read( fd, buffer, blocksize );
+	if ( iotype == 'f' )
+	  retval = fread( buffer, sizeof( char ), blocksize, file );
+	if ( iotype == 'g' )
+	  retval = libc::fread( buffer, sizeof( char ), blocksize, cfile );
+	break;
+      case 3: // short hop, mostly forward
+	hop = nextRandom( ) % 384 - 128;
+	retval = 1; // a hop past the end shows up as EOF on the next read
+	if ( iotype == 'u' ) lseek( fd, hop, SEEK_CUR );
+	if ( iotype == 'f' ) fseek( file, hop, SEEK_CUR );
+	if ( iotype == 'g' ) libc::fseek( cfile, hop, SEEK_CUR );
 	break;
       }
       if ( iotype == 'u' && retval <= 0 ) break;
-      if ( iotype == 'f' && ( retval == 0 || retstr == NULL ) ) break;
+      if ( iotype != 'u' && ( retval == 0 || retstr == NULL ) ) break;
     }
   }
-  else {
-    printf( "testcase not supported" );
-  }
 
-  stopTimer( 'r', iotype, testcase, filename );
+  long elapsed = stopTimer( );
 
-  if ( iotype == 'u' ) close( fd );
+  haveStats = ( file != NULL && fstats( file, &lastStats ) == 0 );
+  haveCache = ( file != NULL && fcachestat( file, &lastCache ) == 0 );
+
+  delete [] wholeData;
+  delete [] buffer;
+  close( fd );
   if ( iotype == 'f' ) fclose( file );
+  if ( iotype == 'g' ) libc::fclose( cfile );
+  return elapsed;
 }
 
-const char *contents = 
+const char *contents =
 "abcdefghijklmnopqrstuvwxyz1234567890~!@#$%^&*()-+={}|:;',./?ABC\n\0";
 
-char *init_data( ) {
-  char *data = new char[DATASIZE];
-  for ( int i = 0; i < DATASIZE; i += 64 )  // 2048 repetitions
-    strncpy( data + i, contents, 64 );
+// Returns datasize bytes to write: contents repeated, or the file source
+// repeated if there is one.
+char *init_data( const char *source ) {
+  char *data = new char[datasize];
+  FILE *file = ( source != NULL ) ? fopen( source, "r" ) : NULL;
+  long length = 0;
+  if ( file != NULL ) {
+    length = fread( data, sizeof( char ), datasize, file );
+    fclose( file );
+  }
+  if ( length == 0 ) {
+    strncpy( data, contents, ( datasize < 64 ) ? datasize : 64 );
+    length = ( datasize < 64 ) ? datasize : 64;
+  }
+  for ( long i = length; i < datasize; i += length )
+    memcpy( data + i, data, ( datasize - i < length ) ? datasize - i : length );
 
   return data;
 }
 
-void writes( char iotype, char testcase, char *filename ) {
-  int fd = ( iotype == 'u' ) ? 
-    open( filename, O_WRONLY | O_CREAT | O_TRUNC, 
+// Times one run of a write testcase of datasize bytes of data, up to and
+// including the final fflush; returns the time in nanoseconds, or -1 if
+// filename cannot be written. *ran is set as by reads( ).
+long writes( char iotype, char testcase, char *filename, char *ran,
+	     char *buffer ) {
+  int fd = ( iotype == 'u' ) ?
+    open( filename, O_WRONLY | O_CREAT | O_TRUNC,
 	  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH ) : -1;
-  FILE *file = ( iotype == 'f' ) ? fopen( filename, "w" ) : NULL;
-  char *buffer = init_data( );
+  FILE *file = ( iotype == 'f' ) ? fopen( filename, "w" ) :
+               ( iotype == 'i' ) ? fopen( filename, "wu" ) :
+               ( iotype == 'd' ) ? fopen( filename, "wd" ) : NULL;
+  libc::FILE *cfile = ( iotype == 'g' ) ? libc::fopen( filename, "w" ) : NULL;
+  *ran = ( file != NULL && file->ring != NULL ) ? 'i' :
+         ( file != NULL && file->direct != 0 ) ? 'd' :
+         ( file != NULL ) ? 'f' : iotype;
+  if ( iotype == 'i' || iotype == 'd' )
+    iotype = 'f'; // same calls, flushed through io_uring or O_DIRECT
 
-  if ( iotype == 'u' && fd == -1 || iotype == 'f' && file == NULL ) {
+  if ( ( iotype == 'u' && fd == -1 ) || ( iotype == 'f' && file == NULL ) ||
+       ( iotype == 'g' && cfile == NULL ) ) {
     printf( "filename(" );
     printf( filename );
     printf( "): write protected\n" );
-    return;
+    return -1;
   }
+  seed = SEED;
 
   startTimer( );
 
   switch( testcase ) {
   case 'a': // write once
-    if ( iotype == 'u' ) write( fd, buffer, DATASIZE );
-    if ( iotype == 'f' ) 
-      fwrite( buffer, sizeof( char ), DATASIZE, file );
+    if ( iotype == 'u' ) write( fd, buffer, datasize );
+    if ( iotype == 'f' )
+      fwrite( buffer, sizeof( char ), datasize, file );
+    if ( iotype == 'g' )
+      libc::fwrite( buffer, sizeof( char ), datasize, cfile );
     break;
   case 'b': // block writes
-    for ( int i = 0; i < DATASIZE; i += BUFSIZE ) { // 32 repetitions
+    for ( long i = 0; i < datasize; i += blocksize ) {
+      int size = ( datasize - i >= blocksize ) ? blocksize : datasize - i;
       if ( iotype == 'u' )
-	write( fd, buffer + i, BUFSIZE );
+	write( fd, buffer + i, size );
       if ( iotype == 'f' )
-	fwrite( buffer + i, sizeof( char ), BUFSIZE, file );
+	fwrite( buffer + i, sizeof( char ), size, file );
+      if ( iotype == 'g' )
+	libc::fwrite( buffer + i, sizeof( char ), size, cfile );
     }
     break;
   case 'c': // char writes
-    for ( int i = 0; i < DATASIZE; i ++ ) { // DATASIZE repetition
+    for ( long i = 0; i < datasize; i ++ ) { // datasize repetitions
       if ( iotype == 'u' ) write( fd, buffer + i, 1 );
       if ( iotype == 'f' ) fputc( buffer[i], file );
+      if ( iotype == 'g' ) libc::fputc( buffer[i], cfile );
     }
     break;
   case 'r':
-    int j;
+    long j;
     j = 0;
     int size;
-    while ( j < DATASIZE ) {
-      switch( rand( ) % 3 ) {
+    while ( j < datasize ) {
+      switch( nextRandom( ) % 3 ) {
       case 0: // char
-	for ( int k = 0; k < 64; k++ ) {
+	size = ( datasize - j >= 64 ) ? 64 : datasize - j;
+	for ( int k = 0; k < size; k++ ) {
 	  if ( iotype == 'u' ) write( fd, buffer + j + k, 1 );
 	  if ( iotype == 'f' ) fputc( buffer[j + k], file );
+	  if ( iotype == 'g' ) libc::fputc( buffer[j + k], cfile );
 	}
-	j += 64;
+	j += size;
 	break;
       case 1: // line
-	size = ( DATASIZE - j >= 64 ) ? 64 : DATASIZE - j;
+	size = ( datasize - j >= 64 ) ? 64 : datasize - j;
 	if ( iotype == 'u' ) write( fd, buffer + j, size );
 	if ( iotype == 'f' ) fputs( contents, file );
+	if ( iotype == 'g' ) libc::fputs( contents, cfile );
 	j += size;
 	break;
       case 2: // block
-	size = ( DATASIZE - j >= BUFSIZE ) ? BUFSIZE : DATASIZE - j;
+	size = ( datasize - j >= blocksize ) ? blocksize : datasize - j;
 	if ( iotype == 'u' ) write( fd, buffer + j, size );
-	if ( iotype == 'f' ) 
+	if ( iotype == 'f' )
 	  fwrite( buffer + j, sizeof( char ), size, file );
+	if ( iotype == 'g' )
+	  libc::fwrite( buffer + j, sizeof( char ), size, cfile );
 	j += size;
 	break;
      default:
@@ -205,50 +419,173 @@ void writes( char iotype, char testcase, char *filename ) {
       }
     }
     break;
-  default:
-    printf( "testcase not supported\n" );
-    break;
   }
 
   if ( iotype == 'f' ) fflush( file );
+  if ( iotype == 'g' ) libc::fflush( cfile );
+
+  long elapsed = stopTimer( );
 
-  stopTimer( 'w', iotype, testcase, filename );
+  haveStats = ( file != NULL && fstats( file, &lastStats ) == 0 );
+  haveCache = false;
 
   if ( iotype == 'u' ) close( fd );
   if ( iotype == 'f' ) fclose( file );
+  if ( iotype == 'g' ) libc::fclose( cfile );
+  return elapsed;
+}
+
+// Runs warmups discarded runs and reps measured runs of one testcase and
+// reports the median, p99 and throughput; returns false if a run failed.
+// source, if not NULL, is what writes write instead of contents.
+bool bench( char rw, char iotype, char testcase, char *filename,
+	    const char *source ) {
+  if ( testcase != 'a' && testcase != 'b' && testcase != 'c' &&
+       testcase != 'r' ) {
+    printf( "testcase not supported\n" );
+    return false;
+  }
+  char *data = ( rw == 'w' ) ? init_data( source ) : NULL;
+  long *samples = new long[reps];
+  result r;
+  r.rw = rw;
+  r.testcase = testcase;
+  r.bytes = datasize;
+  if ( rw == 'r' ) {
+    struct stat fileStat;
+    r.bytes = ( stat( filename, &fileStat ) == 0 ) ? fileStat.st_size : 0;
+  }
+
+  bool ok = true;
+  for ( int i = -warmups; i < reps && ok; i++ ) {
+    long elapsed = ( rw == 'r' ) ?
+      reads( iotype, testcase, filename, &r.iotype ) :
+      writes( iotype, testcase, filename, &r.iotype, data );
+    ok = ( elapsed >= 0 );
+    if ( i >= 0 )
+      samples[i] = elapsed;
+  }
+  if ( ok ) {
+    qsort( samples, reps, sizeof( long ), compareLong );
+    r.median = ( reps % 2 == 1 ) ? samples[reps / 2] :
+      ( samples[reps / 2 - 1] + samples[reps / 2] ) / 2;
+    r.p99 = samples[( reps * 99 + 99 ) / 100 - 1];  // nearest rank
+    r.min = samples[0];
+    report( r );
+  }
+
+  delete [] samples;
+  delete [] data;
+  return ok;
+}
+
+// Scales source up to a corpus of datasize bytes in filename and runs every
+// testcase of every iotype over it, reads first, then writes of the same
+// text to filename. filename is removed afterwards.
+void corpus( char *source, char *filename ) {
+  char *data = init_data( source );
+  FILE *file = fopen( filename, "w" );
+  if ( file == NULL ) {
+    printf( "filename(" );
+    printf( filename );
+    printf( "): write protected\n" );
+    delete [] data;
+    return;
+  }
+  fwrite( data, sizeof( char ), datasize, file );
+  fclose( file );
+  delete [] data;
+
+  const char *readtypes = "ufmicdpg", *writetypes = "ufidg";
+  const char *testcases = "abcr";
+  bool ok = true;
+  for ( const char *t = readtypes; *t != '\0' && ok; t++ )
+    for ( const char *c = testcases; *c != '\0' && ok; c++ )
+      ok = bench( 'r', *t, *c, filename, NULL );
+  for ( const char *t = writetypes; *t != '\0' && ok; t++ )
+    for ( const char *c = testcases; *c != '\0' && ok; c++ )
+      ok = bench( 'w', *t, *c, filename, source );
+
+  unlink( filename );
 }
 
 int main( int argc, char *argv[] ) {
 
   // argument verification
-  if ( argc != 5 ) {
-    printf( "usage: eval r/w u|f a|b|c|r filename, where:\n" );
-    printf( "r = read,     w = write\n" );
-    printf( "u = unix i/o, f = c file i/o\n" );
-    printf( "a = at once,  b = 4096B block,  c = 1B char,  r = random\n" );
-      
-    return -1;
+  bool isCorpus = ( argc >= 4 && strcmp( argv[1], "corpus" ) == 0 );
+  int first = isCorpus ? 4 : 5;  // the first option
+  bool ok = ( argc >= first && ( argc - first ) % 2 == 0 );
+  if ( isCorpus ) datasize = CORPUSSIZE;
+  for ( int i = first; ok && i < argc; i += 2 ) {
+    char option = ( argv[i][0] == '-' ) ? argv[i][1] : '\0';
+    long value = ( option == 'o' ) ? 0 : parseSize( argv[i + 1] );
+    if ( option == 's' && value > 0 ) datasize = value;
+    else if ( option == 'b' && value > 0 && value < ( 1L << 30 ) )
+      blocksize = value;
+    else if ( option == 'n' && value > 0 && value < ( 1L << 20 ) )
+      reps = value;
+    else if ( option == 'w' && value > 0 && value < ( 1L << 20 ) )
+      warmups = value;
+    else if ( option == 'w' && strcmp( argv[i + 1], "0" ) == 0 )
+      warmups = 0;
+    else if ( option == 'o' && ( strcmp( argv[i + 1], "text" ) == 0 ||
+				 strcmp( argv[i + 1], "csv" ) == 0 ||
+				 strcmp( argv[i + 1], "json" ) == 0 ) )
+      format = argv[i + 1][0];
+    else
+      ok = false;
   }
-  char  rw        = argv[1][0];
-  char  iotype    = argv[2][0];
-  char  testcase  = argv[3][0];
-  char *filename  = argv[4];
+  if ( !ok ) {
+    printf( "usage: eval r/w u|f|m|i|c|d|p|g a|b|c|r filename [options]\n" );
+    printf( "       eval corpus source filename [options], where:\n" );
+    printf( "r = read,     w = write\n" );
+    printf( "u = unix i/o, f = c file i/o, m = mmap c file i/o (reads only)\n" );
+    printf( "i = io_uring c file i/o, c = block cached c file i/o (reads only)\n" );
+    printf( "d = O_DIRECT c file i/o, g = glibc's own c file i/o\n" );
+    printf( "p = c file i/o reading at once with parallel preads "
+	    "(reads only)\n" );
+    printf( "a = at once,  b = block,  c = 1B char,  r = random\n" );
+    printf( "corpus = every testcase over source (e.g. hamlet.txt) scaled\n" );
+    printf( "         up in filename, which is removed afterwards\n" );
+    printf( "options: -s size    bytes written, or the corpus size "
+	    "(default %d, corpus %d)\n", DATASIZE, CORPUSSIZE );
+    printf( "         -b size    block size (default %d)\n", BUFSIZE );
+    printf( "         -n runs    measured runs (default %d)\n", REPS );
+    printf( "         -w runs    discarded warmup runs (default %d)\n",
+	    WARMUPS );
+    printf( "         -o format  text, csv or json (default text)\n" );
+    printf( "sizes take a k, m or g suffix\n" );
 
-  if ( iotype != 'u' && iotype != 'f' ) {
-    printf( "iotype(" );
-    printf( argv[2] );
-    printf( "): not supported\n" );
     return -1;
   }
 
-  if ( rw == 'r' )
-    reads( iotype, testcase, filename );
-  else if ( rw == 'w' )
-    writes( iotype, testcase, filename );
+  if ( isCorpus )
+    corpus( argv[2], argv[3] );
   else {
-    printf( "rw(" );
-    printf( argv[1] );
-    printf( "): not supported\n" );
+    char  rw        = argv[1][0];
+    char  iotype    = argv[2][0];
+    char  testcase  = argv[3][0];
+    char *filename  = argv[4];
+
+    if ( iotype != 'u' && iotype != 'f' && iotype != 'i' && iotype != 'g' &&
+	 iotype != 'd' &&
+	 ( ( iotype != 'm' && iotype != 'c' && iotype != 'p' ) || rw != 'r' ) ) {
+      printf( "iotype(" );
+      printf( argv[2] );
+      printf( "): not supported\n" );
+      return -1;
+    }
+
+    if ( rw != 'r' && rw != 'w' ) {
+      printf( "rw(" );
+      printf( argv[1] );
+      printf( "): not supported\n" );
+      return -1;
+    }
+    if ( !bench( rw, iotype, testcase, filename, NULL ) )
+      return -1;
   }
+  if ( format == 'j' && results > 0 )
+    printf( "\n]\n" );
   return 0;
 }
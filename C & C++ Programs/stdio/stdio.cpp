@@ -2,26 +2,160 @@
 // File:        stdio.cpp
 // Classes:     FILE
 //
-// Methods:     recursive_itoa()
-//              itoa()
+// Methods:     fmtflush()
+//              fmtputs()
+//              utoa()
+//              vformat()
+//              vsnprintf()
+//              snprintf()
+//              vfprintf()
+//              fprintf()
 //              printf()
 //              setvbuf()
+//              fstdopen()
+//              fstdflush()
 //              setbuf()
 //              fopen()
+//              mapwindow()
+//              frefill()
+//              freadahead()
 //              fpurge()
+//              fwritebuf()
+//              fflush_unlocked()
 //              fflush()
+//              fbypass()
+//              freadv()
+//              fwritev()
+//              fread_unlocked()
 //              fread()
+//              fpeek_unlocked()
+//              fpeek()
+//              fadvance_unlocked()
+//              fadvance()
+//              fwrite_unlocked()
 //              fwrite()
+//              _filbuf()
+//              _flsbuf()
+//              fgetc_unlocked()
 //              fgetc()
+//              fputc_unlocked()
 //              fputc()
+//              fgets_unlocked()
 //              fgets()
+//              getdelim()
+//              getline()
+//              fcountlines()
+//              fputs_unlocked()
 //              fputs()
 //              feof()
+//              flseek()
 //              fseek()
+//              ftell_unlocked()
+//              ftell()
+//              fgetpos()
+//              fsetpos()
 //              fclose()
+//              fthreadself()
+//              ftrylockfile()
+//              flockfile()
+//              funlockfile()
+//              fasyncwriter()
+//              fasyncsubmit()
+//              fasyncwait()
+//              fasyncfree()
+//              fasyncstop()
+//              setasync()
+//              furingfree()
+//              furingkey()
+//              furingget()
+//              furingreap()
+//              furingenter()
+//              furingqueue()
+//              furingwait()
+//              furingattach()
+//              furingdetach()
+//              furingsettle()
+//              furingread()
+//              furingwrite()
+//              furingdrop()
+//              fcachebucket()
+//              fcachetouch()
+//              fcacheunlink()
+//              fcachewindow()
+//              fcacheseek()
+//              fcachestop()
+//              fcachealloc()
+//              fcachefree()
+//              setcache()
+//              fcachestat()
+//              fbufalloc()
+//              fbuffree()
+//              fbufsize()
+//              fresize()
+//              fadaptive()
+//              fgrow()
+//              fshrink()
+//              fbufstat()
+//              fstatsadd()
+//              fstats()
+//              fcopykernel()
+//              fcopy()
+//              fmemread()
+//              fmemwrite()
+//              fmemseek()
+//              fmemclose()
+//              fmemstream()
+//              fmemopen()
+//              open_memstream()
+//              fdirectblock()
+//              fdirectread()
+//              fdirectwrite()
+//              fisspace()
+//              fdigit()
+//              fskipspace()
+//              fscanint()
+//              fscandouble()
+//              fread_int()
+//              fread_double()
+//              vfscanf()
+//              fscanf()
+//              scanf()
+//              fupdateturn()
+//              fupdateflush()
+//              fsharevictim()
+//              fsharewindow()
+//              fshareclose()
+//              fsharestat()
+//              fopen_shared()
+//              freadchunk()
+//              fread_parallel()
+//              fnextline()
+//              fsplitlines()
+//              fcrc32cinit()
+//              fcrc32csoft()
+//              fcrc32chard()
+//              fcrc32c()
+//              fcrcwindow()
+//              setchecksum()
+//              fchecksum()
+//              fclose_checksum()
+//              fclose_verify()
+//              fzipput()
+//              fzipget()
+//              fzipsequence()
+//              fzipencode()
+//              fzipdecode()
+//              fzipbytes()
+//              fzipheader()
+//              fzipindex()
+//              fzipwalk()
+//              fzipread()
+//              fzipwrite()
+//              fzipseek()
+//              fzipopen()
+//              fzipfree()
 //
-// Written by:  Professor Munehiro Fukuda (recursive_itoa, itoa, printf, fopen,
-//                                          setvbuf, setbuf)
+// Written by:  Professor Munehiro Fukuda (printf, fopen, setvbuf, setbuf)
 //
 //              Daniel Hanks (fpurge, fflush, fread, fwrite, fgetc, fputc,
 //                            fgets, fputs, feof, fseek, fclose)
@@ -30,50 +164,497 @@
 //----------------------------------------------------------------------------
 #include <fcntl.h>     // open
 #include <sys/types.h> // read
-#include <sys/uio.h>   // read
+#include <sys/uio.h>   // readv, writev, preadv, pwritev
+#include <sys/stat.h>  // fstat
+#include <sys/mman.h>  // mmap, munmap, madvise
+#include <sys/sendfile.h> // sendfile
+#include <sys/syscall.h> // syscall
+#include <linux/futex.h> // FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE
+#include <sys/single_threaded.h> // __libc_single_threaded
+#include <pthread.h>   // pthread_create, pthread_mutex_lock, pthread_cond_wait
+#include <linux/io_uring.h> // io_uring_params, io_uring_sqe, io_uring_cqe
 #include <unistd.h>    // read, close
-#include <strings.h>   // bcopy
 #include <string.h>    // strlen
 #include <stdarg.h>    // format, ...
-#include <stdlib.h>    // abs
+#include <stdlib.h>    // realloc, posix_memalign
 #include <cstddef>     // std
 #include <errno.h>     // errno
+#include <limits.h>    // LONG_MAX, ULLONG_MAX
 
 using namespace std;
 
-char decimal[100];
 const char CR_LF = '\n';
 const char NULL_CHAR = '\0';
 const int THRESHHOLD = 105;
+const int RARUN = 2;       // sequential refills before reading ahead
+const int RABUFFERS = 32;  // buffers' worth of data to keep read ahead
+const int BUFMAX = 1 << 22;   // the largest buffer a stream grows to
+const int HUGEPAGE = 1 << 21; // buffers this large are huge page backed
+
+fiostats closedStats;      // the counters of every stream closed so far
+const char FOPEN_OPTIONS[] = "mudz"; // option letters accepted after a mode
+const unsigned URENTRIES = 64; // submission queue entries of each io_uring
+const unsigned URBATCH = 16;   // queued writes that force a submission
+const long COPYMAX = 1L << 30; // the most bytes one kernel copy is asked for
+const int DIRECTALIGN = 4096;  // the O_DIRECT alignment of buffers and offsets
+const int DIRECTBUF = 1 << 21; // the buffer of an O_DIRECT stream, >= HUGEPAGE
+const int FLOATMAX = 127;      // the longest floating point number scanned
+const int SHAREBLOCK = 1 << 17; // the cache blocks of a shared file
+const int SHAREBLOCKS = 64;    // the cache blocks of a shared file by default
+const long PARALLELMIN = 1L << 20; // the fewest bytes a reading thread is given
+const int PARALLELMAX = 64;    // the most threads fread_parallel starts
+const int SPLITWINDOW = 1 << 16; // bytes searched at a time for a line start
+const unsigned CRC32CPOLY = 0x82F63B78; // the Castagnoli polynomial, reflected
+const int ZIPBLOCK = 1 << 17;  // the uncompressed bytes of one frame at most
+const int ZIPHEADER = 8;       // a frame's uncompressed and compressed lengths
+const int ZIPREAD = 2 * (ZIPBLOCK + ZIPHEADER); // compressed bytes read at once
+const int ZIPHASHBITS = 14;    // log2 of the compressor's hash table size
+const int ZIPMINMATCH = 4;     // the shortest match worth encoding
+const int ZIPWINDOW = 65535;   // the farthest back a match may start
 
 int fgetc( FILE *stream );
+int fflush( FILE *stream );
+size_t fwrite_unlocked( const void *ptr, size_t size, size_t nmemb,
+    FILE *stream );
+int mapwindow( FILE *stream, long offset );
+void freadahead( FILE *stream, int bytesRead );
+int fwritebuf( FILE *stream );
+int fasyncsubmit( FILE *stream );
+int fasyncwait( FILE *stream );
+int fasyncstop( FILE *stream );
+bool furingattach( FILE *stream );
+void furingdetach( FILE *stream );
+int furingread( FILE *stream );
+int furingwrite( FILE *stream );
+int furingdrop( FILE *stream );
+int fcachewindow( FILE *stream, long offset );
+int fcacheseek( FILE *stream, long offset, int whence );
+void fcachestop( FILE *stream );
+void fcachefree( fcache *cache );
+long ftell_unlocked( FILE *stream );
+off_t flseek( FILE *stream, off_t offset, int whence );
+bool fbypass( FILE *stream );
+char *fbufalloc( int size );
+void fbuffree( char *buffer, int size );
+void fbufsize( FILE *stream );
+void fgrow( FILE *stream, bool full );
+void fshrink( FILE *stream );
+void fstatsadd( fiostats *to, const fiostats *from );
+long fmemread( FILE *stream, char *ptr, long length );
+long fmemwrite( FILE *stream, const char *ptr, long length );
+off_t fmemseek( FILE *stream, off_t offset, int whence );
+int fmemclose( FILE *stream );
+int fdirectread( FILE *stream );
+int fdirectwrite( FILE *stream );
+void fupdateturn( FILE *stream, char op );
+int fupdateflush( FILE *stream );
+int fsharewindow( FILE *stream, long offset );
+int fshareclose( FILE *stream );
+int fsharestat( FILE *stream, struct fcachestats *out );
+unsigned fcrc32c( unsigned crc, const char *data, size_t length );
+void fcrcwindow( FILE *stream );
+bool fzipopen( FILE *stream );
+int fzipread( FILE *stream );
+int fzipwrite( FILE *stream );
+int fzipseek( FILE *stream, long offset, int whence );
+void fzipfree( fzip *zip );
 int fseek( FILE *stream, long offset, int whence );
 int fputc( int c, FILE *stream );
 
 
-int recursive_itoa( int arg ) {
-  int div = arg / 10;
-  int mod = arg % 10;
-  int index = 0; //Test
-  if ( div > 0 )
-    index = recursive_itoa( div );
-  decimal[index] = mod + '0';
-  return ++index;
+//-----------------------------------------------------------------------------
+// Struct:        fmtout
+//
+// Description:   The destination of the formatting engine: a fixed chunk of
+//                characters, usually on the caller's stack, that is handed to
+//                a FILE (fprintf, printf) each time it fills up, or simply
+//                truncated (snprintf).
+//-----------------------------------------------------------------------------
+struct fmtout {
+  char *buf;       // the chunk being filled
+  size_t len;      // the number of characters in the chunk
+  size_t cap;      // the size of the chunk
+  FILE *stream;    // receives each full chunk, or NULL
+  size_t total;    // the number of characters produced so far
+  bool failed;     // true once passing a chunk on has failed
+};
+
+// "00" "01" ... "99", so integers are converted two digits per division
+const char DIGIT_PAIRS[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536"
+  "37383940414243444546474849505152535455565758596061626364656667686970717273"
+  "7475767778798081828384858687888990919293949596979899";
+const int NUMBUFSIZ = 24; // digits of the largest 64-bit value, with room
+
+//-----------------------------------------------------------------------------
+// fmtflush
+// Passes the characters collected in out->buf on to its FILE and empties the
+// chunk. A snprintf target is left untouched.
+//
+// @pre:   None
+// @post:  out->len is 0 unless out has no FILE
+// @param  out:       The formatting destination
+//-----------------------------------------------------------------------------
+void fmtflush( fmtout *out ) {
+  if(out->len == 0 || out->stream == NULL) {
+    return;
+  }
+  if(fwrite_unlocked(out->buf, sizeof(char), out->len, out->stream) != out->len) {
+    out->failed = true;
+  }
+  out->len = 0;
+}
+
+//-----------------------------------------------------------------------------
+// fmtputs
+// Appends n characters of str (or n copies of str[0] when repeat is true) to
+// out, flushing each time the chunk fills up
+//
+// @pre:   str holds n characters, or one when repeat is true
+// @post:  The characters are in out->buf or have been passed on
+// @param  out:       The formatting destination
+// @param  str:       The characters to append
+// @param  n:         The number of characters to append
+// @param  repeat:    true to append str[0] n times
+//-----------------------------------------------------------------------------
+void fmtputs( fmtout *out, const char *str, size_t n, bool repeat = false ) {
+  out->total += n;
+  while(n > 0) {
+    if(out->len == out->cap) {
+      if(out->stream == NULL) {
+        return;
+      }
+      fmtflush(out);
+    }
+    size_t chunk = out->cap - out->len;
+    if(n < chunk) {
+      chunk = n;
+    }
+    if(repeat) {
+      memset(&out->buf[out->len], str[0], chunk);
+    }
+    else {
+      memcpy(&out->buf[out->len], str, chunk);
+      str += chunk;
+    }
+    out->len += chunk;
+    n -= chunk;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// utoa
+// Converts value to text backwards from *end, two decimal digits at a time
+// through DIGIT_PAIRS, or one hex digit at a time
+//
+// @pre:   end points one past a buffer of at least NUMBUFSIZ characters
+// @post:  The digits of value end just before *end
+// @param  value:     The number to convert
+// @param  end:       One past the last character to fill
+// @param  base:      10 or 16
+// @param  upper:     true for upper case hex digits
+// @returns:          A pointer to the first digit
+//-----------------------------------------------------------------------------
+char *utoa( unsigned long long value, char *end, int base, bool upper ) {
+  char *p = end;
+  if(base == 16) {
+    const char *hex = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    do {
+      *--p = hex[value & 0xf];
+      value >>= 4;
+    } while(value != 0);
+    return p;
+  }
+  while(value >= 100) {
+    const char *pair = &DIGIT_PAIRS[(value % 100) * 2];
+    value /= 100;
+    *--p = pair[1];
+    *--p = pair[0];
+  }
+  if(value >= 10) {
+    *--p = DIGIT_PAIRS[value * 2 + 1];
+    *--p = DIGIT_PAIRS[value * 2];
+  }
+  else {
+    *--p = '0' + value;
+  }
+  return p;
+}
+
+//-----------------------------------------------------------------------------
+// vformat
+// The formatting engine behind printf, fprintf and snprintf. Supports the
+// conversions %d %i %u %x %X %c %s %p and %%, the flags - 0 + and space, a
+// width and a precision (either may be *), and the length modifiers hh, h, l,
+// ll and z: hh and h convert the int argument to a char or a short, and z
+// takes a size_t (ssize_t for %d). Numbers are converted on the stack,
+// nothing is allocated.
+//
+// @pre:   format is '\0'-terminated and list matches its conversions
+// @post:  The formatted text has been appended to out
+// @param  out:       The formatting destination
+// @param  format:    The format string
+// @param  list:      The arguments of the conversions
+// @returns:          The total number of characters produced
+//-----------------------------------------------------------------------------
+int vformat( fmtout *out, const char *format, va_list list ) {
+  char number[NUMBUFSIZ];
+  while(*format != NULL_CHAR) {
+    const char *percent = strchr(format, '%');
+    if(percent == NULL) {
+      fmtputs(out, format, strlen(format));
+      break;
+    }
+    fmtputs(out, format, percent - format);
+    format = percent + 1;
+
+    bool left = false, zero = false;
+    char sign = NULL_CHAR;
+    for(;; format++) {
+      if(*format == '-') left = true;
+      else if(*format == '0') zero = true;
+      else if(*format == '+') sign = '+';
+      else if(*format == ' ') { if(sign == NULL_CHAR) sign = ' '; }
+      else break;
+    }
+    int width = 0;
+    if(*format == '*') {
+      width = va_arg(list, int);
+      if(width < 0) {
+        left = true;
+        width = -width;
+      }
+      format++;
+    }
+    while(*format >= '0' && *format <= '9') {
+      width = width * 10 + (*format++ - '0');
+    }
+    int precision = -1;
+    if(*format == '.') {
+      format++;
+      precision = 0;
+      if(*format == '*') {
+        precision = va_arg(list, int);
+        format++;
+      }
+      while(*format >= '0' && *format <= '9') {
+        precision = precision * 10 + (*format++ - '0');
+      }
+    }
+    int longs = 0, shorts = 0;
+    bool sized = false;               // z: the argument is a size_t
+    for(;; format++) {
+      if(*format == 'l') longs++;
+      else if(*format == 'h') shorts++;
+      else if(*format == 'z') sized = true;
+      else break;
+    }
+
+    const char *text = number;
+    size_t textLength = 0;
+    bool numeric = true;
+    const char *prefix = "";
+    switch(*format) {
+    case 'd':
+    case 'i': {
+      long long value = sized ? va_arg(list, ssize_t) :
+                        (longs >= 2) ? va_arg(list, long long) :
+                        (longs == 1) ? va_arg(list, long) : va_arg(list, int);
+      if(shorts >= 2) {
+        value = (signed char)value;
+      }
+      else if(shorts == 1) {
+        value = (short)value;
+      }
+      unsigned long long magnitude = (value < 0) ?
+          0ULL - (unsigned long long)value : value;
+      text = utoa(magnitude, number + NUMBUFSIZ, 10, false);
+      if(value < 0) {
+        prefix = "-";
+      }
+      else if(sign != NULL_CHAR) {
+        prefix = (sign == '+') ? "+" : " ";
+      }
+      break;
+    }
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'p': {
+      unsigned long long value = (*format == 'p') ?
+          (unsigned long long)(size_t)va_arg(list, void *) :
+          sized ? va_arg(list, size_t) :
+          (longs >= 2) ? va_arg(list, unsigned long long) :
+          (longs == 1) ? va_arg(list, unsigned long) :
+                         va_arg(list, unsigned int);
+      if(*format != 'p' && shorts >= 2) {
+        value = (unsigned char)value;
+      }
+      else if(*format != 'p' && shorts == 1) {
+        value = (unsigned short)value;
+      }
+      text = utoa(value, number + NUMBUFSIZ, (*format == 'u') ? 10 : 16,
+          *format == 'X');
+      if(*format == 'p') {
+        prefix = "0x";
+      }
+      break;
+    }
+    case 'c':
+      number[0] = (char)va_arg(list, int);
+      textLength = 1;
+      numeric = false;
+      break;
+    case 's':
+      text = va_arg(list, const char *);
+      if(text == NULL) {
+        text = "(null)";
+      }
+      textLength = (precision >= 0) ? strnlen(text, precision) : strlen(text);
+      numeric = false;
+      break;
+    case '%':
+      number[0] = '%';
+      textLength = 1;
+      width = 0;
+      numeric = false;
+      break;
+    default:                      // unknown conversion, print it as it is
+      fmtputs(out, percent, format - percent + (*format != NULL_CHAR));
+      if(*format != NULL_CHAR) {
+        format++;
+      }
+      continue;
+    }
+    format++;
+
+    int zeros = 0;
+    if(numeric) {
+      textLength = number + NUMBUFSIZ - text;
+      if(precision >= 0) {
+        if(precision == 0 && textLength == 1 && text[0] == '0') {
+          textLength = 0;
+        }
+        if((size_t)precision > textLength) {
+          zeros = precision - textLength;
+        }
+      }
+      else if(zero && !left) {
+        int used = strlen(prefix) + textLength;
+        if(width > used) {
+          zeros = width - used;
+        }
+      }
+    }
+    int used = strlen(prefix) + zeros + textLength;
+    int padding = (width > used) ? width - used : 0;
+    if(padding > 0 && !left) {
+      fmtputs(out, " ", padding, true);
+    }
+    fmtputs(out, prefix, strlen(prefix));
+    if(zeros > 0) {
+      fmtputs(out, "0", zeros, true);
+    }
+    fmtputs(out, text, textLength);
+    if(padding > 0 && left) {
+      fmtputs(out, " ", padding, true);
+    }
+  }
+  return out->total;
+}
+
+//-----------------------------------------------------------------------------
+// vsnprintf
+// Formats list according to format into str, writing at most size characters
+// including the terminating '\0'
+//
+// @pre:   str holds size characters, or size is 0
+// @post:  str holds the '\0'-terminated, possibly truncated, text
+// @param  str:       The destination buffer
+// @param  size:      The size of str
+// @param  format:    The format string, as for printf
+// @param  list:      The arguments of the conversions
+// @returns:          The length the whole text would have had
+//-----------------------------------------------------------------------------
+int vsnprintf( char *str, size_t size, const char *format, va_list list ) {
+  fmtout out = { str, 0, (size > 0) ? size - 1 : 0, NULL, 0, false };
+  int total = vformat(&out, format, list);
+  if(size > 0) {
+    str[out.len] = NULL_CHAR;
+  }
+  return total;
+}
+
+//-----------------------------------------------------------------------------
+// snprintf
+// Calls vsnprintf with the additional parameters
+//
+// @pre:   str holds size characters, or size is 0
+// @post:  str holds the '\0'-terminated, possibly truncated, text
+// @param  str:       The destination buffer
+// @param  size:      The size of str
+// @param  format:    The format string, as for printf
+// @param  ...:       The arguments of the conversions
+// @returns:          The length the whole text would have had
+//-----------------------------------------------------------------------------
+int snprintf( char *str, size_t size, const char *format, ... ) {
+  va_list list;
+  va_start(list, format);
+  int total = vsnprintf(str, size, format, list);
+  va_end(list);
+  return total;
 }
 
+//-----------------------------------------------------------------------------
+// vfprintf
+// Formats list according to format into stream's buffer. The text is
+// collected on the stack and handed to fwrite in chunks, so stream's own
+// buffering decides when write( ) is called.
+//
+// @pre:   stream represents an open FILE
+// @post:  The formatted text has been written to stream
+// @param  stream:    A pointer to an open FILE object
+// @param  format:    The format string, as for printf
+// @param  list:      The arguments of the conversions
+// @returns:          The number of characters written, or a negative number
+//-----------------------------------------------------------------------------
+int vfprintf( FILE *stream, const char *format, va_list list ) {
+  if(stream == NULL || format == NULL) {
+    errno = EBADF;
+    return EOF;
+  }
+  char chunk[BUFSIZ / 8];
+  fmtout out = { chunk, 0, sizeof(chunk), stream, 0, false };
+  flockfile(stream);
+  int total = vformat(&out, format, list);
+  fmtflush(&out);
+  funlockfile(stream);
+  return out.failed ? EOF : total;
+}
 
-char *itoa( const int arg ) {
-  bzero( decimal, 100 );
-  int order = recursive_itoa( arg );
-  char *new_decimal = new char[order + 1];
-  bcopy( decimal, new_decimal, order + 1 );
-  return new_decimal;
+//-----------------------------------------------------------------------------
+// fprintf
+// Calls vfprintf with the additional parameters
+//
+// @pre:   stream represents an open FILE
+// @post:  The formatted text has been written to stream
+// @param  stream:    A pointer to an open FILE object
+// @param  format:    The format string, as for printf
+// @param  ...:       The arguments of the conversions
+// @returns:          The number of characters written, or a negative number
+//-----------------------------------------------------------------------------
+int fprintf( FILE *stream, const char *format, ... ) {
+  va_list list;
+  va_start(list, format);
+  int total = vfprintf(stream, format, list);
+  va_end(list);
+  return total;
 }
 
 //-----------------------------------------------------------------------------
 // printf
 // Writes the array *format to the console with as many variables to be printed
-// as provided as additional parameters
+// as provided as additional parameters, through the stdout stream
 //
 // @pre:   None
 // @post:  format is sent to console as output
@@ -82,35 +663,12 @@ char *itoa( const int arg ) {
 // @returns:          The total number of characters written if successful,
 //                    a negative number otherwise
 //-----------------------------------------------------------------------------
-int printf( const void *format, ... ) {
+int printf( const char *format, ... ) {
   va_list list;
   va_start( list, format );
-
-  char *msg = ( char * )format;
-  char buf[1024];
-  int nWritten = 0;
-
-  int i = 0, j = 0;
-  while ( msg[i] != '\0') {
-    if ( msg[i] == '%' && msg[i + 1] == 'd' ) {
-      buf[j] = '\0';
-      nWritten += write( 1, buf, j );
-      j = 0;
-      i += 2;
-
-      int int_val = va_arg( list, int );
-      char *dec = itoa( abs( int_val ) );
-      if ( int_val < 0 )
-  nWritten += write( 1, "-", 1 );
-      nWritten += write( 1, dec, strlen( dec ) );
-      delete dec;
-    }
-    else
-      buf[j++] = msg[i++];
-  }
-  if ( j > 0 )
-    nWritten += write( 1, buf, j );
+  int total = vfprintf( stdout, format, list );
   va_end( list );
+  return total;
 }
 
 //-----------------------------------------------------------------------------
@@ -123,17 +681,40 @@ int printf( const void *format, ... ) {
 // @param  stream:    A pointer to an open FILE object
 // @param  buf:       A buffer to be copied into stream->buffer if not empty
 // @param  mode:      The mode of the file (unbuffered, line or fully buffered
+//                    optionally or'd with _IOURING to refill and flush through
+//                    the calling thread's io_uring)
 // @param  size:      The size of the buffer to be created
 // @returns:          0 if successful, -1 otherwise
 //-----------------------------------------------------------------------------
 int setvbuf( FILE *stream, char *buf, int mode, size_t size ) {
+  bool uring = ( mode & _IOURING ) != 0;
+  mode &= ~_IOURING;
   if ( mode != _IONBF && mode != _IOLBF && mode != _IOFBF )
     return -1;
+  if ( stream->map != (char *)0 )   // a mapped file has no buffer to replace
+    return -1;
+  if ( stream->cache != (fcache *)0 ) // nor does a cached one
+    return -1;
+  if ( stream->direct != 0 )        // O_DIRECT needs the aligned buffer
+    return -1;
+  if ( stream->share != (fshare *)0 ) // a cursor's buffer is one cache block
+    return -1;
+  if ( stream->checksum )           // the checksum is taken from the buffer
+    return -1;
+  if ( stream->zip != (fzip *)0 )   // the buffer holds one frame's data
+    return -1;
+  if ( stream->async != (fasync *)0 ) // the buffer belongs to write-behind
+    return -1;
+  if ( stream->ring != (furing *)0 )
+    furingdetach( stream );
+  if ( mode == _IONBF )
+    stream->update = false;         // unbuffered I/O goes by the file position
   stream->mode = mode;
   stream->pos = 0;
 
   if ( stream->buffer != (char *)0 && stream->bufown == true )
-    delete stream->buffer;
+    fbuffree( stream->buffer, stream->size );
+  stream->bufbase = 0;              // the caller has chosen the size
 
   switch ( mode ) {
   case _IONBF:
@@ -156,9 +737,53 @@ int setvbuf( FILE *stream, char *buf, int mode, size_t size ) {
     break;
   }
 
+  if ( uring && mode != _IONBF )
+    furingattach( stream );
   return 0;
 }
 
+//-----------------------------------------------------------------------------
+// fstdopen
+// Sets up one of the predefined streams on an already open file descriptor
+//
+// @pre:   stream is a statically allocated FILE
+// @post:  stream refers to fd, buffered in buf according to mode
+// @param  stream:    The FILE object to set up
+// @param  fd:        The open file descriptor, 0, 1 or 2
+// @param  flag:      O_RDONLY or O_WRONLY
+// @param  buf:       A BUFSIZ-byte buffer, or NULL if mode is _IONBF
+// @param  mode:      The mode of the file (unbuffered, line or fully buffered)
+// @returns:          stream
+//-----------------------------------------------------------------------------
+FILE *fstdopen( FILE *stream, int fd, int flag, char *buf, int mode ) {
+  stream->fd = fd;
+  stream->flag = flag;
+  stream->offset = flseek( stream, 0, SEEK_CUR );  // -1 on a pipe or terminal
+  setvbuf( stream, buf, mode, BUFSIZ );
+  return stream;
+}
+
+//-----------------------------------------------------------------------------
+// fstdflush
+// Flushes stdout when the program exits, registered with atexit( )
+//-----------------------------------------------------------------------------
+void fstdflush( ) {
+  if ( stdout->lastop == 'w' )
+    fflush( stdout );
+}
+
+// The predefined streams. stdout is line buffered on a terminal, so
+// interactive output appears a line at a time, and fully buffered otherwise;
+// stderr is never buffered.
+char stdinBuffer[BUFSIZ];
+char stdoutBuffer[BUFSIZ];
+FILE stdinFile, stdoutFile, stderrFile;
+FILE *stdin = fstdopen( &stdinFile, 0, O_RDONLY, stdinBuffer, _IOFBF );
+FILE *stdout = fstdopen( &stdoutFile, 1, O_WRONLY, stdoutBuffer,
+                         isatty( 1 ) ? _IOLBF : _IOFBF );
+FILE *stderr = fstdopen( &stderrFile, 2, O_WRONLY, (char *)0, _IONBF );
+int stdflushed = atexit( fstdflush );
+
 //-----------------------------------------------------------------------------
 // setbuf
 // Calls setvbuf using a ternary operation to represent unbuffered vs fully
@@ -176,6 +801,21 @@ void setbuf( FILE *stream, char *buf ) {
 //-----------------------------------------------------------------------------
 // fopen
 // Opens a file at location *path in the mode *mode, ie: r, r+, w, w+, a, a+
+// A read-only mode with a trailing 'm' (rm, rbm) maps the whole file instead
+// of buffering it, so reads and seeks are served straight from the mapping.
+// Files that cannot be mapped (pipes, empty files) fall back to buffering.
+// A trailing 'u' (ru, wu, r+u, ...) moves refills and flushes onto io_uring,
+// falling back to read( ) and write( ) where io_uring is unavailable.
+// A trailing 'd' (rd, wd, r+d, ...) opens the file with O_DIRECT, so its data
+// bypasses the page cache, see fdirectread( ) and fdirectwrite( ). Files
+// that do not support O_DIRECT are opened normally.
+// A trailing 'z' (rz, wz, az) compresses each buffer into a frame of the file
+// as it is flushed and decompresses the frames as they are read, see
+// fzipwrite( ) and fzipread( ). It takes precedence over 'm', 'u' and 'd',
+// and is refused with r+, w+ and a+, as frames cannot be rewritten in place,
+// and with pipes and other files that are not regular, as frames are read
+// with pread( ).
+// The buffer is sized from the file's st_blksize, see fbufsize( ).
 //
 // @pre:   *path and *mode are not NULL and represent correct information
 // @post:  The file at *path is opened in the mode specified by *mode
@@ -186,6 +826,7 @@ void setbuf( FILE *stream, char *buf ) {
 FILE *fopen( const char *path, const char *mode ) {
   FILE *stream = new FILE( );
   setvbuf( stream, (char *)0, _IOFBF, BUFSIZ );
+  const char *options = mode;
 
   // fopen() mode
   // r or rb           =  O_RDONLY
@@ -194,6 +835,20 @@ FILE *fopen( const char *path, const char *mode ) {
   // r+ or rb+ or r+b  =  O_RDWR
   // w+ or wb+ or w+b  =  O_RDWR   | O_CREAT | O_TRUNC
   // a+ or ab+ or a+b  =  O_RDWR   | O_CREAT | O_APPEND
+  //
+  // followed by any of the FOPEN_OPTIONS letters
+  // m                 =  map a read-only file instead of buffering it
+  // u                 =  refill and flush through the thread's io_uring
+  // d                 =  bypass the page cache with O_DIRECT
+  // z                 =  compress the file in frames of ZIPBLOCK bytes
+
+  char base[4];
+  int length = 0;
+  for ( const char *c = mode; *c != '\0' && length < 3; c++ )
+    if ( strchr( FOPEN_OPTIONS, *c ) == NULL )
+      base[length++] = *c;
+  base[length] = '\0';
+  mode = base;
 
   switch( mode[0] ) {
   case 'r':
@@ -236,67 +891,521 @@ FILE *fopen( const char *path, const char *mode ) {
 
   mode_t open_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
 
-  if ( ( stream->fd = open( path, stream->flag, mode ) ) == -1 ) {
+  bool zip = ( strchr( options, 'z' ) != NULL );
+  if ( zip && ( stream->flag & O_ACCMODE ) == O_RDWR ) {
+    fbuffree( stream->buffer, stream->size );
+    delete stream;
+    errno = EINVAL;
+    printf( "fopen failed\n" );
+    return NULL;
+  }
+
+  // appends are placed by fdirectwrite, as pwrite( ) ignores its offset
+  // with O_APPEND, and it reads back the blocks it writes part of, so a
+  // write-only file is opened read-write
+  bool direct = !zip && ( strchr( options, 'd' ) != NULL );
+  int directFlag = ( stream->flag | O_DIRECT ) & ~O_APPEND;
+  if ( ( directFlag & O_ACCMODE ) == O_WRONLY )
+    directFlag = ( directFlag & ~O_ACCMODE ) | O_RDWR;
+  stream->fd = direct ? open( path, directFlag, open_mode ) : -1;
+  if ( direct && stream->fd == -1 && ( errno == EINVAL || errno == EACCES ) )
+    direct = false;                   // not supported, or not readable
+  // an appended compressed file is opened for reading too, as fzipopen
+  // reads its frame headers to find where the stream ends
+  int flag = stream->flag;
+  if ( zip && ( flag & O_APPEND ) )
+    flag = ( flag & ~O_ACCMODE ) | O_RDWR;
+  if ( !direct )
+    stream->fd = open( path, flag, open_mode );
+  if ( stream->fd == -1 ) {
+    fbuffree( stream->buffer, stream->size );
     delete stream;
     printf( "fopen failed\n" );
-    stream = NULL;
+    return NULL;
+  }
+  stream->offset = flseek( stream, 0, SEEK_CUR );  // -1 on a pipe
+  if ( zip && !fzipopen( stream ) ) {
+    close( stream->fd );
+    fbuffree( stream->buffer, stream->size );
+    delete stream;
+    printf( "fopen failed\n" );
+    return NULL;
+  }
+
+  struct stat fileStat;
+  if ( direct ) {
+    char *buffer = fbufalloc( DIRECTBUF + 2 * DIRECTALIGN );
+    if ( buffer != (char *)0 ) {
+      fbuffree( stream->buffer, stream->size );
+      stream->buffer = buffer;        // with two spare blocks, see fdirectwrite
+      stream->size = DIRECTBUF;
+      stream->direct = DIRECTALIGN;
+      stream->raoffset = -1;
+    }
   }
+  if ( strchr( options, 'm' ) != NULL && stream->flag == O_RDONLY &&
+       stream->direct == 0 && stream->zip == (fzip *)0 &&
+       fstat( stream->fd, &fileStat ) == 0 && S_ISREG( fileStat.st_mode ) &&
+       fileStat.st_size > 0 ) {
+    void *map = mmap( NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE,
+                      stream->fd, 0 );
+    if ( map != MAP_FAILED ) {
+      fbuffree( stream->buffer, stream->size );
+      stream->bufown = false;
+      stream->map = (char *)map;
+      stream->mapsize = fileStat.st_size;
+      stream->lastop = 'r';
+      mapwindow( stream, 0 );
+    }
+  }
+  if ( stream->map == (char *)0 && stream->direct == 0 &&
+       stream->zip == (fzip *)0 )
+    fbufsize( stream );
+  if ( strchr( options, 'u' ) != NULL && stream->map == (char *)0 &&
+       stream->zip == (fzip *)0 )
+    furingattach( stream );
+  // r+ and w+ read and write one window of a regular file, see fupdateturn
+  if ( ( stream->flag & O_ACCMODE ) == O_RDWR &&
+       !( stream->flag & O_APPEND ) && stream->direct == 0 &&
+       stream->ring == (furing *)0 &&
+       fstat( stream->fd, &fileStat ) == 0 && S_ISREG( fileStat.st_mode ) )
+    stream->update = true;
   return stream;
 }
 
+//-----------------------------------------------------------------------------
+// mapwindow
+// Points stream->buffer at the MAPWIN-aligned window of stream->map that holds
+// offset, so buffer, pos and actual_size describe the mapping exactly as they
+// would describe a buffer filled by read( ). Windows keep pos and actual_size
+// within an int for files larger than 2GB.
+//
+// @pre:   stream was opened with a mapped mode, 0 <= offset <= mapsize
+// @post:  stream->buffer[stream->pos] is the byte at offset
+// @param  stream:    A pointer to an open, mapped FILE object
+// @param  offset:    The file offset to position the window at
+// @returns:          The number of bytes left in the new window
+//-----------------------------------------------------------------------------
+int mapwindow( FILE *stream, long offset ) {
+  long start = offset - offset % MAPWIN;
+  long length = stream->mapsize - start;
+  stream->buffer = stream->map + start;
+  stream->size = stream->actual_size = ( length < MAPWIN ) ? length : MAPWIN;
+  stream->pos = offset - start;
+  stream->offset = start;
+  return stream->actual_size - stream->pos;
+}
+
+//-----------------------------------------------------------------------------
+// frefill
+// Discards the consumed contents of stream->buffer and fills it with the next
+// bytes of the file, either with a read( ) (or io_uring), or by moving to the
+// next window of a mapped file or the next block of a cached one.
+//
+// @pre:   stream represents an open FILE with a buffer
+// @post:  stream->pos is 0, stream->actual_size is the number of bytes filled
+//         and stream->offset is the file offset of the first of them
+// @param  stream:    A pointer to an open FILE object
+// @returns:          The number of bytes filled, 0 at EOF, EOF if read fails
+//-----------------------------------------------------------------------------
+int frefill( FILE *stream ) {
+  stream->stats.refills++;
+  if(stream->map != NULL) {
+    return mapwindow(stream, (stream->buffer - stream->map) +
+        stream->actual_size);
+  }
+  if(stream->cache != NULL) {
+    return fcachewindow(stream, stream->offset + stream->actual_size);
+  }
+  if(stream->share != NULL) {
+    return fsharewindow(stream, stream->offset + stream->actual_size);
+  }
+  if(stream->direct != 0) {
+    return fdirectread(stream);
+  }
+  if(stream->zip != NULL) {
+    return fzipread(stream);
+  }
+  if(stream->update && fupdateflush(stream) == EOF) {
+    return EOF;   // the window is about to move past its dirty bytes
+  }
+  if(stream->checksum) {
+    fcrcwindow(stream);
+  }
+  if(stream->offset >= 0) {
+    stream->offset += stream->actual_size;
+  }
+  fgrow(stream, stream->actual_size == stream->size);
+  stream->pos = 0;
+  stream->actual_size = 0;
+  int bytesRead = (stream->ring != NULL) ? furingread(stream) :
+      (stream->mem != NULL) ? fmemread(stream, stream->buffer, stream->size) :
+      stream->update ?
+      pread(stream->fd, stream->buffer, stream->size, stream->offset) :
+      read(stream->fd, stream->buffer, stream->size);
+  if(stream->ring == NULL) {
+    stream->stats.reads++;   // io_uring counts its reads as it queues them
+  }
+  if(bytesRead < 0) {
+    return EOF;
+  }
+  stream->stats.bytesread += bytesRead;
+  stream->actual_size = bytesRead;
+  if(bytesRead > 0 && stream->raoffset >= 0 && stream->mem == NULL) {
+    freadahead(stream, bytesRead);
+  }
+  return bytesRead;
+}
+
+//-----------------------------------------------------------------------------
+// freadahead
+// Called after each refill to detect sequential reading. Once RARUN refills
+// in a row have not been separated by a seek, the kernel is told the file is
+// read sequentially and asked to start reading the next RABUFFERS buffers'
+// worth of data in the background, renewed each time half of that window
+// has been consumed. The next refills then find their data already cached
+// instead of blocking on the disk.
+//
+// @pre:   stream->raoffset was the file offset of the bytes just read
+// @post:  stream->raoffset is the file offset following them
+// @param  stream:    A pointer to an open FILE object
+// @param  bytesRead: The number of bytes the refill read
+//-----------------------------------------------------------------------------
+void freadahead( FILE *stream, int bytesRead ) {
+  stream->raoffset += bytesRead;
+  if(++stream->rarun < RARUN) {
+    return;
+  }
+  long window = (long)stream->size * RABUFFERS;
+  if(stream->rarun == RARUN) {
+    posix_fadvise(stream->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    stream->raend = stream->raoffset;
+  }
+  if(stream->raend - stream->raoffset < window / 2) {
+    long start = (stream->raend > stream->raoffset) ?
+        stream->raend : stream->raoffset;
+    posix_fadvise(stream->fd, start, window, POSIX_FADV_WILLNEED);
+    stream->raend = start + window;
+  }
+}
+
 //-----------------------------------------------------------------------------
 // fpurge
-// Fills the FILE buffer with '\0' to reset it.
+// Discards the data in the FILE buffer. Resetting pos and actual_size is
+// enough: what is left in stream->buffer is never read or written again.
 //
 // @pre:    stream represents an open FILE
-// @post:   stream->buffer is reset by being filled with '\0'
+// @post:   stream->buffer holds no data
 // @param stream:     A pointer to an open FILE object
 // @returns:          0 if successful, EOF (-1) if it fails
 //-----------------------------------------------------------------------------
 int fpurge( FILE *stream ) {
   if(stream == NULL || stream->buffer == NULL) {
     errno = EBADF;
-    printf("fpurge error: %d\n", strerror(errno));
+    printf("fpurge error: %s\n", strerror(errno));
     return EOF;
   }
-  memset(stream->buffer, 0, stream->size);
+  if(stream->checksum) {
+    fcrcwindow(stream);
+  }
   stream->pos = 0;
   stream->actual_size = 0;
+  stream->dirtylo = stream->dirtyhi = 0;
   return 0;
 }
 
 //-----------------------------------------------------------------------------
-// fflush
+// fwritebuf
+// Writes the contents of stream->buffer to the file, or with write-behind
+// hands the buffer to the background writer and carries on with a spare one
+//
+// @pre:    stream represents an open FILE whose last operation was a write
+// @post:   stream->pos is reset to 0
+// @param stream:     A pointer to an open FILE object
+// @returns:          0 if successful, EOF (-1) if it fails
+//-----------------------------------------------------------------------------
+int fwritebuf( FILE *stream ) {
+  stream->raoffset = -1;  // read-ahead resumes after the next fseek
+  if(stream->update) {
+    bool full = (stream->pos == stream->size);
+    if(fupdateflush(stream) == EOF) {
+      return EOF;
+    }
+    if(full) {
+      // a full window moves on to the bytes that follow it
+      stream->offset += stream->size;
+      stream->pos = stream->actual_size = 0;
+      stream->dirtylo = stream->dirtyhi = 0;
+      fgrow(stream, true);
+    }
+    return 0;
+  }
+  if(stream->pos > 0) {
+    stream->stats.flushes++;
+  }
+  if(stream->direct != 0) {
+    return fdirectwrite(stream);
+  }
+  if(stream->zip != NULL) {
+    return fzipwrite(stream);
+  }
+  if(stream->offset >= 0) {
+    // appended data lands at the end of the file, known once it is written
+    stream->offset = (stream->flag & O_APPEND) ? -1 :
+        stream->offset + stream->pos;
+  }
+  if(stream->async != NULL) {
+    return fasyncsubmit(stream);
+  }
+  if(stream->ring != NULL) {
+    return furingwrite(stream);
+  }
+  int written = 0;
+  while(written < stream->pos) {
+    int bytesWritten = (stream->mem != NULL) ?
+        fmemwrite(stream, &stream->buffer[written], stream->pos - written) :
+        write(stream->fd, &stream->buffer[written], stream->pos - written);
+    stream->stats.writes++;
+    if(bytesWritten < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return EOF;
+    }
+    written += bytesWritten;
+    stream->stats.byteswritten += bytesWritten;
+  }
+  if(stream->flag & O_APPEND) {
+    stream->offset = flseek(stream, 0, SEEK_CUR);
+  }
+  bool full = (stream->pos == stream->size);
+  fpurge(stream);
+  fgrow(stream, full);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fflush_unlocked
 // If the last operation performed on the FILE * stream was a write, the
 // contensts of stream->buffer are output to stream. Else, purges buffer.
+// With write-behind, also waits until every handed off buffer is written.
 //
 // @pre:    stream represents an open FILE
 // @post:   stream->pos is reset to 0, stream->buffer is reset
 // @param stream:     A pointer to an open FILE object
 // @returns:          0 if successful, EOF (-1) if it fails
 //-----------------------------------------------------------------------------
-int fflush( FILE *stream ) {
+int fflush_unlocked( FILE *stream ) {
   if(stream == NULL || stream->buffer == NULL) {
     errno = EBADF;
-    printf("fflush error: %d\n", strerror(errno));
+    printf("fflush error: %s\n", strerror(errno));
     return EOF;
   }
-  if(stream->lastop == 'r') {
-    fpurge(stream);
+  if(stream->map != NULL || stream->cache != NULL) {
+    return 0;    // nothing to write, and the buffer is shared with the file
   }
-  else {
-    write(stream->fd, stream->buffer, stream->pos);
-    printf("writeBuffer = %d\n", stream->pos);
+  if(stream->update) {
+    if(fupdateflush(stream) == EOF) {
+      return EOF;
+    }
+    stream->offset += stream->pos;
+    stream->pos = stream->actual_size = 0;
+    stream->dirtylo = stream->dirtyhi = 0;
+    // refills and write-backs leave the file position alone: bring it to the
+    // stream's, as other users of the descriptor expect after a flush
+    return (flseek(stream, stream->offset, SEEK_SET) == -1) ? EOF : 0;
+  }
+  if(stream->lastop == 'w') {
+    if(fwritebuf(stream) == EOF) {
+      return EOF;
+    }
+    int result = (stream->async != NULL) ? fasyncwait(stream) :
+                 (stream->ring != NULL) ? furingdrop(stream) : 0;
+    if(stream->offset < 0 && (stream->flag & O_APPEND)) {
+      stream->offset = flseek(stream, 0, SEEK_CUR);
+    }
+    return result;
+  }
+  if(stream->ring != NULL) {
+    furingdrop(stream);
+  }
+  if(stream->offset >= 0) {
+    // the file position is past the unread bytes: move it back to where the
+    // reader stopped, so that a write after this lands there. O_DIRECT
+    // streams, cursors and compressed streams place every transfer
+    // themselves and need no system call.
+    long position = stream->offset + stream->pos;
+    if(stream->direct == 0 && stream->share == NULL && stream->zip == NULL &&
+        stream->pos < stream->actual_size &&
+        flseek(stream, position, SEEK_SET) == -1) {
+      position = stream->offset + stream->actual_size;  // the bytes are skipped
+    }
+    stream->offset = position;
   }
   fpurge(stream);
   return 0;
 }
 
 //-----------------------------------------------------------------------------
-// fread
+// fflush
+// Calls fflush_unlocked while holding stream's lock
+//-----------------------------------------------------------------------------
+int fflush( FILE *stream ) {
+  flockfile(stream);
+  int result = fflush_unlocked(stream);
+  funlockfile(stream);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+// fbypass
+// Tells whether large transfers on stream may go straight between the
+// caller's memory and the file descriptor. Mapped and cached streams have
+// nothing to gain, nor have memory streams, O_DIRECT streams must keep to
+// aligned transfers, and write-behind and io_uring have data in flight that
+// a direct transfer would overtake. Cursors read through their shared cache,
+// and the data of compressed streams has to pass through a frame.
+//
+// @param  stream:    A pointer to an open, buffered FILE object
+// @returns:          true if freadv and fwritev may be used on stream
+//-----------------------------------------------------------------------------
+bool fbypass( FILE *stream ) {
+  return stream->map == NULL && stream->cache == NULL &&
+      stream->async == NULL && stream->ring == NULL && stream->mem == NULL &&
+      stream->direct == 0 && stream->share == NULL && stream->zip == NULL;
+}
+
+//-----------------------------------------------------------------------------
+// freadv
+// Reads a large request straight into the caller's memory, refilling
+// stream->buffer with whatever follows it in the same readv( )
+//
+// @pre:   stream->buffer is empty and length >= stream->size
+// @post:  stream->buffer holds the bytes read past the caller's request
+// @param  stream:    A pointer to an open FILE object
+// @param  ptr:       Where the caller wants the data
+// @param  length:    The number of bytes the caller still wants
+// @returns:          The number of bytes given to the caller, 0 at EOF and
+//                    -1 if readv fails
+//-----------------------------------------------------------------------------
+long freadv( FILE *stream, char *ptr, size_t length ) {
+  if(stream->update && fupdateflush(stream) == EOF) {
+    return -1;
+  }
+  if(stream->checksum) {
+    fcrcwindow(stream);
+  }
+  if(stream->offset >= 0) {
+    stream->offset += stream->actual_size;
+  }
+  stream->pos = 0;
+  stream->actual_size = 0;
+  iovec iov[2];
+  iov[0].iov_base = ptr;
+  iov[0].iov_len = length;
+  iov[1].iov_base = stream->buffer;
+  iov[1].iov_len = stream->size;
+  long bytesRead;
+  do {
+    bytesRead = stream->update ? preadv(stream->fd, iov, 2, stream->offset) :
+        readv(stream->fd, iov, 2);
+    stream->stats.reads++;
+  } while(bytesRead < 0 && errno == EINTR);
+  if(bytesRead <= 0) {
+    return bytesRead;
+  }
+  stream->stats.bytesread += bytesRead;
+  if(stream->raoffset >= 0) {
+    freadahead(stream, bytesRead);
+  }
+  long given = ((size_t)bytesRead < length) ? bytesRead : length;
+  if(stream->checksum) {
+    stream->crc = fcrc32c(stream->crc, ptr, given);
+  }
+  if(stream->offset >= 0) {
+    stream->offset += given;
+  }
+  stream->actual_size = bytesRead - given;
+  return given;
+}
+
+//-----------------------------------------------------------------------------
+// fwritev
+// Writes the contents of stream->buffer followed by a large request from
+// the caller's memory in as few writev( )s as the kernel allows
+//
+// @pre:   stream's last operation was a write
+// @post:  stream->buffer is empty unless writev failed
+// @param  stream:    A pointer to an open FILE object
+// @param  ptr:       The caller's data
+// @param  length:    The number of bytes of it
+// @returns:          The number of the caller's bytes written, which is less
+//                    than length if writev failed
+//-----------------------------------------------------------------------------
+size_t fwritev( FILE *stream, const char *ptr, size_t length ) {
+  if(stream->update) {
+    // the data may overwrite the window, which is written back and dropped
+    if(fupdateflush(stream) == EOF) {
+      return 0;
+    }
+    stream->offset += stream->pos;
+    stream->pos = stream->actual_size = 0;
+    stream->dirtylo = stream->dirtyhi = 0;
+  }
+  iovec iov[2];
+  iov[0].iov_base = stream->buffer;
+  iov[0].iov_len = stream->pos;
+  iov[1].iov_base = (void *)ptr;
+  iov[1].iov_len = length;
+  int first = (stream->pos > 0) ? 0 : 1;
+  long done = 0;
+  while(first < 2) {
+    long bytesWritten = stream->update ?
+        pwritev(stream->fd, &iov[first], 2 - first, stream->offset + done) :
+        writev(stream->fd, &iov[first], 2 - first);
+    stream->stats.writes++;
+    if(bytesWritten < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    stream->stats.byteswritten += bytesWritten;
+    done += bytesWritten;
+    while(first < 2 && (size_t)bytesWritten >= iov[first].iov_len) {
+      bytesWritten -= iov[first].iov_len;
+      iov[first].iov_len = 0;
+      first++;
+    }
+    if(first < 2) {
+      iov[first].iov_base = (char *)iov[first].iov_base + bytesWritten;
+      iov[first].iov_len -= bytesWritten;
+    }
+  }
+  size_t flushed = stream->pos - iov[0].iov_len;
+  size_t written = length - iov[1].iov_len;
+  if(stream->checksum) {
+    stream->crc = fcrc32c(stream->crc, stream->buffer, flushed);
+    stream->crc = fcrc32c(stream->crc, ptr, written);
+  }
+  if(stream->offset >= 0) {
+    stream->offset = (stream->flag & O_APPEND) ?
+        flseek(stream, 0, SEEK_CUR) : stream->offset + flushed + written;
+  }
+  // buffered bytes that could not be written stay buffered
+  memmove(stream->buffer, iov[0].iov_base, iov[0].iov_len);
+  stream->pos = iov[0].iov_len;
+  stream->raoffset = -1;
+  return written;
+}
+
+//-----------------------------------------------------------------------------
+// fread_unlocked
 // Reads data from a FILE object in the amount of the number of bytes (size)
 // for each number of blocks (nmemb) into a buffer and returns the number of
-// blocks read.
+// blocks read. Once the buffered bytes are used up, a remainder of at least
+// a buffer's worth is read straight into ptr, together with the next
+// buffer's worth in the same readv( ).
 //
 // @pre:   stream represents an open FILE, size == sizeof(char)
 // @post:  stream->buffer is filled with the last chars read up to stream->size
@@ -306,80 +1415,194 @@ int fflush( FILE *stream ) {
 // @param stream:     An open FILE pointer
 // @returns:          Returns the number of blocks read successfully
 //-----------------------------------------------------------------------------
-size_t fread( void *ptr, size_t size, size_t nmemb, FILE *stream ) {
+size_t fread_unlocked( void *ptr, size_t size, size_t nmemb, FILE *stream ) {
   if (nmemb <= 0 || ptr == NULL || size != sizeof(char)) {
     errno = EBADFD;
-    printf("fread error: %d\n", strerror(errno));
+    printf("fread error: %s\n", strerror(errno));
     return EOF;
   }
   if(stream == NULL) {
     errno = EBADF;
-    printf("fread error: %d\n", strerror(errno));
+    printf("fread error: %s\n", strerror(errno));
     return EOF;
   }
   if(stream->eof) {
     return 0;
   }
-  if (stream->lastop == 'w') {
-     if (fflush(stream) == EOF){
+  if(stream->update) {
+    fupdateturn(stream, 'r');
+  }
+  else if (stream->lastop == 'w') {
+     if (fflush_unlocked(stream) == EOF){
         return EOF;
      }
   }
+  stream->lastop = 'r';
   char *buffer = (char *)ptr;
   size_t totalToRead = size * nmemb;
-  int numberRead = 0;
+  size_t numberRead = 0;
+  if(totalToRead > (size_t)stream->bufneed) {
+    stream->bufneed = (totalToRead < (size_t)BUFMAX) ? totalToRead : BUFMAX;
+  }
   if(stream->mode == _IONBF) {
-    return(read(stream->fd, buffer, totalToRead));
+    long bytesRead = (stream->mem != NULL) ?
+        fmemread(stream, buffer, totalToRead) :
+        read(stream->fd, buffer, totalToRead);
+    stream->stats.reads++;
+    stream->stats.bytesread += (bytesRead > 0) ? bytesRead : 0;
+    return bytesRead;
   }
-  int sizeLeft = 0;
+  size_t sizeLeft = 0;
   int bytesRead = 0;
 
   while(numberRead < totalToRead) {
-    if(stream->pos == 0) {
-      bytesRead = read(stream->fd, stream->buffer, stream->size);
+    if(stream->pos == stream->actual_size &&
+        totalToRead - numberRead >= (size_t)stream->size && fbypass(stream)) {
+      // too large to stage in the buffer: read it straight into place
+      long given = freadv(stream, &buffer[numberRead], totalToRead - numberRead);
+      if(given < 0) {
+        return EOF;
+      }
+      if(given == 0) {
+        stream->eof = true;
+        break;
+      }
+      numberRead += given;
+      continue;
+    }
+    if(stream->pos == stream->actual_size) {
+      bytesRead = frefill(stream);
       if(bytesRead < 0) {
         return EOF;
       }
       if(bytesRead == 0) {
         stream->eof = true;
-        return numberRead;
-      }
-      if(bytesRead < stream->size) {
-        stream->actual_size = bytesRead;
+        break;
       }
     }
-    sizeLeft = (stream->actual_size ? stream->actual_size : stream->size)
-        - stream->pos;
-    if((totalToRead - numberRead) <= sizeLeft) {
-      memcpy(&buffer[numberRead], &stream->buffer[stream->pos],
-          (totalToRead - numberRead));
-      stream->pos += (totalToRead - numberRead);
-      numberRead += (totalToRead - numberRead);
-
+    sizeLeft = stream->actual_size - stream->pos;
+    if((totalToRead - numberRead) < sizeLeft) {
+      sizeLeft = totalToRead - numberRead;
     }
-    else {
-      memcpy(&buffer[numberRead], &stream->buffer[stream->pos], sizeLeft);
-      numberRead += sizeLeft;
-      stream->pos += sizeLeft;
+    memcpy(&buffer[numberRead], &stream->buffer[stream->pos], sizeLeft);
+    stream->stats.copied += sizeLeft;
+    numberRead += sizeLeft;
+    stream->pos += sizeLeft;
+  }
+  return (numberRead / size);
+}
+
+//-----------------------------------------------------------------------------
+// fread
+// Calls fread_unlocked while holding stream's lock
+//-----------------------------------------------------------------------------
+size_t fread( void *ptr, size_t size, size_t nmemb, FILE *stream ) {
+  flockfile(stream);
+  size_t numberRead = fread_unlocked(ptr, size, nmemb, stream);
+  funlockfile(stream);
+  return numberRead;
+}
+
+//-----------------------------------------------------------------------------
+// fpeek_unlocked
+// Lends the caller the unread bytes in stream->buffer, refilling it first if
+// it is empty, so data can be scanned in place instead of being copied out
+// with fread. Nothing is consumed until fadvance is called. The pointer is
+// only valid until the next call that reads, writes or seeks on stream.
+//
+// @pre:   stream represents an open, buffered FILE and len is not NULL
+// @post:  *len is set to the number of bytes available at the returned address
+// @param  stream:    A pointer to an open FILE object
+// @param  len:       Receives the number of bytes that may be examined
+// @returns:          A pointer to the next unread byte, or NULL at EOF or error
+//-----------------------------------------------------------------------------
+const char *fpeek_unlocked( FILE *stream, size_t *len ) {
+  if(stream == NULL || stream->buffer == NULL || len == NULL) {
+    errno = EBADF;
+    printf("fpeek error: %s\n", strerror(errno));
+    return NULL;
+  }
+  *len = 0;
+  if(stream->update) {
+    fupdateturn(stream, 'r');
+  }
+  else if(stream->lastop == 'w') {
+    if(fflush_unlocked(stream) == EOF) {
+      return NULL;
     }
-    if(stream->pos == stream->actual_size) {
-      stream->eof = true;
-      break;
+  }
+  stream->lastop = 'r';
+  if(stream->pos == stream->actual_size) {
+    if(stream->eof) {
+      return NULL;
     }
-    if(stream->pos == stream->size) {
-      stream->pos = 0;
-      fpurge(stream);
+    int bytesRead = frefill(stream);
+    if(bytesRead <= 0) {
+      stream->eof = (bytesRead == 0);
+      return NULL;
     }
   }
-  stream->lastop = 'r';
-  return (numberRead / size);
+  *len = stream->actual_size - stream->pos;
+  return &stream->buffer[stream->pos];
 }
 
 //-----------------------------------------------------------------------------
-// fwrite
+// fpeek
+// Calls fpeek_unlocked while holding stream's lock. The bytes lent out are
+// only safe to examine while no other thread uses stream; a caller sharing
+// stream should hold flockfile across fpeek_unlocked and fadvance_unlocked.
+//-----------------------------------------------------------------------------
+const char *fpeek( FILE *stream, size_t *len ) {
+  flockfile(stream);
+  const char *run = fpeek_unlocked(stream, len);
+  funlockfile(stream);
+  return run;
+}
+
+//-----------------------------------------------------------------------------
+// fadvance_unlocked
+// Consumes n bytes previously lent out by fpeek, as though they had been read
+//
+// @pre:   fpeek returned at least n bytes and stream has not been used since
+// @post:  stream->pos is moved forward by n
+// @param  stream:    A pointer to an open FILE object
+// @param  n:         The number of peeked bytes to consume
+// @returns:          0 if successful, EOF if n exceeds the peeked bytes
+//-----------------------------------------------------------------------------
+int fadvance_unlocked( FILE *stream, size_t n ) {
+  if(stream == NULL || stream->buffer == NULL) {
+    errno = EBADF;
+    printf("fadvance error: %s\n", strerror(errno));
+    return EOF;
+  }
+  if(stream->lastop != 'r' ||
+      n > (size_t)(stream->actual_size - stream->pos)) {
+    errno = EINVAL;
+    return EOF;
+  }
+  stream->pos += n;
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// fadvance
+// Calls fadvance_unlocked while holding stream's lock
+//-----------------------------------------------------------------------------
+int fadvance( FILE *stream, size_t n ) {
+  flockfile(stream);
+  int result = fadvance_unlocked(stream, n);
+  funlockfile(stream);
+  return result;
+}
+
+// fwrite_unlocked
 // Writes data from a buffer (str) in the amount of the number of bytes (size)
 // for each number of blocks (nmemb) into stream->buffer and returns the number
-// of blocks read.
+// of blocks read. A line buffered stream is flushed if the data has a '\n'.
+// A request of at least a buffer's worth is not copied: it is written with
+// whatever is buffered in one writev( ).
 //
 // @pre:   stream represents an open FILE, size == sizeof(char)
 // @post:  stream->buffer is filled with contents of ptr of size * nmemb bytes
@@ -389,81 +1612,225 @@ size_t fread( void *ptr, size_t size, size_t nmemb, FILE *stream ) {
 // @param stream:     An open FILE pointer
 // @returns:          Returns the number of blocks written successfully
 //-----------------------------------------------------------------------------
-size_t fwrite( const void *ptr, size_t size, size_t nmemb, FILE *stream ) {
+size_t fwrite_unlocked( const void *ptr, size_t size, size_t nmemb,
+    FILE *stream ) {
   if (nmemb <= 0 || ptr == NULL || size != sizeof(char)) {
     errno = EBADFD;
-    printf("fread error: %d\n", strerror(errno));
+    printf("fwrite error: %s\n", strerror(errno));
     return EOF;
   }
-  if(stream == NULL) {
-    errno = EBADF;
-    printf("fread error: %d\n", strerror(errno));
+  if(stream == NULL || stream->map != NULL || stream->cache != NULL ||
+      stream->share != NULL) {
+    errno = EBADF;    // the buffer of these is the file's data, not ours
+    printf("fwrite error: %s\n", strerror(errno));
+    return EOF;
+  }
+  if(stream->mem != NULL && (stream->flag & O_ACCMODE) == O_RDONLY) {
+    errno = EBADF;    // the memory is the caller's, opened for reading
+    printf("fwrite error: %s\n", strerror(errno));
     return EOF;
   }
-  int sizeLeft = 0;
-  int numberWritten = 0;
+  if(stream->update) {
+    fupdateturn(stream, 'w');
+  }
+  else if(stream->lastop == 'r' && stream->buffer != NULL) {
+    if(fflush_unlocked(stream) == EOF) {
+      return EOF;
+    }
+  }
+  stream->lastop = 'w';
+  size_t sizeLeft = 0;
+  size_t numberWritten = 0;
   size_t totalToWrite = size * nmemb;
   char *buffer = (char*)ptr;
+  bool newline = false;
+  if(totalToWrite > (size_t)stream->bufneed) {
+    stream->bufneed = (totalToWrite < (size_t)BUFMAX) ? totalToWrite : BUFMAX;
+  }
 
   if(stream->mode == _IONBF) {
-    return (write(stream->fd, buffer, (totalToWrite)));
+    long bytesWritten = (stream->mem != NULL) ?
+        fmemwrite(stream, buffer, totalToWrite) :
+        write(stream->fd, buffer, totalToWrite);
+    stream->stats.writes++;
+    stream->stats.byteswritten += (bytesWritten > 0) ? bytesWritten : 0;
+    return bytesWritten;
   }
-  if(stream->pos == stream->size) {
-    fflush(stream);
+  if(totalToWrite >= (size_t)stream->size && fbypass(stream)) {
+    // too large to stage in the buffer: write it along with what is buffered
+    return (fwritev(stream, buffer, totalToWrite) / size);
   }
   while(numberWritten < totalToWrite) {
+    if(stream->pos == stream->size) {
+      if(fwritebuf(stream) == EOF) {
+        return (numberWritten / size);
+      }
+    }
     sizeLeft = stream->size - stream->pos;
-    if((totalToWrite - numberWritten) <= sizeLeft) {
-      memcpy(&stream->buffer[stream->pos], buffer,
-          (totalToWrite - numberWritten));
-      stream->pos += (totalToWrite  - numberWritten);
-      numberWritten += (totalToWrite - numberWritten);
+    if((totalToWrite - numberWritten) < sizeLeft) {
+      sizeLeft = totalToWrite - numberWritten;
     }
-    else {
-      memcpy(&stream->buffer[stream->pos], buffer, sizeLeft);
-      stream->pos = stream->size;
-      numberWritten += sizeLeft;
+    memcpy(&stream->buffer[stream->pos], &buffer[numberWritten], sizeLeft);
+    stream->stats.copied += sizeLeft;
+    // line buffered: only the bytes just appended need to be searched
+    if(stream->mode == _IOLBF && !newline &&
+        memchr(&stream->buffer[stream->pos], CR_LF, sizeLeft) != NULL) {
+      newline = true;
+    }
+    stream->pos += sizeLeft;
+    numberWritten += sizeLeft;
+  }
+  if(newline && fwritebuf(stream) == EOF) {
+    return EOF;
+  }
+  return (numberWritten / size);
+}
+
+//-----------------------------------------------------------------------------
+// fwrite
+// Calls fwrite_unlocked while holding stream's lock
+//-----------------------------------------------------------------------------
+size_t fwrite( const void *ptr, size_t size, size_t nmemb, FILE *stream ) {
+  flockfile(stream);
+  size_t numberWritten = fwrite_unlocked(ptr, size, nmemb, stream);
+  funlockfile(stream);
+  return numberWritten;
+}
+
+//-----------------------------------------------------------------------------
+// _filbuf
+// The out-of-line half of getc: called once the buffered data is used up (or
+// the stream was last written), it refills stream->buffer and returns its
+// first character. Unbuffered streams read the character directly.
+//
+// @pre:   None
+// @post:  stream->buffer is refilled and its first character consumed
+// @param  stream:     A pointer to an open FILE object
+// @returns:          The character read if successful, EOF if it fails
+//-----------------------------------------------------------------------------
+int _filbuf( FILE *stream ) {
+  if(stream == NULL) {
+    errno = EBADF;
+    printf("fgetc error: %s\n", strerror(errno));
+    return EOF;
+  }
+  if(stream->eof) {
+    return EOF;
+  }
+  if(stream->buffer == NULL) {
+    unsigned char charRead = '\0';
+    return (fread_unlocked(&charRead, sizeof(char), 1, stream) == 1) ?
+        charRead : EOF;
+  }
+  if(stream->update) {
+    fupdateturn(stream, 'r');
+  }
+  else if(stream->lastop == 'w') {
+    if(fflush_unlocked(stream) == EOF) {
+      return EOF;
+    }
+  }
+  stream->lastop = 'r';
+  if(stream->pos == stream->actual_size) {
+    int bytesRead = frefill(stream);
+    if(bytesRead <= 0) {
+      stream->eof = (bytesRead == 0);
+      return EOF;
+    }
+  }
+  return (unsigned char)stream->buffer[stream->pos++];
+}
+
+//-----------------------------------------------------------------------------
+// _flsbuf
+// The out-of-line half of putc: called once stream->buffer is full (or the
+// stream was last read, or c ends a line of a line buffered stream), it
+// flushes the buffer as needed and stores c. Unbuffered streams write the
+// character directly.
+//
+// @pre:   None
+// @post:  c is stored in stream->buffer or written to the file
+// @param  c:         A single character to be written
+// @param  stream:    A pointer to an open FILE object
+// @returns:          The character written if successful, EOF if it fails
+//-----------------------------------------------------------------------------
+int _flsbuf( int c, FILE *stream ) {
+  if(stream == NULL || stream->map != NULL || stream->cache != NULL ||
+      stream->share != NULL || (stream->mem != NULL &&
+      (stream->flag & O_ACCMODE) == O_RDONLY)) {
+    errno = EBADF;
+    printf("fputc error: %s\n", strerror(errno));
+    return EOF;
+  }
+  unsigned char charWritten = c;
+  if(stream->buffer == NULL) {
+    stream->stats.writes++;
+    if(((stream->mem != NULL) ? fmemwrite(stream, (char *)&charWritten, 1) :
+        write(stream->fd, &charWritten, 1)) != 1) {
+      return EOF;
     }
-    if(stream->pos == stream->size && numberWritten < totalToWrite) {
-      fflush(stream);
+    stream->stats.byteswritten++;
+    return charWritten;
+  }
+  if(stream->update) {
+    fupdateturn(stream, 'w');
+  }
+  else if(stream->lastop == 'r') {
+    if(fflush_unlocked(stream) == EOF) {
+      return EOF;
     }
   }
   stream->lastop = 'w';
-  return (numberWritten / size);
+  if(stream->pos == stream->size) {
+    if(fwritebuf(stream) == EOF) {
+      return EOF;
+    }
+  }
+  stream->buffer[stream->pos++] = charWritten;
+  if(stream->mode == _IOLBF && charWritten == CR_LF) {
+    if(fwritebuf(stream) == EOF) {
+      return EOF;
+    }
+  }
+  return charWritten;
 }
 
 //-----------------------------------------------------------------------------
-// fgetc
+// fgetc_unlocked
 // Reads a single character from a FILE object, stores the character in
 // stream->buffer if fully-buffered, and returns that character.
+// A checked wrapper around the inline getc in stdio.h.
 //
 // @pre:   stream represents an open FILE
 // @post:  stream->buffer is filled with the last chars read up to stream->size
 // @param  stream:     A pointer to an open FILE object
 // @returns:          The character read if successful, EOF if it fails
 //-----------------------------------------------------------------------------
-int fgetc( FILE *stream ) {
-  unsigned char charRead = '\0';
-  int bytesRead;
-
+int fgetc_unlocked( FILE *stream ) {
   if (stream == NULL) {
     errno = EBADF;
-    printf("fgetc error: %d\n", strerror(errno));
-    return EOF;
-  }
-  if(stream->eof) {
+    printf("fgetc error: %s\n", strerror(errno));
     return EOF;
   }
-  if(fread(&charRead, sizeof(char), 1, stream) < 0) {
-   return EOF;
-  }
+  return getc_unlocked(stream);
+}
+
+//-----------------------------------------------------------------------------
+// fgetc
+// Calls fgetc_unlocked while holding stream's lock
+//-----------------------------------------------------------------------------
+int fgetc( FILE *stream ) {
+  flockfile(stream);
+  int charRead = fgetc_unlocked(stream);
+  funlockfile(stream);
   return charRead;
 }
 
 //-----------------------------------------------------------------------------
-// fputc
+// fputc_unlocked
 // Writes a single character (int c) to the stream->buffer, and calls fflush()
 // if that buffer is full to output to file pointed to by stream
+// A checked wrapper around the inline putc in stdio.h.
 //
 // @pre:   stream represents an open FILE and c is not a NULL character
 // @post:  int c parameter is written into stream->buffer
@@ -471,71 +1838,237 @@ int fgetc( FILE *stream ) {
 // @param  c:         A single character to be written
 // @returns:          The character written if successful, EOF if it fails
 //-----------------------------------------------------------------------------
-int fputc( int c, FILE *stream ) {
+int fputc_unlocked( int c, FILE *stream ) {
   if(stream == NULL) {
     errno = EBADF;
-    printf("fputc error: %d\n", strerror(errno));
+    printf("fputc error: %s\n", strerror(errno));
     return EOF;
   }
-  if(stream->mode == _IONBF) {
-    write(stream->fd, &c, sizeof(char));
-  }
-  else {
-    if(fwrite(&c, sizeof(char), 1, stream) < 0) {
-      return EOF;
-    }
-  }
-  stream->lastop = 'w';
-  return c;
+  return putc_unlocked(c, stream);
 }
 
 //-----------------------------------------------------------------------------
-// fgets
+// fputc
+// Calls fputc_unlocked while holding stream's lock
+//-----------------------------------------------------------------------------
+int fputc( int c, FILE *stream ) {
+  flockfile(stream);
+  int charWritten = fputc_unlocked(c, stream);
+  funlockfile(stream);
+  return charWritten;
+}
+
+//-----------------------------------------------------------------------------
+// fgets_unlocked
 // Reads from the file pointed to by FILE *stream and stores characters in *str
-// up to int size, or until it encounters a '\n'.
+// up to int size, or until it encounters a '\n'. The buffered data is searched
+// with memchr and copied a run at a time rather than one fgetc per character.
 //
 // @pre:   stream represents an open FILE and *str is not NULL
 // @post:  *str buffer is filled up to size or until a '\n'
 // @param  stream:    A pointer to an open FILE object
 // @param: size:      The number of characters to read into the buffer
 // @param *str:       The buffer to read characters into
-// @returns:          *str if successful, or NULL if it fails
+// @returns:          *str if successful, an empty *str if size == 1, or
+//                    NULL if size <= 0 or if the end of the file or an error
+//                    came before any character
 //-----------------------------------------------------------------------------
-char *fgets( char *str, int size, FILE *stream ) {
+char *fgets_unlocked( char *str, int size, FILE *stream ) {
   if(stream == NULL || str == NULL) {
     errno = EBADF;
-    printf("fgets error: %d\n", strerror(errno));
+    printf("fgets error: %s\n", strerror(errno));
+    return NULL;
+  }
+  if(size <= 0) {
     return NULL;
   }
+  if(size == 1) {
+    str[0] = NULL_CHAR;   // room for the terminator only, as in C
+    return str;
+  }
   if(stream->eof) {
     return NULL;
   }
-  char charRead = NULL_CHAR;
   int numberRead = 0;
-  for(int i = 0; i < (size - 1); i++, numberRead++) {
-    charRead = fgetc(stream);
-    if (stream->eof) {
-      str[i] = charRead;
-      numberRead++;
-      break;
-    }
-    else {
-      str[i] = charRead;
+  if(stream->buffer == NULL) {
+    int charRead = NULL_CHAR;
+    while(numberRead < (size - 1) && (charRead = getc_unlocked(stream)) != EOF) {
+      str[numberRead++] = charRead;
       if(charRead == CR_LF) {
-        numberRead++;
+        break;
+      }
+    }
+  }
+  else {
+    const char *run;
+    size_t runLength;
+    while(numberRead < (size - 1) &&
+        (run = fpeek_unlocked(stream, &runLength)) != NULL) {
+      if(runLength > (size_t)(size - 1 - numberRead)) {
+        runLength = size - 1 - numberRead;
+      }
+      const char *newline = (const char *)memchr(run, CR_LF, runLength);
+      if(newline != NULL) {
+        runLength = newline - run + 1;
+      }
+      memcpy(&str[numberRead], run, runLength);
+      stream->stats.copied += runLength;
+      numberRead += runLength;
+      stream->pos += runLength;
+      if(newline != NULL) {
         break;
       }
     }
   }
   str[numberRead] = NULL_CHAR;
-  stream->lastop = 'r';
-  return str;
+  return (numberRead > 0) ? str : NULL;
 }
 
 //-----------------------------------------------------------------------------
-// fputs
+// fgets
+// Calls fgets_unlocked while holding stream's lock
+//-----------------------------------------------------------------------------
+char *fgets( char *str, int size, FILE *stream ) {
+  flockfile(stream);
+  char *result = fgets_unlocked(str, size, stream);
+  funlockfile(stream);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+// getdelim
+// Reads from stream up to and including the next delim character into
+// *lineptr, growing it with realloc as needed, so lines of any length can be
+// read without knowing a maximum. As with fgets, runs of buffered data are
+// found with memchr and copied whole.
+//
+// @pre:   stream represents an open FILE, *lineptr is NULL or was allocated
+//         with malloc and holds *n bytes
+// @post:  *lineptr holds the '\0'-terminated line, *n its allocated size
+// @param  lineptr:   The address of a malloc'ed buffer or of NULL
+// @param  n:         The address of the size of *lineptr
+// @param  delim:     The character ending a line
+// @param  stream:    A pointer to an open FILE object
+// @returns:          The number of characters read, delim included, or EOF
+//                    at end of file or on error
+//-----------------------------------------------------------------------------
+ssize_t getdelim( char **lineptr, size_t *n, int delim, FILE *stream ) {
+  if(stream == NULL || lineptr == NULL || n == NULL) {
+    errno = EINVAL;
+    printf("getdelim error: %s\n", strerror(errno));
+    return EOF;
+  }
+  if(*lineptr == NULL) {
+    *n = 0;
+  }
+  size_t numberRead = 0;
+  bool found = false;
+  flockfile(stream);
+  while(!found) {
+    char oneChar;
+    const char *run;
+    size_t runLength;
+    if(stream->buffer == NULL) {
+      int charRead = getc_unlocked(stream);
+      if(charRead == EOF) {
+        break;
+      }
+      oneChar = charRead;
+      run = &oneChar;
+      runLength = 1;
+    }
+    else if((run = fpeek_unlocked(stream, &runLength)) == NULL) {
+      break;
+    }
+    const char *end = (const char *)memchr(run, delim, runLength);
+    if(end != NULL) {
+      runLength = end - run + 1;
+      found = true;
+    }
+    if(numberRead + runLength + 1 > *n) {
+      size_t newSize = (*n > 0) ? *n : 120;
+      while(numberRead + runLength + 1 > newSize) {
+        newSize *= 2;
+      }
+      char *grown = (char *)realloc(*lineptr, newSize);
+      if(grown == NULL) {
+        funlockfile(stream);
+        errno = ENOMEM;
+        return EOF;
+      }
+      *lineptr = grown;
+      *n = newSize;
+    }
+    memcpy(&(*lineptr)[numberRead], run, runLength);
+    stream->stats.copied += runLength;
+    numberRead += runLength;
+    if(stream->buffer != NULL) {
+      stream->pos += runLength;
+    }
+  }
+  funlockfile(stream);
+  if(numberRead == 0) {
+    return EOF;
+  }
+  (*lineptr)[numberRead] = NULL_CHAR;
+  return numberRead;
+}
+
+//-----------------------------------------------------------------------------
+// getline
+// Calls getdelim to read a whole line ending in '\n'
+//
+// @pre:   As for getdelim
+// @post:  *lineptr holds the '\0'-terminated line, *n its allocated size
+// @param  lineptr:   The address of a malloc'ed buffer or of NULL
+// @param  n:         The address of the size of *lineptr
+// @param  stream:    A pointer to an open FILE object
+// @returns:          The number of characters read, or EOF
+//-----------------------------------------------------------------------------
+ssize_t getline( char **lineptr, size_t *n, FILE *stream ) {
+  return getdelim(lineptr, n, CR_LF, stream);
+}
+
+//-----------------------------------------------------------------------------
+// fcountlines
+// Consumes the rest of stream and counts its lines by searching each buffer
+// refill for '\n' with memchr, without copying any data out. A last line
+// without a trailing '\n' is counted too.
+//
+// @pre:   stream represents an open, buffered FILE
+// @post:  stream is at EOF
+// @param  stream:    A pointer to an open FILE object
+// @returns:          The number of lines read, or EOF on error
+//-----------------------------------------------------------------------------
+long fcountlines( FILE *stream ) {
+  if(stream == NULL || stream->buffer == NULL) {
+    errno = EBADF;
+    printf("fcountlines error: %s\n", strerror(errno));
+    return EOF;
+  }
+  long lines = 0;
+  char last = CR_LF;
+  const char *run;
+  size_t runLength;
+  flockfile(stream);
+  while((run = fpeek_unlocked(stream, &runLength)) != NULL) {
+    const char *end = run + runLength;
+    for(const char *p = run; (p = (const char *)memchr(p, CR_LF, end - p))
+        != NULL; p++) {
+      lines++;
+    }
+    last = end[-1];
+    stream->pos += runLength;
+  }
+  funlockfile(stream);
+  return (last == CR_LF) ? lines : lines + 1;
+}
+
+//-----------------------------------------------------------------------------
+// fputs_unlocked
 // Writes all chars contained in const char *str to stream->buffer up until it
 // encounters the char '\0', and flushes stream->buffer if it becomes full
+// (or, if stream is line buffered, if str contains a '\n')
 //
 // @pre:   stream represents an open FILE, *str is not NULL and has a '\0' char
 // @post:  stream->buffer is filled with contents of *str, and flushed if full
@@ -543,29 +2076,32 @@ char *fgets( char *str, int size, FILE *stream ) {
 // @param  *str:      The char buffer to write to file
 // @returns:          0 if successful, EOF if it fails
 //-----------------------------------------------------------------------------
-int fputs( const char *str, FILE *stream ) {
+int fputs_unlocked( const char *str, FILE *stream ) {
   if(stream == NULL || str == NULL) {
     errno = EBADF;
-    printf("fputs error: %d\n", strerror(errno));
+    printf("fputs error: %s\n", strerror(errno));
+    return EOF;
+  }
+  size_t length = strlen(str);
+  if(length > 0 && fwrite_unlocked(str, sizeof(char), length, stream) != length) {
+    errno = EBADFD;
+    printf("fputs error: %s\n", strerror(errno));
     return EOF;
   }
-  char charRead = NULL_CHAR;
-  int currentIndex = 0;
-  do {
-    charRead = str[currentIndex];
-    if(charRead != NULL_CHAR) {
-      if(fputc(charRead, stream) == EOF) {
-        errno = EBADFD;
-        printf("fputc error: %d\n", strerror(errno));
-        return EOF;
-      }
-    }
-    currentIndex++;
-  }while(charRead != NULL_CHAR);
-  stream->lastop = 'w';
   return 0;
 }
 
+//-----------------------------------------------------------------------------
+// fputs
+// Calls fputs_unlocked while holding stream's lock
+//-----------------------------------------------------------------------------
+int fputs( const char *str, FILE *stream ) {
+  flockfile(stream);
+  int result = fputs_unlocked(str, stream);
+  funlockfile(stream);
+  return result;
+}
+
 //-----------------------------------------------------------------------------
 // feof
 // Writes a single character (int c) to the stream->buffer, and calls fflush()
@@ -580,9 +2116,30 @@ int feof( FILE *stream ) {
   return stream->eof == true;
 }
 
+//-----------------------------------------------------------------------------
+// flseek
+// Calls lseek on the file descriptor of stream, or moves the position of a
+// memory stream, counting the call
+//-----------------------------------------------------------------------------
+off_t flseek( FILE *stream, off_t offset, int whence ) {
+  stream->stats.seeks++;
+  if(stream->mem != NULL) {
+    return fmemseek(stream, offset, whence);
+  }
+  return lseek(stream->fd, offset, whence);
+}
+
 //-----------------------------------------------------------------------------
 // fseek
 // Changes the current position pointer within FILE stream based on parameters
+// A mapped stream only moves its window and a cached stream only records the
+// new position, no system call is made. Neither is
+// one made when a buffered read lands inside the bytes already in
+// stream->buffer: only stream->pos moves and the buffer is kept. An update
+// stream keeps its window whether it was reading or writing, and leaving it
+// writes back the dirty bytes without moving the file position; if that
+// fails, fseek fails and the window stays in place, still dirty. A stream
+// with a checksum cannot seek, as it sums the bytes it passes in order.
 //
 // @pre:   stream is an open FILE.
 // @post:  The current position pointer in FILE stream is changed accordingly
@@ -594,14 +2151,171 @@ int feof( FILE *stream ) {
 int fseek( FILE *stream, long offset, int whence ) {
   if(stream == NULL) {
     errno = EBADF;
-    printf("fseek error: %d\n", strerror(errno));
+    printf("fseek error: %s\n", strerror(errno));
     return EOF;
   }
-  fflush(stream);
+  if(stream->checksum) {
+    errno = EINVAL;
+    printf("fseek error: %s\n", strerror(errno));
+    return EOF;
+  }
+  flockfile(stream);
   stream->eof = false;
-  stream->actual_size = 0;
-  stream->pos = 0;
-  return lseek(stream->fd, offset, whence);
+  if(stream->map != NULL) {
+    long current = (stream->buffer - stream->map) + stream->pos;
+    long target = (whence == SEEK_SET) ? offset :
+                  (whence == SEEK_CUR) ? current + offset :
+                  (whence == SEEK_END) ? stream->mapsize + offset : -1;
+    if(target >= 0 && target <= stream->mapsize) {
+      mapwindow(stream, target);
+      stream->stats.seekhits++;
+    }
+    funlockfile(stream);
+    if(target < 0 || target > stream->mapsize) {
+      errno = EINVAL;
+      return EOF;
+    }
+    return 0;
+  }
+  if(stream->cache != NULL) {
+    int result = fcacheseek(stream, offset, whence);
+    funlockfile(stream);
+    return result;
+  }
+  if(stream->zip != NULL) {
+    int result = fzipseek(stream, offset, whence);
+    funlockfile(stream);
+    return result;
+  }
+  if(stream->update) {
+    fupdateturn(stream, 'r');   // so pos may move anywhere in the window
+    stream->lastop = 'r';
+  }
+  if(stream->buffer != NULL && stream->offset >= 0 && whence != SEEK_END) {
+    long target = (whence == SEEK_SET) ? offset :
+        stream->offset + stream->pos + offset;
+    if(target < 0) {
+      funlockfile(stream);
+      errno = EINVAL;
+      return EOF;
+    }
+    if(stream->lastop == 'r' && target >= stream->offset &&
+        target <= stream->offset + stream->actual_size) {
+      stream->pos = target - stream->offset;
+      stream->stats.seekhits++;
+      funlockfile(stream);
+      return 0;
+    }
+    // the file position is past stream->buffer until it is flushed
+    offset = target;
+    whence = SEEK_SET;
+  }
+  if(stream->update) {
+    if(fupdateflush(stream) == EOF) {
+      funlockfile(stream);
+      return EOF;   // the window stays, with the bytes still dirty
+    }
+  }
+  else if(stream->buffer != NULL &&
+      (stream->lastop == 'w' || stream->ring != NULL)) {
+    fflush_unlocked(stream);
+  }
+  else if(stream->buffer != NULL) {
+    fpurge(stream);   // the file position is moved next, unread bytes or not
+  }
+  stream->stats.seekmisses++;
+  stream->actual_size = 0;
+  stream->pos = 0;
+  // update streams and cursors refill with pread( ), so only need the offset
+  off_t result = ((stream->update || stream->share != NULL) &&
+      whence == SEEK_SET) ? offset : flseek(stream, offset, whence);
+  if(result == -1) {
+    stream->offset = flseek(stream, 0, SEEK_CUR);
+    funlockfile(stream);
+    return EOF;
+  }
+  stream->offset = result;
+  stream->raoffset = stream->raend = result;
+  stream->rarun = 0;
+  fshrink(stream);
+  funlockfile(stream);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// ftell_unlocked
+// Returns the current position in FILE stream, counting the bytes read from
+// or written to stream->buffer, without a system call as long as the file
+// offset of stream->buffer is known
+//
+// @pre:   stream is an open FILE
+// @post:  A stream in append mode is flushed if it was last written
+// @param  stream:    A pointer to an open FILE object
+// @returns:          The offset from the start of the file, or -1 on error
+//-----------------------------------------------------------------------------
+long ftell_unlocked( FILE *stream ) {
+  if(stream == NULL) {
+    errno = EBADF;
+    printf("ftell error: %s\n", strerror(errno));
+    return -1;
+  }
+  if(stream->buffer == NULL) {
+    return flseek(stream, 0, SEEK_CUR);
+  }
+  // appended data goes to the end of the file, wherever that is by now;
+  // compressed streams count their own data instead
+  if((stream->offset < 0 || ((stream->flag & O_APPEND) && stream->zip == NULL))
+      && stream->lastop == 'w' && fflush_unlocked(stream) == EOF) {
+    return -1;
+  }
+  if(stream->offset < 0) {
+    return flseek(stream, 0, SEEK_CUR);  // fails with ESPIPE on a pipe
+  }
+  return stream->offset + stream->pos;
+}
+
+//-----------------------------------------------------------------------------
+// ftell
+// Calls ftell_unlocked while holding stream's lock
+//-----------------------------------------------------------------------------
+long ftell( FILE *stream ) {
+  flockfile(stream);
+  long result = ftell_unlocked(stream);
+  funlockfile(stream);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+// fgetpos
+// Stores the current position in FILE stream for a later fsetpos
+//
+// @pre:   stream is an open FILE
+// @post:  *pos holds the current position
+// @param  stream:    A pointer to an open FILE object
+// @param  pos:       Receives the position
+// @returns:          0 if successful, -1 otherwise
+//-----------------------------------------------------------------------------
+int fgetpos( FILE *stream, fpos_t *pos ) {
+  long result = ftell(stream);
+  if(result == -1) {
+    return -1;
+  }
+  *pos = result;
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fsetpos
+// Returns FILE stream to a position stored by fgetpos
+//
+// @pre:   stream is an open FILE, pos was filled in by fgetpos on stream
+// @post:  The current position in FILE stream is *pos
+// @param  stream:    A pointer to an open FILE object
+// @param  pos:       The position to return to
+// @returns:          0 if successful, EOF otherwise
+//-----------------------------------------------------------------------------
+int fsetpos( FILE *stream, const fpos_t *pos ) {
+  return fseek(stream, *pos, SEEK_SET);
 }
 
 //-----------------------------------------------------------------------------
@@ -611,23 +2325,3994 @@ int fseek( FILE *stream, long offset, int whence ) {
 // @pre:   stream represents an open FILE
 // @post:  File pointed to by stream is closed and stream->buffer is flushed
 // @param  stream:    A pointer to an open FILE object
-// @returns:          0 if fclose is successful, EOF (-1) otherwise
+// @returns:          0 if fclose is successful, EOF (-1) if the buffered data,
+//                    a background write or the close failed, with errno of
+//                    the first failure
 //-----------------------------------------------------------------------------
 int fclose( FILE *stream ) {
   if(stream != NULL) {
-    fflush(stream);
-    if(close(stream->fd) != 0) {
-      return EOF;
+    flockfile(stream);
+    int result = 0;   // EOF once a step has failed
+    int error = 0;    // errno of the first step that failed
+    if((stream->update) ? fupdateflush(stream) == EOF :
+        stream->buffer != NULL && fflush_unlocked(stream) == EOF) {
+      result = EOF;
+      error = errno;
+    }
+    if(stream->async != NULL && fasyncstop(stream) == EOF && result == 0) {
+      result = EOF;
+      error = errno;
+    }
+    if(stream->ring != NULL) {
+      furingdetach(stream);
+    }
+    if(stream->cache != NULL) {
+      fcachestop(stream);
+    }
+    if(stream->zip != NULL) {
+      fzipfree(stream->zip);
+      stream->zip = NULL;
+    }
+    funlockfile(stream);
+    if(stream->map != NULL) {
+      munmap(stream->map, stream->mapsize);
+    }
+    int closed = (stream->mem != NULL) ? fmemclose(stream) :
+        (stream->share != NULL) ? fshareclose(stream) : close(stream->fd);
+    if(closed != 0 && result == 0) {
+      result = EOF;
+      error = errno;
     }
     if(stream->bufown) {
-      delete [] stream;
-      stream = NULL;
+      fbuffree(stream->buffer, stream->size);
+    }
+    if(stream != stdin && stream != stdout && stream != stderr) {
+      fstatsadd(&closedStats, &stream->stats);
+      delete stream;
+    }
+    if(result == EOF) {
+      errno = error;
+      return EOF;
     }
   }
   else {
     errno = EBADF;
-    printf("fclose error: %d\n", strerror(errno));
+    printf("fclose error: %s\n", strerror(errno));
+    return EOF;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fthreadself
+// Identifies the calling thread by the address of a thread-local variable,
+// which is cheaper than any system call
+//
+// @returns:          A value unique to the calling thread while it runs
+//-----------------------------------------------------------------------------
+long fthreadself( ) {
+  static __thread char threadTag;
+  return (long)&threadTag;
+}
+
+//-----------------------------------------------------------------------------
+// ftrylockfile
+// Takes stream's lock if it is free or already held by the calling thread
+//
+// @pre:   None
+// @post:  The calling thread holds stream's lock once more if successful
+// @param  stream:    A pointer to an open FILE object
+// @returns:          0 if the lock was taken, nonzero otherwise
+//-----------------------------------------------------------------------------
+int ftrylockfile( FILE *stream ) {
+  if(stream == NULL) {
+    return 0;
+  }
+  long self = fthreadself();
+  if(__atomic_load_n(&stream->owner, __ATOMIC_RELAXED) == self) {
+    stream->lockcount++;
+    return 0;
+  }
+  if(__libc_single_threaded) {  // no other thread to exclude
+    stream->lock = 1;
+    stream->owner = self;
+    stream->lockcount = 1;
+    return 0;
+  }
+  int unlocked = 0;
+  if(!__atomic_compare_exchange_n(&stream->lock, &unlocked, 1, false,
+      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return 1;
+  }
+  __atomic_store_n(&stream->owner, self, __ATOMIC_RELAXED);
+  stream->lockcount = 1;
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// flockfile
+// Takes stream's lock, waiting for other threads to release it. The lock is
+// recursive, so a thread holding it may keep calling the locked functions.
+// An uncontended lock costs one compare-and-swap, and none at all while the
+// process has a single thread; only contended locks sleep on a futex.
+//
+// @pre:   None
+// @post:  The calling thread holds stream's lock once more
+// @param  stream:    A pointer to an open FILE object, or NULL to do nothing
+//-----------------------------------------------------------------------------
+void flockfile( FILE *stream ) {
+  if(ftrylockfile(stream) == 0) {
+    return;
+  }
+  // lock is 0 when free, 1 when held and 2 when threads may be waiting
+  int state = __atomic_exchange_n(&stream->lock, 2, __ATOMIC_ACQUIRE);
+  while(state != 0) {
+    syscall(SYS_futex, &stream->lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+    state = __atomic_exchange_n(&stream->lock, 2, __ATOMIC_ACQUIRE);
+  }
+  __atomic_store_n(&stream->owner, fthreadself(), __ATOMIC_RELAXED);
+  stream->lockcount = 1;
+}
+
+//-----------------------------------------------------------------------------
+// funlockfile
+// Releases one hold of stream's lock, waking a waiting thread once the
+// calling thread no longer holds it at all
+//
+// @pre:   The calling thread holds stream's lock
+// @post:  The lock is released once per matching flockfile
+// @param  stream:    A pointer to an open FILE object, or NULL to do nothing
+//-----------------------------------------------------------------------------
+void funlockfile( FILE *stream ) {
+  if(stream == NULL || --stream->lockcount > 0) {
+    return;
+  }
+  __atomic_store_n(&stream->owner, 0, __ATOMIC_RELAXED);
+  if(__libc_single_threaded) {
+    stream->lock = 0;
+    return;
+  }
+  if(__atomic_exchange_n(&stream->lock, 0, __ATOMIC_RELEASE) == 2) {
+    syscall(SYS_futex, &stream->lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Struct:        fasync
+//
+// Description:   The write-behind state of a FILE: a bounded ring of full
+//                buffers waiting for the background writer thread, and the
+//                spare buffers the producer switches to meanwhile.
+//-----------------------------------------------------------------------------
+struct fasync {
+  pthread_t writer;        // the background writer thread
+  pthread_mutex_t mutex;   // guards everything below
+  pthread_cond_t queued;   // signalled when a buffer is queued or on stop
+  pthread_cond_t written;  // signalled when a queued buffer has been written
+  char **queue;            // full buffers in the order they were handed off
+  int *lengths;            // the number of bytes to write from each of them
+  char **spare;            // empty buffers the producer may switch to
+  char **buffers;          // the buffers allocated for write-behind
+  char *original;          // stream->buffer before write-behind was set up
+  int depth;               // the most buffers in flight at once
+  int head;                // the queue slot to be written next
+  int count;               // the number of queued or in flight buffers
+  int spares;              // the number of spare buffers
+  int error;               // errno of the first failed background write
+  bool stop;               // tells the writer to exit once the queue is empty
+};
+
+//-----------------------------------------------------------------------------
+// fasyncwriter
+// The background writer: write( )s queued buffers in order until told to
+// stop, returning each one to the spare pool once it is written
+//
+// @param  arg:       The FILE with write-behind set up
+// @returns:          NULL
+//-----------------------------------------------------------------------------
+void *fasyncwriter( void *arg ) {
+  FILE *stream = (FILE *)arg;
+  fasync *async = stream->async;
+  pthread_mutex_lock(&async->mutex);
+  while(true) {
+    while(async->count == 0 && !async->stop) {
+      pthread_cond_wait(&async->queued, &async->mutex);
+    }
+    if(async->count == 0) {
+      break;
+    }
+    char *data = async->queue[async->head];
+    int length = async->lengths[async->head];
+    pthread_mutex_unlock(&async->mutex);
+
+    int error = 0;
+    int written = 0;
+    while(written < length) {
+      int bytesWritten = write(stream->fd, &data[written], length - written);
+      __atomic_fetch_add(&stream->stats.writes, 1, __ATOMIC_RELAXED);
+      if(bytesWritten < 0) {
+        if(errno == EINTR) {
+          continue;
+        }
+        error = errno;
+        break;
+      }
+      written += bytesWritten;
+    }
+    __atomic_fetch_add(&stream->stats.byteswritten, written, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&async->mutex);
+    if(error != 0 && async->error == 0) {
+      async->error = error;
+    }
+    async->head = (async->head + 1) % async->depth;
+    async->count--;
+    async->spare[async->spares++] = data;
+    pthread_cond_broadcast(&async->written);
+  }
+  pthread_mutex_unlock(&async->mutex);
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// fasyncsubmit
+// Queues stream->buffer for the background writer and switches stream to a
+// spare buffer, waiting only if all buffers are already in flight
+//
+// @pre:   stream has write-behind set up and its last operation was a write
+// @post:  stream->buffer is empty
+// @param  stream:    A pointer to an open FILE object
+// @returns:          0, or EOF if a background write has failed
+//-----------------------------------------------------------------------------
+int fasyncsubmit( FILE *stream ) {
+  fasync *async = stream->async;
+  pthread_mutex_lock(&async->mutex);
+  if(stream->pos > 0) {
+    while(async->spares == 0) {
+      pthread_cond_wait(&async->written, &async->mutex);
+    }
+    int tail = (async->head + async->count) % async->depth;
+    async->queue[tail] = stream->buffer;
+    async->lengths[tail] = stream->pos;
+    async->count++;
+    stream->buffer = async->spare[--async->spares];
+    pthread_cond_signal(&async->queued);
+  }
+  int error = async->error;
+  pthread_mutex_unlock(&async->mutex);
+  stream->pos = 0;
+  stream->actual_size = 0;
+  if(error != 0) {
+    errno = error;
+    return EOF;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fasyncwait
+// Waits until the background writer has written every queued buffer, so
+// fflush and fclose remain barriers with write-behind
+//
+// @pre:   stream has write-behind set up
+// @post:  No buffer of stream is in flight
+// @param  stream:    A pointer to an open FILE object
+// @returns:          0, or EOF if a background write has failed
+//-----------------------------------------------------------------------------
+int fasyncwait( FILE *stream ) {
+  fasync *async = stream->async;
+  pthread_mutex_lock(&async->mutex);
+  while(async->count > 0) {
+    pthread_cond_wait(&async->written, &async->mutex);
+  }
+  int error = async->error;
+  pthread_mutex_unlock(&async->mutex);
+  if(error != 0) {
+    errno = error;
+    return EOF;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fasyncfree
+// Frees the write-behind state, which must no longer have a writer thread
+//
+// @param  async:     The write-behind state to free
+//-----------------------------------------------------------------------------
+void fasyncfree( fasync *async ) {
+  for(int i = 0; i < async->depth; i++) {
+    delete [] async->buffers[i];
+  }
+  pthread_mutex_destroy(&async->mutex);
+  pthread_cond_destroy(&async->queued);
+  pthread_cond_destroy(&async->written);
+  delete [] async->queue;
+  delete [] async->lengths;
+  delete [] async->spare;
+  delete [] async->buffers;
+  delete async;
+}
+
+//-----------------------------------------------------------------------------
+// fasyncstop
+// Stops the background writer and gives stream its original buffer back
+//
+// @pre:   stream has write-behind set up and has been flushed
+// @post:  stream->async is NULL and the write-behind buffers are freed
+// @param  stream:    A pointer to an open FILE object
+// @returns:          0, or EOF if a background write has failed
+//-----------------------------------------------------------------------------
+int fasyncstop( FILE *stream ) {
+  fasync *async = stream->async;
+  pthread_mutex_lock(&async->mutex);
+  async->stop = true;
+  pthread_cond_signal(&async->queued);
+  pthread_mutex_unlock(&async->mutex);
+  pthread_join(async->writer, NULL);
+
+  int error = async->error;
+  stream->buffer = async->original;
+  stream->async = NULL;
+  fasyncfree(async);
+  if(error != 0) {
+    errno = error;
+    return EOF;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// setasync
+// Turns write-behind on or off for a buffered output stream. With it on,
+// fwrite and fputc fill one buffer while a background thread write( )s the
+// full ones, so the caller only blocks once inflight buffers are waiting.
+// fflush and fclose wait for every buffer to be written and report the
+// errno of any failed background write.
+//
+// @pre:   stream represents an open, buffered FILE
+// @post:  stream has inflight spare buffers and a writer thread, or none
+// @param  stream:    A pointer to an open FILE object
+// @param  inflight:  The most full buffers that may wait at once, 0 for none
+// @returns:          0 if successful, EOF otherwise
+//-----------------------------------------------------------------------------
+int setasync( FILE *stream, int inflight ) {
+  if(stream == NULL || stream->buffer == NULL || stream->map != NULL ||
+      stream->ring != NULL || stream->cache != NULL || stream->mem != NULL ||
+      stream->direct != 0 || stream->share != NULL || stream->zip != NULL ||
+      inflight < 0 || (stream->checksum && inflight > 0)) {
+    errno = EINVAL;
+    printf("setasync error: %s\n", strerror(errno));
+    return EOF;
+  }
+  flockfile(stream);
+  if(stream->lastop != 0 && fflush_unlocked(stream) == EOF) {
+    funlockfile(stream);
     return EOF;
   }
+  if(stream->async != NULL) {
+    fasyncstop(stream);
+  }
+  int result = 0;
+  if(inflight > 0) {
+    stream->update = false;   // the writer thread goes by the file position
+    fasync *async = new fasync( );
+    async->queue = new char *[inflight];
+    async->lengths = new int[inflight];
+    async->spare = new char *[inflight];
+    async->buffers = new char *[inflight];
+    for(int i = 0; i < inflight; i++) {
+      async->buffers[i] = async->spare[i] = new char[stream->size];
+    }
+    async->original = stream->buffer;
+    async->depth = inflight;
+    async->spares = inflight;
+    pthread_mutex_init(&async->mutex, NULL);
+    pthread_cond_init(&async->queued, NULL);
+    pthread_cond_init(&async->written, NULL);
+    stream->async = async;
+    if(pthread_create(&async->writer, NULL, fasyncwriter, stream) != 0) {
+      stream->async = NULL;
+      fasyncfree(async);
+      result = EOF;
+    }
+  }
+  funlockfile(stream);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+// Struct:        furing
+//
+// Description:   An io_uring shared by the streams a thread opens with 'u':
+//                the mapped submission and completion queues, and the number
+//                of submission entries filled in but not yet handed to the
+//                kernel, so that flushes of many streams go in one syscall.
+//-----------------------------------------------------------------------------
+struct furing {
+  int fd;                  // the io_uring file descriptor
+  pthread_mutex_t mutex;   // guards the queues, and urbusy of every stream
+  unsigned *sqhead;        // the first entry the kernel has not consumed
+  unsigned *sqtail;        // one past the last entry filled in
+  unsigned *sqmask;        // sq_entries - 1
+  unsigned *sqarray;       // indexes into sqes, in submission order
+  io_uring_sqe *sqes;      // the submission entries
+  unsigned *cqhead;        // the first completion not yet reaped
+  unsigned *cqtail;        // one past the last completion posted
+  unsigned *cqmask;        // cq_entries - 1
+  io_uring_cqe *cqes;      // the completion entries
+  void *rings;             // the mapping of both queues
+  size_t ringsize;         // the length of that mapping
+  size_t sqesize;          // the length of the mapping of sqes
+  unsigned entries;        // the number of submission entries
+  unsigned queued;         // entries filled in but not yet submitted
+  int streams;             // the number of streams attached to the ring
+  bool orphan;             // true once the thread that set it up has exited
+};
+
+static __thread furing *threadRing;   // the calling thread's ring, if any
+static __thread bool threadNoRing;    // io_uring could not be set up
+static pthread_key_t furingKey;       // frees a thread's ring when it exits
+static pthread_once_t furingOnce = PTHREAD_ONCE_INIT;
+
+//-----------------------------------------------------------------------------
+// furingfree
+// Unmaps and closes a ring, or, while streams are still attached to it,
+// marks it to be freed when the last of them is closed
+//
+// @param  ring:      The ring of an exiting thread, or one with no streams
+//-----------------------------------------------------------------------------
+void furingfree( void *ring ) {
+  furing *uring = (furing *)ring;
+  pthread_mutex_lock(&uring->mutex);
+  uring->orphan = true;
+  bool unused = (uring->streams == 0);
+  pthread_mutex_unlock(&uring->mutex);
+  if(!unused) {
+    return;
+  }
+  munmap(uring->sqes, uring->sqesize);
+  munmap(uring->rings, uring->ringsize);
+  close(uring->fd);
+  pthread_mutex_destroy(&uring->mutex);
+  delete uring;
+}
+
+//-----------------------------------------------------------------------------
+// furingkey
+// Creates the key whose destructor frees each thread's ring
+//-----------------------------------------------------------------------------
+void furingkey( ) {
+  pthread_key_create(&furingKey, furingfree);
+}
+
+//-----------------------------------------------------------------------------
+// furingget
+// Returns the calling thread's io_uring, setting it up on first use
+//
+// @returns:          The ring, or NULL if this kernel has no usable io_uring
+//-----------------------------------------------------------------------------
+furing *furingget( ) {
+  if(threadRing != NULL || threadNoRing) {
+    return threadRing;
+  }
+  threadNoRing = true;
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, URENTRIES, &params);
+  if(fd < 0) {
+    return NULL;
+  }
+  // one mapping for both queues keeps the setup simple (Linux 5.4 and later),
+  // and an offset of -1 reads and writes at the file position (5.6 and later)
+  if((params.features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+      (params.features & IORING_FEAT_RW_CUR_POS) == 0) {
+    close(fd);
+    return NULL;
+  }
+  size_t sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqsize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  size_t ringsize = (sqsize > cqsize) ? sqsize : cqsize;
+  size_t sqesize = params.sq_entries * sizeof(io_uring_sqe);
+  void *rings = mmap(NULL, ringsize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if(rings == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  void *sqes = mmap(NULL, sqesize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if(sqes == MAP_FAILED) {
+    munmap(rings, ringsize);
+    close(fd);
+    return NULL;
+  }
+
+  furing *ring = new furing( );
+  char *base = (char *)rings;
+  ring->fd = fd;
+  pthread_mutex_init(&ring->mutex, NULL);
+  ring->sqhead = (unsigned *)(base + params.sq_off.head);
+  ring->sqtail = (unsigned *)(base + params.sq_off.tail);
+  ring->sqmask = (unsigned *)(base + params.sq_off.ring_mask);
+  ring->sqarray = (unsigned *)(base + params.sq_off.array);
+  ring->sqes = (io_uring_sqe *)sqes;
+  ring->cqhead = (unsigned *)(base + params.cq_off.head);
+  ring->cqtail = (unsigned *)(base + params.cq_off.tail);
+  ring->cqmask = (unsigned *)(base + params.cq_off.ring_mask);
+  ring->cqes = (io_uring_cqe *)(base + params.cq_off.cqes);
+  ring->rings = rings;
+  ring->ringsize = ringsize;
+  ring->sqesize = sqesize;
+  ring->entries = params.sq_entries;
+
+  pthread_once(&furingOnce, furingkey);
+  pthread_setspecific(furingKey, ring);
+  threadRing = ring;
+  threadNoRing = false;
+  return ring;
+}
+
+//-----------------------------------------------------------------------------
+// furingreap
+// Records every posted completion in the stream it belongs to
+//
+// @pre:   ring->mutex is held
+// @param  ring:      The ring to reap
+//-----------------------------------------------------------------------------
+void furingreap( furing *ring ) {
+  unsigned head = *ring->cqhead;
+  unsigned tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+  while(head != tail) {
+    io_uring_cqe *cqe = &ring->cqes[head & *ring->cqmask];
+    FILE *stream = (FILE *)cqe->user_data;
+    stream->urresult = cqe->res;
+    stream->urbusy = false;
+    head++;
+  }
+  __atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+}
+
+//-----------------------------------------------------------------------------
+// furingenter
+// Hands the queued submission entries to the kernel in one io_uring_enter( ),
+// optionally waiting for a completion, and reaps whatever has completed
+//
+// @pre:   ring->mutex is held
+// @param  ring:      The ring to submit
+// @param  wait:      true to block until at least one operation completes
+// @returns:          0 if successful, -1 with errno set otherwise
+//-----------------------------------------------------------------------------
+int furingenter( furing *ring, bool wait ) {
+  while(true) {
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued,
+                            wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+                            NULL, 0);
+    if(submitted >= 0) {
+      ring->queued -= submitted;
+      break;
+    }
+    if(errno == EBUSY) {        // completions must be reaped to make room
+      furingreap(ring);
+      continue;
+    }
+    if(errno != EINTR) {
+      return -1;
+    }
+  }
+  furingreap(ring);
   return 0;
 }
+
+//-----------------------------------------------------------------------------
+// furingqueue
+// Queues a read into or a write from stream->urbuffer at the file position.
+// Reads are submitted at once so they overlap with the caller; writes wait
+// for URBATCH of them, or for a stream of the ring to need a result.
+//
+// @pre:   stream has no io_uring operation in flight
+// @post:  stream->urbusy is true until the operation completes
+// @param  stream:    A pointer to a FILE attached to an io_uring
+// @param  op:        'r' to read or 'w' to write
+// @param  length:    The number of bytes to transfer
+// @returns:          0 if successful, -1 with errno set otherwise
+//-----------------------------------------------------------------------------
+int furingqueue( FILE *stream, char op, int length ) {
+  furing *ring = stream->ring;
+  pthread_mutex_lock(&ring->mutex);
+  unsigned tail = *ring->sqtail;
+  if(tail - __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE) == ring->entries &&
+     furingenter(ring, false) == -1) {
+    pthread_mutex_unlock(&ring->mutex);
+    return -1;
+  }
+  unsigned index = tail & *ring->sqmask;
+  if(op == 'r') {
+    stream->stats.reads++;
+  }
+  else {
+    stream->stats.writes++;
+  }
+  io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = (op == 'r') ? IORING_OP_READ : IORING_OP_WRITE;
+  sqe->fd = stream->fd;
+  sqe->off = (__u64)-1;           // at, and advancing, the file position
+  sqe->addr = (unsigned long)stream->urbuffer;
+  sqe->len = length;
+  sqe->user_data = (unsigned long)stream;
+  ring->sqarray[index] = index;
+  __atomic_store_n(ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+  ring->queued++;
+  stream->urop = op;
+  stream->urlength = length;
+  stream->urbusy = true;
+  int result = 0;
+  if(op == 'r' || ring->queued >= URBATCH) {
+    result = furingenter(ring, false);
+  }
+  pthread_mutex_unlock(&ring->mutex);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+// furingwait
+// Waits for the io_uring operation of stream to complete, submitting any
+// entries still queued on its ring first
+//
+// @param  stream:    A pointer to a FILE attached to an io_uring
+// @returns:          The result of the operation, a byte count or -errno
+//-----------------------------------------------------------------------------
+int furingwait( FILE *stream ) {
+  furing *ring = stream->ring;
+  pthread_mutex_lock(&ring->mutex);
+  while(stream->urbusy) {
+    if(furingenter(ring, true) == -1) {
+      int error = errno;
+      pthread_mutex_unlock(&ring->mutex);
+      return -error;
+    }
+  }
+  pthread_mutex_unlock(&ring->mutex);
+  return stream->urresult;
+}
+
+//-----------------------------------------------------------------------------
+// furingattach
+// Moves the refills and flushes of stream onto the calling thread's io_uring.
+// The stream gets a second buffer so that it can fill or drain one while the
+// kernel works on the other, and owns both, since the kernel may still be
+// using either one when the caller would take its own buffer back.
+//
+// @pre:   stream is open, buffered, not mapped and has no pending data
+// @post:  stream->ring is set, unless io_uring is unavailable
+// @param  stream:    A pointer to an open FILE object
+// @returns:          true if stream now uses io_uring, false otherwise
+//-----------------------------------------------------------------------------
+bool furingattach( FILE *stream ) {
+  if(stream->buffer == NULL || stream->async != NULL ||
+      stream->cache != NULL || stream->mem != NULL || stream->direct != 0 ||
+      stream->share != NULL) {
+    return false;
+  }
+  furing *ring = furingget();
+  if(ring == NULL) {
+    return false;
+  }
+  pthread_mutex_lock(&ring->mutex);
+  ring->streams++;
+  pthread_mutex_unlock(&ring->mutex);
+  if(!stream->bufown) {
+    stream->buffer = fbufalloc(stream->size);
+    stream->bufown = true;
+  }
+  stream->urbuffer = fbufalloc(stream->size);
+  stream->urop = 0;
+  stream->urbusy = false;
+  stream->ring = ring;
+  stream->update = false;   // io_uring reads and writes at the file position
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// furingdetach
+// Waits for the operation stream has in flight and detaches it from its ring,
+// freeing the ring if its thread has exited and this was its last stream
+//
+// @pre:   stream is attached to an io_uring and has been flushed
+// @post:  stream->ring and stream->urbuffer are NULL
+// @param  stream:    A pointer to an open FILE object
+//-----------------------------------------------------------------------------
+void furingdetach( FILE *stream ) {
+  furing *ring = stream->ring;
+  furingdrop(stream);
+  fbuffree(stream->urbuffer, stream->size);
+  stream->urbuffer = NULL;
+  stream->ring = NULL;
+  pthread_mutex_lock(&ring->mutex);
+  ring->streams--;
+  bool unused = (ring->orphan && ring->streams == 0);
+  pthread_mutex_unlock(&ring->mutex);
+  if(unused) {
+    furingfree(ring);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// furingsettle
+// Waits for a write stream has in flight, finishing a short write with
+// write( ) so that no data is lost
+//
+// @param  stream:    A pointer to a FILE attached to an io_uring
+// @returns:          0 if everything handed off has been written, EOF otherwise
+//-----------------------------------------------------------------------------
+int furingsettle( FILE *stream ) {
+  if(stream->urop != 'w') {
+    return 0;
+  }
+  int written = furingwait(stream);
+  stream->urop = 0;
+  if(written < 0) {
+    errno = -written;
+    return EOF;
+  }
+  stream->stats.byteswritten += written;
+  while(written < stream->urlength) {
+    int bytesWritten = write(stream->fd, &stream->urbuffer[written],
+                             stream->urlength - written);
+    stream->stats.writes++;
+    if(bytesWritten < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return EOF;
+    }
+    written += bytesWritten;
+    stream->stats.byteswritten += bytesWritten;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// furingread
+// Refills stream->buffer with the read io_uring has been doing ahead of the
+// caller, and queues the read of the buffer after it
+//
+// @pre:   stream is attached to an io_uring and stream->buffer is consumed
+// @post:  The next read is in flight unless the end of file was reached
+// @param  stream:    A pointer to an open FILE object
+// @returns:          The number of bytes read, or -1 with errno set
+//-----------------------------------------------------------------------------
+int furingread( FILE *stream ) {
+  if(furingsettle(stream) == EOF) {
+    return -1;
+  }
+  if(stream->urop != 'r' && furingqueue(stream, 'r', stream->size) == -1) {
+    return -1;
+  }
+  int bytesRead = furingwait(stream);
+  stream->urop = 0;
+  if(bytesRead < 0) {
+    errno = -bytesRead;
+    return -1;
+  }
+  char *filled = stream->urbuffer;
+  stream->urbuffer = stream->buffer;
+  stream->buffer = filled;
+  if(bytesRead > 0) {
+    furingqueue(stream, 'r', stream->size);
+  }
+  return bytesRead;
+}
+
+//-----------------------------------------------------------------------------
+// furingwrite
+// Queues the contents of stream->buffer to be written through io_uring and
+// switches stream to the buffer of its previous write, once that is written
+//
+// @pre:   stream is attached to an io_uring and its last operation was a write
+// @post:  stream->buffer is empty
+// @param  stream:    A pointer to an open FILE object
+// @returns:          0, or EOF if this or the previous write failed
+//-----------------------------------------------------------------------------
+int furingwrite( FILE *stream ) {
+  if(stream->pos == 0) {
+    return 0;
+  }
+  if(furingsettle(stream) == EOF) {
+    return EOF;
+  }
+  char *full = stream->buffer;
+  stream->buffer = stream->urbuffer;
+  stream->urbuffer = full;
+  int result = furingqueue(stream, 'w', stream->pos);
+  stream->pos = 0;
+  stream->actual_size = 0;
+  return (result == -1) ? EOF : 0;
+}
+
+//-----------------------------------------------------------------------------
+// furingdrop
+// Settles the io_uring operation stream has in flight: waits for a write to
+// be written, or discards a read ahead and moves the file position back by
+// the bytes it read, as if they had never been read
+//
+// @param  stream:    A pointer to a FILE attached to an io_uring
+// @returns:          0 if successful, EOF if a write failed
+//-----------------------------------------------------------------------------
+int furingdrop( FILE *stream ) {
+  if(stream->urop == 'w') {
+    return furingsettle(stream);
+  }
+  if(stream->urop == 'r') {
+    int bytesRead = furingwait(stream);
+    stream->urop = 0;
+    if(bytesRead > 0) {
+      flseek(stream, -bytesRead, SEEK_CUR);
+    }
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Struct:        fcachestats
+//
+// Description:   What fcachestat( ) reports about the block cache of a FILE.
+//-----------------------------------------------------------------------------
+struct fcachestats {
+  int blocks;              // the number of blocks
+  int blocksize;           // the size of each block
+  long hits;               // refills served from a cached block
+  long misses;             // refills that had to read the block
+  long evictions;          // blocks dropped to make room for another
+  double hitrate;          // hits / (hits + misses), 0 before any refill
+};
+
+//-----------------------------------------------------------------------------
+// Struct:        fcache
+//
+// Description:   The block cache of a read-only FILE: blocks of stream->size
+//                bytes, each holding the file data at a multiple of that
+//                size, found through a hash of the offset and evicted least
+//                recently used first. stream->buffer points at the block
+//                being read, the way it points into the mapping of a mapped
+//                stream. The cursors of a shared file share one, see
+//                fopen_shared( ).
+//-----------------------------------------------------------------------------
+struct fcache {
+  char *data;              // blocks * blocksize bytes of cached data
+  int blocksize;           // the size of each block
+  long *start;             // the file offset of each block, or -1 if unused
+  int *length;             // the number of valid bytes in each block
+  int *older;              // the next less recently used block, or -1
+  int *newer;              // the next more recently used block, or -1
+  int *next;               // the next block in the same hash bucket, or -1
+  int *bucket;             // the first block of each hash bucket, or -1
+  int buckets;             // the number of hash buckets, a power of two
+  int blocks;              // the number of blocks
+  int newest;              // the most recently used block
+  int oldest;              // the least recently used block, evicted next
+  char *original;          // stream->buffer before the cache was set up
+  long hits;               // refills served from a cached block
+  long misses;             // refills that had to read the block
+  long evictions;          // blocks dropped to make room for another
+};
+
+//-----------------------------------------------------------------------------
+// fcachebucket
+// Returns the hash bucket of the block starting at a file offset
+//
+// @param  cache:     A block cache
+// @param  start:     A multiple of cache->blocksize
+// @returns:          An index into cache->bucket
+//-----------------------------------------------------------------------------
+int fcachebucket( fcache *cache, long start ) {
+  unsigned long key = start / cache->blocksize;
+  return (int)((key * 0x9E3779B97F4A7C15UL) >> 32) & (cache->buckets - 1);
+}
+
+//-----------------------------------------------------------------------------
+// fcachetouch
+// Moves a block to the most recently used end of the LRU list
+//
+// @param  cache:     A block cache
+// @param  block:     The block that was just used
+//-----------------------------------------------------------------------------
+void fcachetouch( fcache *cache, int block ) {
+  if(cache->newest == block) {
+    return;
+  }
+  int older = cache->older[block];
+  int newer = cache->newer[block];
+  if(older >= 0) {
+    cache->newer[older] = newer;
+  }
+  else {
+    cache->oldest = newer;
+  }
+  cache->older[newer] = older;
+  cache->older[block] = cache->newest;
+  cache->newer[block] = -1;
+  cache->newer[cache->newest] = block;
+  cache->newest = block;
+}
+
+//-----------------------------------------------------------------------------
+// fcacheunlink
+// Removes a block from its hash bucket, so its offset is no longer found
+//
+// @param  cache:     A block cache
+// @param  block:     A block holding file data
+//-----------------------------------------------------------------------------
+void fcacheunlink( fcache *cache, int block ) {
+  int *link = &cache->bucket[fcachebucket(cache, cache->start[block])];
+  while(*link != block) {
+    link = &cache->next[*link];
+  }
+  *link = cache->next[block];
+  cache->start[block] = -1;
+}
+
+//-----------------------------------------------------------------------------
+// fcachewindow
+// Points stream->buffer at the cached block holding offset, reading it with
+// pread( ) into the least recently used block if it is not cached. A block
+// cut short by the end of the file is read again once the caller reaches
+// its end, in case the file has grown since.
+//
+// @pre:   stream has a block cache, offset >= 0
+// @post:  stream->buffer[stream->pos] is the byte at offset, if there is one
+// @param  stream:    A pointer to an open FILE object
+// @param  offset:    The file offset to position the window at
+// @returns:          The number of bytes left in the new window, EOF on error
+//-----------------------------------------------------------------------------
+int fcachewindow( FILE *stream, long offset ) {
+  fcache *cache = stream->cache;
+  long start = offset - offset % stream->size;
+  int block = cache->bucket[fcachebucket(cache, start)];
+  while(block >= 0 && cache->start[block] != start) {
+    block = cache->next[block];
+  }
+  if(block >= 0 && (offset - start < cache->length[block] ||
+      cache->length[block] == stream->size)) {
+    cache->hits++;
+  }
+  else {
+    cache->misses++;
+    if(block < 0) {
+      block = cache->oldest;
+      if(cache->start[block] >= 0) {
+        fcacheunlink(cache, block);
+        cache->evictions++;
+      }
+    }
+    else {
+      fcacheunlink(cache, block);
+    }
+    char *data = &cache->data[(long)block * stream->size];
+    int length = 0;
+    while(length < stream->size) {
+      int bytesRead = pread(stream->fd, &data[length], stream->size - length,
+          start + length);
+      stream->stats.reads++;
+      if(bytesRead < 0) {
+        if(errno == EINTR) {
+          continue;
+        }
+        stream->pos = stream->actual_size = 0;
+        return EOF;
+      }
+      if(bytesRead == 0) {
+        break;
+      }
+      length += bytesRead;
+      stream->stats.bytesread += bytesRead;
+    }
+    int *link = &cache->bucket[fcachebucket(cache, start)];
+    cache->start[block] = start;
+    cache->length[block] = length;
+    cache->next[block] = *link;
+    *link = block;
+  }
+  fcachetouch(cache, block);
+  stream->buffer = &cache->data[(long)block * stream->size];
+  if(offset - start > cache->length[block]) {
+    stream->offset = offset;   // past the end of the file, nothing to read
+    stream->pos = stream->actual_size = 0;
+    return 0;
+  }
+  stream->offset = start;
+  stream->actual_size = cache->length[block];
+  stream->pos = offset - start;
+  return stream->actual_size - stream->pos;
+}
+
+//-----------------------------------------------------------------------------
+// fcacheseek
+// Moves a stream with a block cache to a new position. Nothing is read until
+// the next refill, which may then find the block cached.
+//
+// @pre:   stream has a block cache and is locked
+// @param  stream:    A pointer to an open FILE object
+// @param  offset:    The number of bytes to seek in the file
+// @param  whence:    The starting position before offset
+// @returns:          0 if seek is successful, EOF otherwise
+//-----------------------------------------------------------------------------
+int fcacheseek( FILE *stream, long offset, int whence ) {
+  long target = offset;
+  if(whence == SEEK_CUR) {
+    target += stream->offset + stream->pos;
+  }
+  else if(whence == SEEK_END) {
+    struct stat fileStat;
+    if(fstat(stream->fd, &fileStat) != 0) {
+      return EOF;
+    }
+    target += fileStat.st_size;
+  }
+  if(target < 0 || (whence != SEEK_SET && whence != SEEK_CUR &&
+      whence != SEEK_END)) {
+    errno = EINVAL;
+    return EOF;
+  }
+  if(target >= stream->offset &&
+      target <= stream->offset + stream->actual_size) {
+    stream->pos = target - stream->offset;
+    stream->stats.seekhits++;
+  }
+  else {
+    stream->offset = target;
+    stream->pos = stream->actual_size = 0;
+    stream->stats.seekmisses++;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fcachestop
+// Frees the block cache of stream and gives stream its original buffer back
+//
+// @pre:   stream has a block cache
+// @post:  stream->cache is NULL and stream->buffer holds no data
+// @param  stream:    A pointer to an open FILE object
+//-----------------------------------------------------------------------------
+void fcachestop( FILE *stream ) {
+  fcache *cache = stream->cache;
+  stream->buffer = cache->original;
+  stream->pos = stream->actual_size = 0;
+  stream->cache = NULL;
+  fcachefree(cache);
+}
+
+//-----------------------------------------------------------------------------
+// fcachealloc
+// Allocates an empty block cache
+//
+// @param  blocks:    The number of blocks, at least 1
+// @param  blocksize: The size of each block
+// @returns:          The block cache, to be freed with fcachefree
+//-----------------------------------------------------------------------------
+fcache *fcachealloc( int blocks, int blocksize ) {
+  fcache *cache = new fcache( );
+  cache->buckets = 1;
+  while(cache->buckets < blocks) {
+    cache->buckets *= 2;
+  }
+  cache->data = new char[(long)blocks * blocksize];
+  cache->blocksize = blocksize;
+  cache->start = new long[blocks];
+  cache->length = new int[blocks];
+  cache->older = new int[blocks];
+  cache->newer = new int[blocks];
+  cache->next = new int[blocks];
+  cache->bucket = new int[cache->buckets];
+  for(int i = 0; i < blocks; i++) {
+    cache->start[i] = -1;
+    cache->length[i] = 0;
+    cache->older[i] = i - 1;
+    cache->newer[i] = (i + 1 < blocks) ? i + 1 : -1;
+    cache->next[i] = -1;
+  }
+  for(int i = 0; i < cache->buckets; i++) {
+    cache->bucket[i] = -1;
+  }
+  cache->blocks = blocks;
+  cache->oldest = 0;
+  cache->newest = blocks - 1;
+  return cache;
+}
+
+//-----------------------------------------------------------------------------
+// fcachefree
+// Frees a block cache
+//
+// @param  cache:     The block cache to free
+//-----------------------------------------------------------------------------
+void fcachefree( fcache *cache ) {
+  delete [] cache->data;
+  delete [] cache->start;
+  delete [] cache->length;
+  delete [] cache->older;
+  delete [] cache->newer;
+  delete [] cache->next;
+  delete [] cache->bucket;
+  delete cache;
+}
+
+//-----------------------------------------------------------------------------
+// setcache
+// Turns the block cache of a read-only, buffered stream on or off. With it
+// on, refills keep the last blocks read, and a read after fseek that lands
+// in one of them is served without a system call. Blocks are read with
+// pread( ), so the position of the file descriptor is left alone until the
+// cache is turned off.
+//
+// @pre:   stream represents an open, buffered, read-only FILE
+// @post:  stream has a cache of blocks blocks of stream->size bytes, or none
+// @param  stream:    A pointer to an open FILE object
+// @param  blocks:    The number of blocks to cache, 0 for none
+// @returns:          0 if successful, EOF otherwise
+//-----------------------------------------------------------------------------
+int setcache( FILE *stream, int blocks ) {
+  if(stream == NULL || stream->buffer == NULL || stream->map != NULL ||
+      stream->async != NULL || stream->ring != NULL || stream->mem != NULL ||
+      stream->direct != 0 || stream->share != NULL || stream->checksum ||
+      stream->zip != NULL || (stream->flag & O_ACCMODE) != O_RDONLY ||
+      blocks < 0) {
+    errno = EINVAL;
+    printf("setcache error: %s\n", strerror(errno));
+    return EOF;
+  }
+  flockfile(stream);
+  long position = ftell_unlocked(stream);
+  if(position < 0) {
+    funlockfile(stream);
+    return EOF;
+  }
+  if(stream->cache != NULL) {
+    fcachestop(stream);
+    flseek(stream, position, SEEK_SET);
+  }
+  else {
+    fflush_unlocked(stream);
+  }
+  stream->offset = position;
+  stream->pos = stream->actual_size = 0;
+  if(blocks > 0) {
+    fcache *cache = fcachealloc(blocks, stream->size);
+    cache->original = stream->buffer;
+    stream->cache = cache;
+    stream->lastop = 'r';
+  }
+  funlockfile(stream);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fcachestat
+// Reports how well the block cache of stream has been serving its refills.
+// For a cursor, that is the cache shared by every cursor on its file.
+//
+// @pre:   stream has a block cache or is a cursor
+// @param  stream:    A pointer to an open FILE object
+// @param  out:       Receives the counters and the hit rate
+// @returns:          0 if successful, EOF if stream has no block cache
+//-----------------------------------------------------------------------------
+int fcachestat( FILE *stream, fcachestats *out ) {
+  if(stream != NULL && out != NULL && stream->share != NULL) {
+    return fsharestat(stream, out);
+  }
+  if(stream == NULL || out == NULL || stream->cache == NULL) {
+    errno = EINVAL;
+    return EOF;
+  }
+  flockfile(stream);
+  fcache *cache = stream->cache;
+  out->blocks = cache->blocks;
+  out->blocksize = stream->size;
+  out->hits = cache->hits;
+  out->misses = cache->misses;
+  out->evictions = cache->evictions;
+  long lookups = cache->hits + cache->misses;
+  out->hitrate = (lookups > 0) ? (double)cache->hits / lookups : 0.0;
+  funlockfile(stream);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Struct:        fbufstats
+//
+// Description:   What fbufstat( ) reports about the buffer of a FILE: its
+//                size, the size chosen at fopen, and the sizes it was given
+//                by its most recent resizes.
+//-----------------------------------------------------------------------------
+struct fbufstats {
+  int size;                  // the current buffer size
+  int base;                  // the size chosen at fopen, 0 if not adaptive
+  int resizes;               // the number of resizes so far
+  int count;                 // the number of entries in history
+  int history[BUFHISTORY];   // the sizes after the last resizes, oldest first
+};
+
+//-----------------------------------------------------------------------------
+// fbufalloc
+// Allocates a stream buffer. Buffers of HUGEPAGE bytes or more are aligned
+// to a huge page and the kernel is asked to back them with huge pages, which
+// saves TLB misses when a large buffer is copied through.
+//
+// @param  size:      The size of the buffer
+// @returns:          The buffer, to be freed with fbuffree
+//-----------------------------------------------------------------------------
+char *fbufalloc( int size ) {
+  if(size < HUGEPAGE) {
+    return new char[size];
+  }
+  void *buffer = NULL;
+  if(posix_memalign(&buffer, HUGEPAGE, size) != 0) {
+    return NULL;
+  }
+  madvise(buffer, size, MADV_HUGEPAGE);
+  return (char *)buffer;
+}
+
+//-----------------------------------------------------------------------------
+// fbuffree
+// Frees a buffer allocated by fbufalloc
+//
+// @param  buffer:    The buffer, or NULL
+// @param  size:      The size it was allocated with
+//-----------------------------------------------------------------------------
+void fbuffree( char *buffer, int size ) {
+  if(size < HUGEPAGE) {
+    delete [] buffer;
+  }
+  else {
+    free(buffer);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// fbufsize
+// Chooses the buffer size of a newly opened stream from the preferred I/O
+// size of its file: a multiple of st_blksize no smaller than BUFSIZ, but no
+// larger than needed to read a small read-only file in one go
+//
+// @pre:   stream was just opened and owns a BUFSIZ-byte buffer
+// @post:  stream->buffer is stream->bufbase bytes and adapts from now on
+// @param  stream:    A pointer to an open FILE object
+//-----------------------------------------------------------------------------
+void fbufsize( FILE *stream ) {
+  struct stat fileStat;
+  if(fstat(stream->fd, &fileStat) != 0 || fileStat.st_blksize <= 0) {
+    return;
+  }
+  long block = (fileStat.st_blksize < BUFMAX) ? fileStat.st_blksize : BUFMAX;
+  long size = (BUFSIZ + block - 1) / block * block;
+  if(stream->flag == O_RDONLY && S_ISREG(fileStat.st_mode)) {
+    long whole = (fileStat.st_size + block) / block * block;  // with EOF
+    if(whole < size) {
+      size = whole;
+    }
+  }
+  if(size != stream->size) {
+    char *buffer = fbufalloc(size);
+    if(buffer == NULL) {
+      return;
+    }
+    fbuffree(stream->buffer, stream->size);
+    stream->buffer = buffer;
+    stream->size = size;
+  }
+  stream->bufbase = size;
+}
+
+//-----------------------------------------------------------------------------
+// fresize
+// Replaces the empty buffer of stream with one of a new size, and records
+// the size in the resize history
+//
+// @pre:   stream->buffer holds no unread or unwritten data
+// @param  stream:    A pointer to an open FILE object
+// @param  size:      The new size
+//-----------------------------------------------------------------------------
+void fresize( FILE *stream, int size ) {
+  char *buffer = fbufalloc(size);
+  if(buffer == NULL) {
+    return;
+  }
+  fbuffree(stream->buffer, stream->size);
+  stream->buffer = buffer;
+  stream->size = size;
+  stream->pos = 0;
+  stream->actual_size = 0;
+  stream->bufhistory[stream->bufresizes % BUFHISTORY] = size;
+  stream->bufresizes++;
+  stream->bufrun = 0;
+  stream->bufneed = 0;
+}
+
+//-----------------------------------------------------------------------------
+// fadaptive
+// Tells whether the buffer of stream may be resized: it was sized by fopen,
+// is still the stream's own and is not shared with another mechanism
+//
+// @param  stream:    A pointer to an open FILE object
+// @returns:          true if fgrow and fshrink may resize the buffer
+//-----------------------------------------------------------------------------
+bool fadaptive( FILE *stream ) {
+  return stream->bufbase > 0 && stream->bufown && stream->mode != _IONBF &&
+      fbypass(stream);
+}
+
+//-----------------------------------------------------------------------------
+// fgrow
+// Called each time the buffer has been emptied by a refill or a flush.
+// After RARUN full buffers in a row without a seek, the access is taken to
+// be sequential and the buffer is doubled, up to BUFMAX, so that long scans
+// make fewer and larger system calls.
+//
+// @pre:   stream->buffer is empty
+// @param  stream:    A pointer to an open FILE object
+// @param  full:      true if the buffer just emptied was full
+//-----------------------------------------------------------------------------
+void fgrow( FILE *stream, bool full ) {
+  if(!fadaptive(stream)) {
+    return;
+  }
+  stream->bufrun = full ? stream->bufrun + 1 : 0;
+  if(stream->bufrun >= RARUN && stream->size < BUFMAX) {
+    fresize(stream, stream->size * 2);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// fshrink
+// Called on a seek that leaves the buffer. Random access wastes most of a
+// large buffer, so it is shrunk back towards the size chosen at fopen,
+// keeping only enough to hold the largest request seen since the last
+// resize.
+//
+// @pre:   stream->buffer is empty
+// @param  stream:    A pointer to an open FILE object
+//-----------------------------------------------------------------------------
+void fshrink( FILE *stream ) {
+  stream->bufrun = 0;
+  if(!fadaptive(stream) || stream->size <= stream->bufbase) {
+    return;
+  }
+  int size = stream->bufbase;
+  while(size < stream->bufneed && size < stream->size) {
+    size *= 2;
+  }
+  if(size < stream->size) {
+    fresize(stream, size);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// fbufstat
+// Reports the buffer size of stream and how it has been adapted
+//
+// @param  stream:    A pointer to an open FILE object
+// @param  out:       Receives the sizes and the resize history
+// @returns:          0 if successful, EOF otherwise
+//-----------------------------------------------------------------------------
+int fbufstat( FILE *stream, fbufstats *out ) {
+  if(stream == NULL || out == NULL) {
+    errno = EINVAL;
+    return EOF;
+  }
+  flockfile(stream);
+  out->size = stream->size;
+  out->base = stream->bufbase;
+  out->resizes = stream->bufresizes;
+  out->count = (stream->bufresizes < BUFHISTORY) ?
+      stream->bufresizes : BUFHISTORY;
+  for(int i = 0; i < out->count; i++) {
+    out->history[i] = stream->bufhistory[
+        (stream->bufresizes - out->count + i) % BUFHISTORY];
+  }
+  funlockfile(stream);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fstatsadd
+// Adds one set of counters to another. The additions are atomic, so streams
+// closed in different threads can add to the same total.
+//
+// @param  to:        The counters to add to
+// @param  from:      The counters to add
+//-----------------------------------------------------------------------------
+void fstatsadd( fiostats *to, const fiostats *from ) {
+  __atomic_fetch_add(&to->reads, from->reads, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&to->writes, from->writes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&to->seeks, from->seeks, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&to->bytesread, from->bytesread, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&to->byteswritten, from->byteswritten, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&to->refills, from->refills, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&to->flushes, from->flushes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&to->copied, from->copied, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&to->seekhits, from->seekhits, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&to->seekmisses, from->seekmisses, __ATOMIC_RELAXED);
+}
+
+//-----------------------------------------------------------------------------
+// fstats
+// Reports the I/O counters of a stream, or with a NULL stream those of the
+// whole process: every stream closed so far plus stdin, stdout and stderr.
+// Counting is always on; it costs an increment next to each system call or
+// copy, and nothing on the getc and putc fast paths.
+//
+// @param  stream:    A pointer to an open FILE object, or NULL
+// @param  out:       Receives the counters
+// @returns:          0 if successful, EOF otherwise
+//-----------------------------------------------------------------------------
+int fstats( FILE *stream, fiostats *out ) {
+  if(out == NULL) {
+    errno = EINVAL;
+    return EOF;
+  }
+  memset(out, 0, sizeof(*out));
+  if(stream != NULL) {
+    flockfile(stream);
+    fstatsadd(out, &stream->stats);
+    funlockfile(stream);
+    return 0;
+  }
+  fstatsadd(out, &closedStats);
+  fstatsadd(out, &stdin->stats);
+  fstatsadd(out, &stdout->stats);
+  fstatsadd(out, &stderr->stats);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fcopykernel
+// Moves up to length bytes from the file descriptor of src to that of dst
+// without them passing through user space: copy_file_range( ) between two
+// files, sendfile( ) from a file to anything else, such as a socket, and
+// splice( ) when either end is a pipe. Both file positions advance.
+//
+// @pre:   Neither stream holds buffered data
+// @param  dst:       A pointer to an open FILE object to write to
+// @param  src:       A pointer to an open FILE object to read from
+// @param  length:    The most bytes to move
+// @param  method:    'c', 's' or 'p' for the call to use; set to the next one
+//                    to try, or 0 for none, if the files do not support it
+// @returns:          The number of bytes moved, 0 at the end of src, or EOF
+//-----------------------------------------------------------------------------
+long fcopykernel( FILE *dst, FILE *src, long length, char *method ) {
+  long moved = -1;
+  if(*method == 'c') {
+    moved = copy_file_range(src->fd, NULL, dst->fd, NULL, length, 0);
+  }
+  else if(*method == 's') {
+    moved = sendfile(dst->fd, src->fd, NULL, length);
+  }
+  else if(*method == 'p') {
+    moved = splice(src->fd, NULL, dst->fd, NULL, length, SPLICE_F_MOVE);
+  }
+  src->stats.reads++;
+  dst->stats.writes++;
+  if(moved < 0) {
+    if(errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+        errno == EOPNOTSUPP || errno == EBADF || errno == ESPIPE) {
+      *method = (*method == 'c') ? 's' : 0;  // sendfile goes file to file too
+    }
+    return EOF;
+  }
+  src->stats.bytesread += moved;
+  dst->stats.byteswritten += moved;
+  if(src->offset >= 0) {
+    src->offset += moved;
+  }
+  if(dst->offset >= 0) {
+    dst->offset += moved;
+  }
+  return moved;
+}
+
+//-----------------------------------------------------------------------------
+// fcopy
+// Copies n bytes, or everything up to the end of src if n is negative, from
+// src to dst. The bytes src has already buffered are written through dst
+// first; the rest is moved by the kernel with fcopykernel whenever both
+// streams are plain file descriptors, so it never passes through user space.
+// Anything the kernel cannot copy, such as a mapped or cached src, a dst with
+// write-behind or io_uring, or a file system without support for any of the
+// calls, is copied through the buffer of src instead.
+//
+// @pre:   src is open for reading, dst for writing, and src != dst
+// @post:  src is positioned after the bytes copied, dst after their copy
+// @param  dst:       A pointer to an open FILE object to write to
+// @param  src:       A pointer to an open FILE object to read from
+// @param  n:         The number of bytes to copy, or -1 for all of them
+// @returns:          The number of bytes copied, or EOF if none could be
+//-----------------------------------------------------------------------------
+long fcopy( FILE *dst, FILE *src, long n ) {
+  if(dst == NULL || src == NULL || dst == src ||
+      (src->flag & O_ACCMODE) == O_WRONLY ||
+      (dst->flag & O_ACCMODE) == O_RDONLY) {
+    errno = (dst == src && dst != NULL) ? EINVAL : EBADF;
+    printf("fcopy error: %s\n", strerror(errno));
+    return EOF;
+  }
+  // always in the same order, so two copies in opposite directions can't
+  // deadlock
+  FILE *first = (src < dst) ? src : dst;
+  FILE *second = (src < dst) ? dst : src;
+  flockfile(first);
+  flockfile(second);
+
+  long copied = 0;
+  bool failed = false;
+  if(src->lastop == 'r' && src->pos < src->actual_size) {
+    long length = src->actual_size - src->pos;
+    if(n >= 0 && length > n) {
+      length = n;
+    }
+    size_t written = fwrite_unlocked(&src->buffer[src->pos], 1, length, dst);
+    if(written > (size_t)length) {
+      written = 0;   // EOF
+    }
+    src->pos += written;
+    copied += written;
+    failed = (written < (size_t)length);
+  }
+
+  // the kernel copies from the file position, which is only where src is
+  // once its buffer is empty
+  struct stat srcStat, dstStat;
+  char method = 0;
+  if(!failed && copied != n && fbypass(src) && fbypass(dst) &&
+      !src->checksum && !dst->checksum &&
+      (src->lastop != 'r' || src->pos == src->actual_size) &&
+      fstat(src->fd, &srcStat) == 0 && fstat(dst->fd, &dstStat) == 0) {
+    method = (S_ISFIFO(srcStat.st_mode) || S_ISFIFO(dstStat.st_mode)) ? 'p' :
+             !S_ISREG(srcStat.st_mode) ? 0 :
+             (S_ISREG(dstStat.st_mode) && !(dst->flag & O_APPEND)) ? 'c' : 's';
+  }
+  if(method != 0 &&
+      ((dst->buffer != NULL && fflush_unlocked(dst) == EOF) ||
+      (src->buffer != NULL && src->lastop != 0 &&
+      fflush_unlocked(src) == EOF))) {
+    failed = true;
+  }
+  while(!failed && method != 0 && copied != n) {
+    long length = (n >= 0 && n - copied < COPYMAX) ? n - copied : COPYMAX;
+    char tried = method;
+    long moved = fcopykernel(dst, src, length, &method);
+    if(moved > 0) {
+      copied += moved;
+    }
+    else if(moved == 0) {
+      src->eof = true;
+      break;
+    }
+    else if(errno != EINTR && method == tried) {
+      failed = true;   // not a call the files can't take: a real error
+    }
+  }
+
+  // whatever is left goes through the buffer of src
+  while(!failed && copied != n && !src->eof) {
+    size_t length = 0;
+    const char *data = NULL;
+    char chunk[BUFSIZ];
+    if(src->buffer != NULL) {
+      data = fpeek_unlocked(src, &length);
+    }
+    else {
+      length = fread_unlocked(chunk, 1, sizeof(chunk), src);
+      data = (length + 1 > 1) ? chunk : NULL;   // neither 0 nor EOF
+    }
+    if(data == NULL) {
+      break;
+    }
+    if(n >= 0 && length > (size_t)(n - copied)) {
+      length = n - copied;
+    }
+    size_t written = fwrite_unlocked(data, 1, length, dst);
+    if(written > length) {
+      written = 0;   // EOF
+    }
+    if(src->buffer != NULL) {
+      fadvance_unlocked(src, written);
+    }
+    copied += written;
+    failed = (written < length);
+  }
+
+  funlockfile(second);
+  funlockfile(first);
+  return (failed && copied == 0) ? EOF : copied;
+}
+
+//-----------------------------------------------------------------------------
+// Struct:        fmem
+//
+// Description:   The memory behind a memory stream, which takes the place of
+//                the file: frefill, fwritebuf and flseek copy to and from it
+//                where they would call read( ), write( ) and lseek( ), so the
+//                stream buffers exactly as a file stream does, without
+//                system calls. Its transfers are still counted in fstats.
+//-----------------------------------------------------------------------------
+struct fmem {
+  char *data;              // the memory read and written
+  size_t capacity;         // the number of bytes at data
+  size_t length;           // the number of bytes of data: the file size
+  size_t position;         // where the next transfer starts: the file offset
+  bool grows;              // true if data is reallocated as it fills up
+  bool own;                // true if data is freed by fclose
+  char **bufp;             // where open_memstream reports data, or NULL
+  size_t *sizep;           // where open_memstream reports its size
+};
+
+//-----------------------------------------------------------------------------
+// fmemread
+// Copies bytes from the memory of a memory stream, as read( ) would
+//
+// @pre:   stream is a memory stream
+// @param  stream:    A pointer to an open FILE object
+// @param  ptr:       Where to copy the bytes to
+// @param  length:    The most bytes to copy
+// @returns:          The number of bytes copied, 0 at the end of the data
+//-----------------------------------------------------------------------------
+long fmemread( FILE *stream, char *ptr, long length ) {
+  fmem *mem = stream->mem;
+  if(mem->position >= mem->length) {
+    return 0;
+  }
+  if((size_t)length > mem->length - mem->position) {
+    length = mem->length - mem->position;
+  }
+  memcpy(ptr, &mem->data[mem->position], length);
+  mem->position += length;
+  return length;
+}
+
+//-----------------------------------------------------------------------------
+// fmemwrite
+// Copies bytes into the memory of a memory stream, as write( ) would. A
+// stream from open_memstream grows to take them all; one from fmemopen
+// takes what fits. Bytes skipped by a seek past the end read as '\0', and a
+// '\0' follows the data whenever there is room for it.
+//
+// @pre:   stream is a memory stream opened for writing
+// @param  stream:    A pointer to an open FILE object
+// @param  ptr:       The bytes to copy
+// @param  length:    The number of bytes to copy
+// @returns:          The number of bytes copied, or -1 with errno set to
+//                    ENOSPC if none fit
+//-----------------------------------------------------------------------------
+long fmemwrite( FILE *stream, const char *ptr, long length ) {
+  fmem *mem = stream->mem;
+  if(stream->flag & O_APPEND) {
+    mem->position = mem->length;
+  }
+  size_t end = mem->position + length;
+  if(mem->grows && end + 1 > mem->capacity) {
+    size_t capacity = mem->capacity * 2;
+    while(capacity < end + 1) {
+      capacity *= 2;
+    }
+    char *data = (char *)realloc(mem->data, capacity);
+    if(data == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    mem->data = data;
+    mem->capacity = capacity;
+  }
+  if(end > mem->capacity) {
+    end = mem->capacity;
+  }
+  if(end <= mem->position && length > 0) {
+    errno = ENOSPC;
+    return -1;
+  }
+  if(mem->position > mem->length) {
+    memset(&mem->data[mem->length], 0, mem->position - mem->length);
+  }
+  length = end - mem->position;
+  memcpy(&mem->data[mem->position], ptr, length);
+  mem->position = end;
+  if(end > mem->length) {
+    mem->length = end;
+  }
+  if(mem->length < mem->capacity) {
+    mem->data[mem->length] = '\0';
+  }
+  if(mem->bufp != NULL) {
+    *mem->bufp = mem->data;
+    *mem->sizep = (mem->position < mem->length) ? mem->position : mem->length;
+  }
+  return length;
+}
+
+//-----------------------------------------------------------------------------
+// fmemseek
+// Moves the position of a memory stream, as lseek( ) would. An fmemopen
+// stream cannot move past the end of its memory; an open_memstream stream
+// can, and the gap is filled with '\0' once it is written past.
+//
+// @pre:   stream is a memory stream
+// @param  stream:    A pointer to an open FILE object
+// @param  offset:    The number of bytes to seek
+// @param  whence:    The starting position before offset
+// @returns:          The new position, or -1 with errno set to EINVAL
+//-----------------------------------------------------------------------------
+off_t fmemseek( FILE *stream, off_t offset, int whence ) {
+  fmem *mem = stream->mem;
+  off_t target = (whence == SEEK_SET) ? offset :
+                 (whence == SEEK_CUR) ? (off_t)mem->position + offset :
+                 (whence == SEEK_END) ? (off_t)mem->length + offset : -1;
+  if(target < 0 || (!mem->grows && (size_t)target > mem->capacity)) {
+    errno = EINVAL;
+    return -1;
+  }
+  mem->position = target;
+  if(mem->bufp != NULL) {
+    *mem->sizep = (mem->position < mem->length) ? mem->position : mem->length;
+  }
+  return target;
+}
+
+//-----------------------------------------------------------------------------
+// fmemclose
+// Releases the memory of a memory stream as fclose closes it. The memory of
+// an open_memstream stream is left to the caller, to be free( )d.
+//
+// @pre:   stream is a memory stream and has been flushed
+// @post:  stream->mem is NULL
+// @param  stream:    A pointer to an open FILE object
+// @returns:          0
+//-----------------------------------------------------------------------------
+int fmemclose( FILE *stream ) {
+  fmem *mem = stream->mem;
+  if(mem->own) {
+    delete [] mem->data;
+  }
+  delete mem;
+  stream->mem = NULL;
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fmemstream
+// Creates a buffered FILE on the memory of mem
+//
+// @param  mem:       The memory, with its position set
+// @param  flag:      The open( ) flags the stream behaves as if opened with
+// @returns:          The new stream
+//-----------------------------------------------------------------------------
+FILE *fmemstream( fmem *mem, int flag ) {
+  FILE *stream = new FILE( );
+  setvbuf(stream, NULL, _IOFBF, BUFSIZ);
+  stream->fd = -1;
+  stream->flag = flag;
+  stream->mem = mem;
+  stream->offset = mem->position;
+  stream->raoffset = -1;
+  return stream;
+}
+
+//-----------------------------------------------------------------------------
+// fmemopen
+// Opens a stream on size bytes of memory at buf, in the mode of fopen: r and
+// r+ read the size bytes, w and w+ first truncate them to a '\0', and a and
+// a+ append after the first '\0'. Writes stop at the end of the memory. With
+// a NULL buf, the stream allocates the memory itself and frees it at fclose.
+//
+// @pre:   buf is NULL or points at size bytes that outlive the stream
+// @param  buf:       The memory, or NULL
+// @param  size:      The number of bytes of memory
+// @param  mode:      The mode to open the memory in
+// @returns:          A pointer to the new stream, or NULL
+//-----------------------------------------------------------------------------
+FILE *fmemopen( void *buf, size_t size, const char *mode ) {
+  if(size == 0 || mode == NULL ||
+      (mode[0] != 'r' && mode[0] != 'w' && mode[0] != 'a')) {
+    errno = EINVAL;
+    printf("fmemopen error: %s\n", strerror(errno));
+    return NULL;
+  }
+  bool update = (strchr(mode, '+') != NULL);
+  int flag = (mode[0] == 'r') ? (update ? O_RDWR : O_RDONLY) :
+             (mode[0] == 'w') ? (update ? O_RDWR : O_WRONLY) | O_TRUNC :
+             (update ? O_RDWR : O_WRONLY) | O_APPEND;
+  fmem *mem = new fmem( );
+  mem->own = (buf == NULL);
+  mem->data = mem->own ? new char[size]( ) : (char *)buf;
+  mem->capacity = size;
+  if(mode[0] == 'r') {
+    mem->length = size;
+  }
+  else if(mode[0] == 'w') {
+    mem->data[0] = '\0';
+  }
+  else {
+    mem->length = strnlen(mem->data, size);
+    mem->position = mem->length;
+  }
+  return fmemstream(mem, flag);
+}
+
+//-----------------------------------------------------------------------------
+// open_memstream
+// Opens a write-only stream on memory that grows as it is written. After
+// each fflush, and after fclose, *bufp points at the data, followed by a
+// '\0', and *sizep holds its size, or the position if that is smaller. The
+// caller free( )s *bufp once the stream is closed.
+//
+// @param  bufp:      Receives the address of the data
+// @param  sizep:     Receives the size of the data
+// @returns:          A pointer to the new stream, or NULL
+//-----------------------------------------------------------------------------
+FILE *open_memstream( char **bufp, size_t *sizep ) {
+  if(bufp == NULL || sizep == NULL) {
+    errno = EINVAL;
+    printf("open_memstream error: %s\n", strerror(errno));
+    return NULL;
+  }
+  fmem *mem = new fmem( );
+  mem->data = (char *)malloc(BUFSIZ);
+  if(mem->data == NULL) {
+    delete mem;
+    errno = ENOMEM;
+    return NULL;
+  }
+  mem->data[0] = '\0';
+  mem->capacity = BUFSIZ;
+  mem->grows = true;
+  mem->bufp = bufp;
+  mem->sizep = sizep;
+  *bufp = mem->data;
+  *sizep = 0;
+  return fmemstream(mem, O_WRONLY);
+}
+
+//-----------------------------------------------------------------------------
+// fdirectblock
+// Reads the DIRECTALIGN-byte block at start of an O_DIRECT stream into an
+// aligned block, zero filling whatever lies past the end of the file
+//
+// @pre:   stream was opened with O_DIRECT, start and block are aligned
+// @param  stream:    A pointer to an open FILE object
+// @param  block:     Where to read the block to
+// @param  start:     The file offset of the block
+// @returns:          The number of bytes of the file in it, or -1 on error
+//-----------------------------------------------------------------------------
+int fdirectblock( FILE *stream, char *block, long start ) {
+  long got;
+  do {
+    got = pread(stream->fd, block, stream->direct, start);
+    stream->stats.reads++;
+  } while(got < 0 && errno == EINTR);
+  if(got < 0) {
+    return -1;
+  }
+  stream->stats.bytesread += got;
+  memset(&block[got], 0, stream->direct - got);
+  return got;
+}
+
+//-----------------------------------------------------------------------------
+// fdirectread
+// Refills an O_DIRECT stream. O_DIRECT only reads whole aligned blocks into
+// an aligned buffer, so the buffer is filled from the block holding the next
+// unread byte, and stream->pos skips the part of that block before it. The
+// page cache is neither used nor filled.
+//
+// @pre:   stream was opened with O_DIRECT and its buffer has been read
+// @post:  stream->buffer[stream->pos] is the next unread byte, if any
+// @param  stream:    A pointer to an open FILE object
+// @returns:          The number of bytes left in the buffer, EOF on error
+//-----------------------------------------------------------------------------
+int fdirectread( FILE *stream ) {
+  long next = stream->offset + stream->actual_size;
+  long start = next - next % stream->direct;
+  stream->offset = next;
+  stream->pos = stream->actual_size = 0;
+  long got;
+  do {
+    got = pread(stream->fd, stream->buffer, stream->size, start);
+    stream->stats.reads++;
+  } while(got < 0 && errno == EINTR);
+  if(got < 0) {
+    return EOF;
+  }
+  stream->stats.bytesread += got;
+  if(next - start >= got) {
+    return 0;   // at or past the end of the file, which keeps next
+  }
+  stream->offset = start;
+  stream->actual_size = got;
+  stream->pos = next - start;
+  return stream->actual_size - stream->pos;
+}
+
+//-----------------------------------------------------------------------------
+// fdirectwrite
+// Flushes an O_DIRECT stream. O_DIRECT only writes whole aligned blocks, so
+// the buffered bytes are widened to the blocks holding them: a head fragment
+// before them and a tail fragment after them are read from the file and
+// written back unchanged, and the file is truncated again if the last block
+// extended it. The buffer is allocated with two spare blocks, one for the
+// fragments to widen it by and one to read them into. An append stream
+// writes at the end of the file as it is when flushed.
+//
+// @pre:   stream was opened with O_DIRECT and was last written
+// @post:  stream->pos is 0 unless the write failed
+// @param  stream:    A pointer to an open FILE object
+// @returns:          0 if successful, EOF otherwise
+//-----------------------------------------------------------------------------
+int fdirectwrite( FILE *stream ) {
+  if(stream->pos == 0) {
+    return 0;
+  }
+  int align = stream->direct;
+  char *block = &stream->buffer[stream->size + align];
+  if(stream->flag & O_APPEND) {
+    struct stat fileStat;
+    if(fstat(stream->fd, &fileStat) != 0) {
+      return EOF;
+    }
+    stream->offset = fileStat.st_size;
+  }
+  long start = stream->offset - stream->offset % align;
+  int head = stream->offset - start;
+  int length = head + stream->pos;
+  int aligned = (length + align - 1) / align * align;
+  int got = align;   // the bytes of the file in the last block
+  bool failed = false;
+  if(head > 0) {
+    memmove(&stream->buffer[head], stream->buffer, stream->pos);
+    got = fdirectblock(stream, block, start);
+    failed = (got < 0);
+    if(!failed) {
+      memcpy(stream->buffer, block, head);
+    }
+  }
+  if(!failed && aligned > length) {
+    if(aligned > align || head == 0) {   // else the head block is the tail
+      got = fdirectblock(stream, block, start + aligned - align);
+      failed = (got < 0);
+    }
+    if(!failed) {
+      memcpy(&stream->buffer[length], &block[length % align],
+          aligned - length);
+    }
+  }
+  int written = 0;
+  while(!failed && written < aligned) {
+    long bytesWritten = pwrite(stream->fd, &stream->buffer[written],
+        aligned - written, start + written);
+    stream->stats.writes++;
+    if(bytesWritten < 0) {
+      failed = (errno != EINTR);
+      continue;
+    }
+    written += bytesWritten;
+    stream->stats.byteswritten += bytesWritten;
+  }
+  if(!failed && aligned > length && got < align) {
+    // the file ended inside the last block: put its end back
+    long end = start + aligned - align + got;
+    if(end < start + length) {
+      end = start + length;
+    }
+    failed = (ftruncate(stream->fd, end) != 0);
+  }
+  if(failed) {
+    memmove(stream->buffer, &stream->buffer[head], stream->pos);
+    return EOF;
+  }
+  stream->offset += stream->pos;
+  stream->pos = 0;
+  stream->actual_size = 0;
+  return 0;
+}
+
+// 1e0 ... 1e22, the powers of ten a double holds exactly
+const double POW10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+  1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+//-----------------------------------------------------------------------------
+// fisspace
+// Tells whether c is white space to the scanf functions: ' ', '\t', '\n',
+// '\v', '\f' or '\r'
+//-----------------------------------------------------------------------------
+inline bool fisspace( char c ) {
+  return c == ' ' || (unsigned)(c - '\t') < 5;
+}
+
+//-----------------------------------------------------------------------------
+// fdigit
+// Returns the value of the digit c in bases up to 16, or 99 if c is not one
+//-----------------------------------------------------------------------------
+inline unsigned fdigit( char c ) {
+  unsigned digit = (unsigned)(c - '0');
+  if(digit < 10) {
+    return digit;
+  }
+  digit = (unsigned)((c | 0x20) - 'a');
+  return (digit < 6) ? digit + 10 : 99;
+}
+
+//-----------------------------------------------------------------------------
+// fskipspace
+// Consumes white space straight from the buffer of stream
+//
+// @pre:   stream is buffered and locked
+// @param  stream:    A pointer to an open FILE object
+// @returns:          The next character, left unread, or EOF
+//-----------------------------------------------------------------------------
+int fskipspace( FILE *stream ) {
+  const char *run;
+  size_t length;
+  while((run = fpeek_unlocked(stream, &length)) != NULL) {
+    size_t i = 0;
+    while(i < length && fisspace(run[i])) {
+      i++;
+    }
+    stream->pos += i;
+    if(i < length) {
+      return (unsigned char)run[i];
+    }
+  }
+  return EOF;
+}
+
+//-----------------------------------------------------------------------------
+// fscanint
+// Parses an integer straight from the buffer of stream, after any white
+// space: an optional sign, then digits in base, with an optional 0x before
+// base 16 digits. Base 0 takes the base from the prefix as strtol does: 0x
+// for 16, 0 for 8 and 10 otherwise. The 0x is only consumed when a hex digit
+// follows it, so "0xg" reads as 0 and leaves "xg" unread. The digit loop
+// runs over the buffered bytes without copying them, and carries on into
+// the next refill if the number is cut by the end of the buffer. A value
+// out of range is reported as ULLONG_MAX with errno set to ERANGE.
+//
+// @pre:   stream is buffered and locked
+// @param  stream:    A pointer to an open FILE object
+// @param  width:     The most characters to consume, 0 for no limit
+// @param  base:      8, 10 or 16, or 0 to take it from the prefix
+// @param  magnitude: Receives the value without its sign
+// @param  negative:  Receives true if it had a '-'
+// @returns:          1 if a number was parsed, 0 if there was none, EOF at
+//                    the end of the file
+//-----------------------------------------------------------------------------
+int fscanint( FILE *stream, int width, int base,
+    unsigned long long *magnitude, bool *negative ) {
+  int c = fskipspace(stream);
+  if(c == EOF) {
+    return EOF;
+  }
+  if(width <= 0) {
+    width = INT_MAX;
+  }
+  *negative = false;
+  *magnitude = 0;
+  if(c == '-' || c == '+') {
+    *negative = (c == '-');
+    stream->pos++;
+    width--;
+  }
+  const char *run;
+  size_t length;
+  if(base == 0 || base == 16) {
+    run = fpeek_unlocked(stream, &length);   // length is 0 at EOF
+    // 0x counts only if a hex digit follows; "0xg" reads as 0, "xg" unread
+    if(width >= 3 && length >= 3 && run[0] == '0' &&
+        (run[1] | 0x20) == 'x' && fdigit(run[2]) < 16) {
+      stream->pos += 2;
+      width -= 2;
+      base = 16;
+    }
+    else if(base == 0) {
+      base = (length > 0 && run[0] == '0') ? 8 : 10;
+    }
+  }
+  unsigned long long value = 0;
+  bool overflow = false;
+  size_t digits = 0;
+  while(width > 0 && (run = fpeek_unlocked(stream, &length)) != NULL) {
+    if(length > (size_t)width) {
+      length = width;
+    }
+    size_t i = 0;
+    unsigned digit;
+    while(i < length && (digit = (base == 10) ? (unsigned)(run[i] - '0') :
+        fdigit(run[i])) < (unsigned)base) {
+      overflow |= __builtin_mul_overflow(value, (unsigned)base, &value);
+      overflow |= __builtin_add_overflow(value, digit, &value);
+      i++;
+    }
+    stream->pos += i;
+    digits += i;
+    width -= i;
+    if(i < length) {
+      break;
+    }
+  }
+  if(overflow) {
+    errno = ERANGE;
+    value = ULLONG_MAX;
+  }
+  *magnitude = value;
+  return (digits > 0) ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// fscandouble
+// Parses a decimal floating point number straight from the buffer of
+// stream, after any white space: an optional sign, digits with an optional
+// '.', and an optional exponent. Up to 19 significant digits are gathered
+// into an integer as they are scanned, and a power of ten of at most 22
+// then gives the correctly rounded value with one multiplication or
+// division. Longer numbers and larger exponents are left to strtod( ).
+//
+// @pre:   stream is buffered and locked
+// @param  stream:    A pointer to an open FILE object
+// @param  width:     The most characters to consume, 0 for no limit
+// @param  value:     Receives the number
+// @returns:          1 if a number was parsed, 0 if there was none, EOF at
+//                    the end of the file
+//-----------------------------------------------------------------------------
+int fscandouble( FILE *stream, int width, double *value ) {
+  int c = fskipspace(stream);
+  if(c == EOF) {
+    return EOF;
+  }
+  if(width <= 0 || width > FLOATMAX) {
+    width = FLOATMAX;
+  }
+  // where the number is: 0 before it, 1 after its sign, 2 in the integer
+  // part, 3 after a '.' with no digits before it, 4 in the fraction, 5 after
+  // the 'e', 6 after the exponent's sign, 7 in the exponent
+  int state = 0;
+  char token[FLOATMAX + 1];
+  int length = 0;
+  int mantissaEnd = 0;        // the length of the token before its 'e'
+  unsigned long long mantissa = 0;
+  int significant = 0;        // the digits gathered into mantissa
+  int scale = 0;              // the power of ten mantissa is to be scaled by
+  bool truncated = false;     // true if digits did not fit into mantissa
+  int exponent = 0;
+  bool negativeExponent = false;
+  const char *run;
+  size_t available;
+  bool done = false;
+  while(!done && length < width &&
+      (run = fpeek_unlocked(stream, &available)) != NULL) {
+    size_t i = 0;
+    while(i < available && length < width) {
+      char ch = run[i];
+      unsigned digit = (unsigned)(ch - '0');
+      if(digit < 10) {
+        if(state <= 4) {
+          if(state != 4 && state != 3) {
+            state = 2;
+          }
+          else {
+            state = 4;
+          }
+          if(significant < 19) {
+            mantissa = mantissa * 10 + digit;
+            significant += (mantissa != 0);  // leading zeros don't count
+            scale -= (state == 4);
+          }
+          else {
+            truncated = true;
+            scale += (state == 2);
+          }
+        }
+        else {
+          state = 7;
+          if(exponent < 100000) {
+            exponent = exponent * 10 + digit;
+          }
+        }
+      }
+      else if((ch == '-' || ch == '+') && (state == 0 || state == 5)) {
+        negativeExponent = (state == 5 && ch == '-');
+        state++;
+      }
+      else if(ch == '.' && state <= 2) {
+        state = (state == 2) ? 4 : 3;
+      }
+      else if((ch | 0x20) == 'e' && (state == 2 || state == 4)) {
+        mantissaEnd = length;
+        state = 5;
+      }
+      else {
+        done = true;
+        break;
+      }
+      token[length++] = ch;
+      i++;
+    }
+    stream->pos += i;
+  }
+  if(state != 2 && state != 4 && state != 7) {
+    if(state != 5 && state != 6) {
+      return 0;
+    }
+    length = mantissaEnd;     // "1e" without digits: the 'e' is not used
+    exponent = 0;
+  }
+  token[length] = NULL_CHAR;
+  int power = scale + (negativeExponent ? -exponent : exponent);
+  if(!truncated && mantissa <= (1ULL << 53) && power >= -22 && power <= 22) {
+    *value = (power < 0) ? mantissa / POW10[-power] :
+        mantissa * POW10[power];
+    if(token[0] == '-') {
+      *value = -*value;
+    }
+  }
+  else {
+    *value = strtod(token, NULL);
+  }
+  return 1;
+}
+
+//-----------------------------------------------------------------------------
+// fread_int
+// Reads a decimal integer from stream, parsing it straight from the buffer
+// (see fscanint). White space before it is skipped and whatever follows it,
+// such as a ',' in CSV, is left unread.
+//
+// @pre:   stream represents an open, buffered FILE
+// @param  stream:    A pointer to an open FILE object
+// @param  value:     Receives the number, saturated to the range of a long
+// @returns:          1 if a number was read, 0 if the next character does not
+//                    start one, EOF at the end of the file or on error
+//-----------------------------------------------------------------------------
+int fread_int( FILE *stream, long *value ) {
+  if(stream == NULL || stream->buffer == NULL || value == NULL) {
+    errno = EBADF;
+    printf("fread_int error: %s\n", strerror(errno));
+    return EOF;
+  }
+  flockfile(stream);
+  unsigned long long magnitude;
+  bool negative;
+  int result = fscanint(stream, 0, 10, &magnitude, &negative);
+  if(result == 1) {
+    unsigned long long limit = negative ? (unsigned long long)LONG_MAX + 1 :
+        LONG_MAX;
+    if(magnitude > limit) {
+      errno = ERANGE;
+      magnitude = limit;
+    }
+    *value = negative ? (long)(0ULL - magnitude) : (long)magnitude;
+  }
+  funlockfile(stream);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+// fread_double
+// Reads a decimal floating point number from stream, parsing it straight
+// from the buffer (see fscandouble). White space before it is skipped and
+// whatever follows it is left unread.
+//
+// @pre:   stream represents an open, buffered FILE
+// @param  stream:    A pointer to an open FILE object
+// @param  value:     Receives the number
+// @returns:          1 if a number was read, 0 if the next character does not
+//                    start one, EOF at the end of the file or on error
+//-----------------------------------------------------------------------------
+int fread_double( FILE *stream, double *value ) {
+  if(stream == NULL || stream->buffer == NULL || value == NULL) {
+    errno = EBADF;
+    printf("fread_double error: %s\n", strerror(errno));
+    return EOF;
+  }
+  flockfile(stream);
+  int result = fscandouble(stream, 0, value);
+  funlockfile(stream);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+// vfscanf
+// The scanning engine behind fscanf and scanf. Supports the conversions
+// %d %i %u %o %x %X %f %e %E %g %G %s %c and %%, assignment suppression
+// with *, a width, and the length modifiers hh, h, l, ll, L, j, z and t.
+// %i takes the base from a 0x or 0 prefix. The floating point conversions
+// read decimal numbers only: %a and hexadecimal input such as 0x1.8p3 are
+// not supported. White space in format matches any amount of white space,
+// and other characters must match themselves. Numbers and strings are taken
+// straight from the buffer of stream. A character that ends a conversion or
+// fails to match is left unread.
+//
+// @pre:   stream is buffered, format is '\0'-terminated and list matches
+//         its conversions
+// @param  stream:    A pointer to an open FILE object
+// @param  format:    The format string
+// @param  list:      Pointers receiving the converted values
+// @returns:          The number of values assigned, or EOF if the end of the
+//                    file came before the first conversion
+//-----------------------------------------------------------------------------
+int vfscanf( FILE *stream, const char *format, va_list list ) {
+  if(stream == NULL || stream->buffer == NULL || format == NULL) {
+    errno = EBADF;
+    printf("fscanf error: %s\n", strerror(errno));
+    return EOF;
+  }
+  flockfile(stream);
+  int assigned = 0;
+  bool converted = false;     // true once any conversion has succeeded
+  bool ended = false;         // true if the file ended
+  while(*format != NULL_CHAR) {
+    if(fisspace(*format)) {
+      ended = (fskipspace(stream) == EOF);
+      while(fisspace(*format)) {
+        format++;
+      }
+      continue;
+    }
+    const char *run;
+    size_t length;
+    if(*format != '%' || format[1] == '%') {
+      if(*format == '%') {
+        fskipspace(stream);
+        format++;
+      }
+      run = fpeek_unlocked(stream, &length);
+      if(run == NULL || *run != *format) {
+        ended = (run == NULL);
+        break;
+      }
+      stream->pos++;
+      format++;
+      continue;
+    }
+    format++;
+    bool suppress = (*format == '*');
+    if(suppress) {
+      format++;
+    }
+    int width = 0;
+    while(*format >= '0' && *format <= '9') {
+      width = width * 10 + (*format++ - '0');
+    }
+    int halves = 0, longs = 0;
+    while(*format == 'h' || *format == 'l' || *format == 'L' ||
+        *format == 'j' || *format == 'z' || *format == 't') {
+      if(*format == 'h') {
+        halves++;
+      }
+      else {
+        longs += (*format == 'l') ? 1 : 2;   // L, j, z and t are 64 bits
+      }
+      format++;
+    }
+    char conversion = *format++;
+    int result = 0;
+    switch(conversion) {
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X': {
+      unsigned long long magnitude;
+      bool negative;
+      result = fscanint(stream, width,
+          (conversion == 'o') ? 8 : (conversion == 'x' ||
+          conversion == 'X') ? 16 : (conversion == 'i') ? 0 : 10,
+          &magnitude, &negative);
+      if(result == 1 && !suppress) {
+        unsigned long long value = negative ? 0ULL - magnitude : magnitude;
+        void *target = va_arg(list, void *);
+        if(halves >= 2) *(char *)target = (char)value;
+        else if(halves == 1) *(short *)target = (short)value;
+        else if(longs == 0) *(int *)target = (int)value;
+        else *(long long *)target = (long long)value;
+      }
+      break;
+    }
+    case 'f':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G': {
+      double value;
+      result = fscandouble(stream, width, &value);
+      if(result == 1 && !suppress) {
+        void *target = va_arg(list, void *);
+        if(longs >= 2) *(long double *)target = value;
+        else if(longs == 1) *(double *)target = value;
+        else *(float *)target = (float)value;
+      }
+      break;
+    }
+    case 's':
+    case 'c': {
+      char *target = suppress ? NULL : va_arg(list, char *);
+      if(conversion == 's') {
+        result = (fskipspace(stream) == EOF) ? EOF : 0;
+      }
+      if(width <= 0) {
+        width = (conversion == 'c') ? 1 : INT_MAX;
+      }
+      int copied = 0;
+      while(result != EOF && copied < width &&
+          (run = fpeek_unlocked(stream, &length)) != NULL) {
+        if(length > (size_t)(width - copied)) {
+          length = width - copied;
+        }
+        size_t i = 0;
+        while(i < length && (conversion == 'c' || !fisspace(run[i]))) {
+          i++;
+        }
+        if(target != NULL) {
+          memcpy(&target[copied], run, i);
+        }
+        stream->pos += i;
+        copied += i;
+        if(i < length) {
+          break;
+        }
+      }
+      if(result != EOF) {
+        result = (copied > 0 && (conversion == 's' || copied == width)) ?
+            1 : (copied == 0 && stream->eof) ? EOF : 0;
+      }
+      if(result == 1 && conversion == 's' && target != NULL) {
+        target[copied] = NULL_CHAR;
+      }
+      break;
+    }
+    default:                  // unsupported conversion
+      errno = EINVAL;
+      break;
+    }
+    if(result != 1) {
+      ended = (result == EOF);
+      break;
+    }
+    converted = true;
+    assigned += !suppress;
+  }
+  funlockfile(stream);
+  return (ended && !converted) ? EOF : assigned;
+}
+
+//-----------------------------------------------------------------------------
+// fscanf
+// Calls vfscanf with the additional parameters
+//
+// @pre:   stream represents an open, buffered FILE
+// @param  stream:    A pointer to an open FILE object
+// @param  format:    The format string, as for scanf
+// @param  ...:       Pointers receiving the converted values
+// @returns:          The number of values assigned, or EOF
+//-----------------------------------------------------------------------------
+int fscanf( FILE *stream, const char *format, ... ) {
+  va_list list;
+  va_start(list, format);
+  int total = vfscanf(stream, format, list);
+  va_end(list);
+  return total;
+}
+
+//-----------------------------------------------------------------------------
+// scanf
+// Calls vfscanf on stdin with the additional parameters
+//
+// @param  format:    The format string
+// @param  ...:       Pointers receiving the converted values
+// @returns:          The number of values assigned, or EOF
+//-----------------------------------------------------------------------------
+int scanf( const char *format, ... ) {
+  va_list list;
+  va_start(list, format);
+  int total = vfscanf(stdin, format, list);
+  va_end(list);
+  return total;
+}
+
+//-----------------------------------------------------------------------------
+// fupdateturn
+// Switches an update stream (r+ or w+ on a regular file) between reading and
+// writing without a system call. Its buffer is one window of the file for
+// both: buffer[0 .. actual_size) holds the bytes at stream->offset, and
+// stream->pos is the stream's place in it. Writes store into the window in
+// place, and [dirtylo, dirtyhi) spans the bytes changed since they were last
+// written back. While writing, the bytes from dirtylo up to pos are dirty as
+// well, so putc needs no bookkeeping; turning takes them into the span. The
+// span may take in clean bytes between two writes, which are written back
+// with them rather than costing a system call of their own.
+//
+// @pre:   stream->update is true
+// @post:  The dirty span covers every byte written, and a write may start at
+//         stream->pos once stream->lastop is set to op
+// @param  stream:    A pointer to an open FILE object
+// @param  op:        'r' or 'w', what stream is about to do
+//-----------------------------------------------------------------------------
+void fupdateturn( FILE *stream, char op ) {
+  if(stream->lastop == 'w') {
+    if(stream->pos > stream->dirtyhi) {
+      stream->dirtyhi = stream->pos;
+    }
+    if(stream->pos > stream->actual_size) {
+      stream->actual_size = stream->pos;   // the window grew by the writes
+    }
+  }
+  if(op == 'w') {
+    if(stream->dirtylo == stream->dirtyhi) {
+      stream->dirtylo = stream->dirtyhi = stream->pos;
+    }
+    else if(stream->pos < stream->dirtylo) {
+      stream->dirtylo = stream->pos;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// fupdateflush
+// Writes the dirty span of an update stream back to the file with pwrite( ),
+// at the offset it came from. The window stays in place and clean, and the
+// file position is left alone, as refills use pread( ).
+//
+// @pre:   stream->update is true
+// @post:  No byte of stream->buffer is dirty, unless pwrite failed
+// @param  stream:    A pointer to an open FILE object
+// @returns:          0 if successful, EOF otherwise
+//-----------------------------------------------------------------------------
+int fupdateflush( FILE *stream ) {
+  if(stream->lastop == 'w') {
+    fupdateturn(stream, 'w');   // takes in the bytes written since the turn
+  }
+  int written = stream->dirtylo;
+  if(written < stream->dirtyhi) {
+    stream->stats.flushes++;
+  }
+  while(written < stream->dirtyhi) {
+    int bytesWritten = pwrite(stream->fd, &stream->buffer[written],
+        stream->dirtyhi - written, stream->offset + written);
+    stream->stats.writes++;
+    if(bytesWritten < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      stream->dirtylo = written;   // the rest stays dirty
+      return EOF;
+    }
+    written += bytesWritten;
+    stream->stats.byteswritten += bytesWritten;
+  }
+  stream->dirtylo = stream->dirtyhi = stream->pos;
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Struct:        fshare
+//
+// Description:   A file opened by fopen_shared( ), with one descriptor and one
+//                block cache for every cursor on it. Cursors read with
+//                pread( ) at their own offsets, so none moves the file
+//                position under another, and a block one of them has read is
+//                found by the others. Each cursor copies the block it reads
+//                into its own buffer, so the block may be evicted afterwards.
+//-----------------------------------------------------------------------------
+struct fshare {
+  dev_t device;            // the device of the file
+  ino_t inode;             // its inode, which with device identifies the file
+  int fd;                  // the descriptor every cursor reads through
+  int users;               // the cursors open on the file
+  fcache *cache;           // the blocks read so far by any cursor
+  int *pins;               // the cursors using each block outside of mutex
+  pthread_mutex_t mutex;   // guards cache and pins
+  fshare *next;            // the next file in shareList
+};
+
+fshare *shareList = NULL;  // the files open through fopen_shared
+pthread_mutex_t shareListLock = PTHREAD_MUTEX_INITIALIZER; // guards shareList
+                                                           // and users
+
+//-----------------------------------------------------------------------------
+// fsharevictim
+// Picks the block a shared cache gives up for a new one: the least recently
+// used block that no cursor is using
+//
+// @pre:   share->mutex is held
+// @param  share:     A shared file
+// @returns:          The block, or -1 if every block is in use
+//-----------------------------------------------------------------------------
+int fsharevictim( fshare *share ) {
+  int block = share->cache->oldest;
+  while(block >= 0 && share->pins[block] > 0) {
+    block = share->cache->newer[block];
+  }
+  return block;
+}
+
+//-----------------------------------------------------------------------------
+// fsharewindow
+// Refills a cursor with the block of its shared file that holds offset. A
+// cached block is copied into the cursor's buffer; otherwise the block is
+// read with pread( ) into the cache first, outside of the cache's lock so
+// that other cursors carry on meanwhile. If every block is in use, the
+// cursor reads into its own buffer without caching. A block cut short by
+// the end of the file is read again once a cursor reaches its end, in case
+// the file has grown since.
+//
+// @pre:   stream is a cursor, offset >= 0
+// @post:  stream->buffer[stream->pos] is the byte at offset, if there is one
+// @param  stream:    A pointer to an open FILE object
+// @param  offset:    The file offset to refill from
+// @returns:          The number of bytes left in the buffer, EOF on error
+//-----------------------------------------------------------------------------
+int fsharewindow( FILE *stream, long offset ) {
+  fshare *share = stream->share;
+  fcache *cache = share->cache;
+  long start = offset - offset % stream->size;
+  pthread_mutex_lock(&share->mutex);
+  int block = cache->bucket[fcachebucket(cache, start)];
+  while(block >= 0 && cache->start[block] != start) {
+    block = cache->next[block];
+  }
+  bool hit = (block >= 0 && (offset - start < cache->length[block] ||
+      cache->length[block] == stream->size));
+  int length = 0;
+  if(hit) {
+    cache->hits++;
+    length = cache->length[block];
+  }
+  else {
+    cache->misses++;
+    if(block >= 0 && share->pins[block] == 0) {
+      fcacheunlink(cache, block);
+    }
+    else {
+      block = fsharevictim(share);
+      if(block >= 0 && cache->start[block] >= 0) {
+        fcacheunlink(cache, block);
+        cache->evictions++;
+      }
+    }
+  }
+  if(block >= 0) {
+    share->pins[block]++;
+    fcachetouch(cache, block);
+  }
+  pthread_mutex_unlock(&share->mutex);
+
+  char *data = (block >= 0) ? &cache->data[(long)block * stream->size] :
+      stream->buffer;
+  while(!hit && length < stream->size) {
+    int bytesRead = pread(share->fd, &data[length], stream->size - length,
+        start + length);
+    stream->stats.reads++;
+    if(bytesRead < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      length = EOF;
+      break;
+    }
+    if(bytesRead == 0) {
+      break;
+    }
+    length += bytesRead;
+    stream->stats.bytesread += bytesRead;
+  }
+  if(block >= 0 && length > 0) {
+    memcpy(stream->buffer, data, length);
+  }
+  if(block >= 0) {
+    pthread_mutex_lock(&share->mutex);
+    if(!hit && length >= 0) {
+      int *link = &cache->bucket[fcachebucket(cache, start)];
+      cache->start[block] = start;
+      cache->length[block] = length;
+      cache->next[block] = *link;
+      *link = block;
+    }
+    share->pins[block]--;
+    pthread_mutex_unlock(&share->mutex);
+  }
+  if(length < 0) {
+    stream->pos = stream->actual_size = 0;
+    return EOF;
+  }
+  stream->offset = start;
+  stream->actual_size = length;
+  stream->pos = offset - start;
+  if(stream->pos > stream->actual_size) {
+    stream->pos = stream->actual_size;  // past the end of the file
+  }
+  return stream->actual_size - stream->pos;
+}
+
+//-----------------------------------------------------------------------------
+// fshareclose
+// Detaches a cursor from its shared file, closing the file and freeing its
+// cache once the last cursor is gone
+//
+// @pre:   stream is a cursor
+// @post:  stream->share is NULL
+// @param  stream:    A pointer to an open FILE object
+// @returns:          0 if successful, what close( ) returns otherwise
+//-----------------------------------------------------------------------------
+int fshareclose( FILE *stream ) {
+  fshare *share = stream->share;
+  stream->share = NULL;
+  pthread_mutex_lock(&shareListLock);
+  bool last = (--share->users == 0);
+  if(last) {
+    fshare **link = &shareList;
+    while(*link != share) {
+      link = &(*link)->next;
+    }
+    *link = share->next;
+  }
+  pthread_mutex_unlock(&shareListLock);
+  if(!last) {
+    return 0;
+  }
+  int closed = close(share->fd);
+  fcachefree(share->cache);
+  delete [] share->pins;
+  pthread_mutex_destroy(&share->mutex);
+  delete share;
+  return closed;
+}
+
+//-----------------------------------------------------------------------------
+// fsharestat
+// Reports how well the cache of a cursor's shared file has been serving the
+// refills of all its cursors, see fcachestat
+//
+// @pre:   stream is a cursor
+// @param  stream:    A pointer to an open FILE object
+// @param  out:       Receives the counters and the hit rate
+// @returns:          0
+//-----------------------------------------------------------------------------
+int fsharestat( FILE *stream, fcachestats *out ) {
+  fshare *share = stream->share;
+  fcache *cache = share->cache;
+  pthread_mutex_lock(&share->mutex);
+  out->blocks = cache->blocks;
+  out->blocksize = cache->blocksize;
+  out->hits = cache->hits;
+  out->misses = cache->misses;
+  out->evictions = cache->evictions;
+  long lookups = cache->hits + cache->misses;
+  out->hitrate = (lookups > 0) ? (double)cache->hits / lookups : 0.0;
+  pthread_mutex_unlock(&share->mutex);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fopen_shared
+// Opens a read-only cursor on a regular file that many threads may read at
+// once, each through a cursor of its own. Cursors on the same file, however
+// its path is spelled, share one descriptor and one block cache. Each reads
+// with pread( ) at its own offset and keeps its own position, buffer and
+// lock, so cursors only wait on one another briefly for the cache. A cursor
+// is an ordinary FILE to fread, fgets, fseek and the rest, and is closed
+// with fclose; the file is closed with its last cursor.
+//
+// @pre:   path names a regular file
+// @post:  The file is open with one more cursor on it
+// @param  path:      The path to the file
+// @param  blocks:    The number of SHAREBLOCK-byte blocks to cache, 0 for
+//                    SHAREBLOCKS, used if no cursor has the file open yet
+// @returns:          The cursor, or NULL on error
+//-----------------------------------------------------------------------------
+FILE *fopen_shared( const char *path, int blocks ) {
+  if(path == NULL || blocks < 0) {
+    errno = EINVAL;
+    printf("fopen_shared error: %s\n", strerror(errno));
+    return NULL;
+  }
+  int fd = open(path, O_RDONLY);
+  struct stat fileStat;
+  if(fd == -1 || fstat(fd, &fileStat) != 0 || !S_ISREG(fileStat.st_mode)) {
+    if(fd != -1) {
+      close(fd);
+      errno = EINVAL;   // a pipe or device has no offsets to share
+    }
+    printf("fopen_shared error: %s\n", strerror(errno));
+    return NULL;
+  }
+  pthread_mutex_lock(&shareListLock);
+  fshare *share = shareList;
+  while(share != NULL && (share->device != fileStat.st_dev ||
+      share->inode != fileStat.st_ino)) {
+    share = share->next;
+  }
+  if(share != NULL) {
+    close(fd);
+  }
+  else {
+    share = new fshare( );
+    share->device = fileStat.st_dev;
+    share->inode = fileStat.st_ino;
+    share->fd = fd;
+    share->cache = fcachealloc((blocks > 0) ? blocks : SHAREBLOCKS,
+        SHAREBLOCK);
+    share->pins = new int[share->cache->blocks]( );
+    pthread_mutex_init(&share->mutex, NULL);
+    share->next = shareList;
+    shareList = share;
+  }
+  share->users++;
+  pthread_mutex_unlock(&shareListLock);
+
+  FILE *stream = new FILE( );
+  stream->fd = share->fd;
+  stream->flag = O_RDONLY;
+  stream->mode = _IOFBF;
+  stream->buffer = fbufalloc(SHAREBLOCK);
+  stream->size = SHAREBLOCK;
+  stream->bufown = true;
+  stream->lastop = 'r';
+  stream->raoffset = -1;
+  stream->share = share;
+  return stream;
+}
+
+//-----------------------------------------------------------------------------
+// Struct:        fchunk
+//
+// Description:   One of the disjoint pieces fread_parallel( ) splits a read
+//                into, and the thread that reads it.
+//-----------------------------------------------------------------------------
+struct fchunk {
+  int fd;                  // the file to read
+  char *data;              // where the piece goes
+  long offset;             // the file offset of the piece
+  long length;             // the number of bytes asked for
+  long done;               // the number of bytes read, fewer at the end of file
+  long reads;              // the number of preads it took
+  int error;               // errno of a failed pread, or 0
+  bool started;            // true if thread was started to read it
+  pthread_t thread;        // the thread reading it
+};
+
+//-----------------------------------------------------------------------------
+// freadchunk
+// Reads one piece of a parallel read with pread( ), until it is complete or
+// the end of the file is reached
+//
+// @param  arg:       The fchunk to read
+// @returns:          NULL
+//-----------------------------------------------------------------------------
+void *freadchunk( void *arg ) {
+  fchunk *chunk = (fchunk *)arg;
+  while(chunk->done < chunk->length) {
+    long bytesRead = pread(chunk->fd, &chunk->data[chunk->done],
+        chunk->length - chunk->done, chunk->offset + chunk->done);
+    chunk->reads++;
+    if(bytesRead < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      chunk->error = errno;
+      break;
+    }
+    if(bytesRead == 0) {
+      break;
+    }
+    chunk->done += bytesRead;
+  }
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// fread_parallel
+// Reads length bytes of a regular file into ptr, as fread does, but with up
+// to threads threads each reading a disjoint piece with pread( ) at once, so
+// that a fast device has as many requests in flight as it can serve. Any
+// bytes already buffered are taken first, and the stream is left positioned
+// after the data read. Each thread gets at least PARALLELMIN bytes, so
+// smaller reads and streams that cannot be read by offset (pipes, memory,
+// mapped, O_DIRECT, write-behind and io_uring streams) are read by fread.
+//
+// @pre:   stream represents an open FILE
+// @post:  The stream position is past the bytes read
+// @param  ptr:       Where the data goes, length bytes
+// @param  length:    The number of bytes to read
+// @param  stream:    A pointer to an open FILE object
+// @param  threads:   The most threads to read with, 0 for one per processor
+// @returns:          The number of bytes read, fewer at the end of the file,
+//                    or EOF if nothing could be read
+//-----------------------------------------------------------------------------
+long fread_parallel( void *ptr, size_t length, FILE *stream, int threads ) {
+  if(ptr == NULL || stream == NULL || threads < 0) {
+    errno = EBADF;
+    printf("fread_parallel error: %s\n", strerror(errno));
+    return EOF;
+  }
+  if(length == 0) {
+    return 0;
+  }
+  flockfile(stream);
+  struct stat fileStat;
+  if(stream->eof || stream->buffer == NULL || length < 2 * PARALLELMIN ||
+      !(fbypass(stream) || stream->share != NULL) ||
+      fstat(stream->fd, &fileStat) != 0 || !S_ISREG(fileStat.st_mode)) {
+    long numberRead = fread_unlocked(ptr, sizeof(char), length, stream);
+    funlockfile(stream);
+    return numberRead;
+  }
+  if(stream->update) {
+    fupdateturn(stream, 'r');
+  }
+  else if(stream->lastop == 'w' && fflush_unlocked(stream) == EOF) {
+    funlockfile(stream);
+    return EOF;
+  }
+  stream->lastop = 'r';
+  char *data = (char *)ptr;
+  size_t given = stream->actual_size - stream->pos;
+  if(given > length) {
+    given = length;
+  }
+  memcpy(data, &stream->buffer[stream->pos], given);
+  stream->pos += given;
+  stream->stats.copied += given;
+  if(given == length || stream->offset < 0 ||
+      (stream->update && fupdateflush(stream) == EOF)) {
+    funlockfile(stream);
+    return given;
+  }
+
+  long start = stream->offset + stream->actual_size;
+  long wanted = length - given;
+  long count = (threads > 0) ? threads : sysconf(_SC_NPROCESSORS_ONLN);
+  if(count > PARALLELMAX) {
+    count = PARALLELMAX;
+  }
+  if(count > wanted / PARALLELMIN) {
+    count = wanted / PARALLELMIN;
+  }
+  if(count < 1) {
+    count = 1;
+  }
+  // pieces end on page boundaries of ptr, so no two threads read into the
+  // same page; the first is shortened by how far ptr is into its page
+  long each = (wanted / count + DIRECTALIGN - 1) / DIRECTALIGN * DIRECTALIGN;
+  long skew = (unsigned long)&data[given] % DIRECTALIGN;
+  fchunk *chunks = new fchunk[count + 1]( );
+  int pieces = 0;
+  for(long at = 0; at < wanted; ) {
+    long end = (at + skew + each) / DIRECTALIGN * DIRECTALIGN - skew;
+    if(end > wanted) {
+      end = wanted;
+    }
+    fchunk *chunk = &chunks[pieces++];
+    chunk->fd = stream->fd;
+    chunk->data = &data[given + at];
+    chunk->offset = start + at;
+    chunk->length = end - at;
+    at = end;
+  }
+  for(int i = 1; i < pieces; i++) {
+    chunks[i].started = (pthread_create(&chunks[i].thread, NULL, freadchunk,
+        &chunks[i]) == 0);
+  }
+  freadchunk(&chunks[0]);
+  for(int i = 1; i < pieces; i++) {
+    if(chunks[i].started) {
+      pthread_join(chunks[i].thread, NULL);
+    }
+    else {
+      freadchunk(&chunks[i]);   // no thread to spare: read it here
+    }
+  }
+
+  // only the bytes up to the first short piece follow on from one another
+  long total = 0;
+  int error = 0;
+  bool whole = true;
+  for(int i = 0; i < pieces; i++) {
+    stream->stats.reads += chunks[i].reads;
+    stream->stats.bytesread += chunks[i].done;
+    if(whole) {
+      total += chunks[i].done;
+      error = chunks[i].error;
+      whole = (chunks[i].done == chunks[i].length);
+    }
+  }
+  delete [] chunks;
+  if(stream->checksum) {
+    fcrcwindow(stream);
+    stream->crc = fcrc32c(stream->crc, &data[given], total);
+  }
+  stream->offset = start + total;
+  stream->pos = stream->actual_size = 0;
+  stream->dirtylo = stream->dirtyhi = 0;
+  stream->eof = (total < wanted && error == 0);
+  if(!stream->update && stream->share == NULL) {
+    flseek(stream, stream->offset, SEEK_SET);   // the preads left it alone
+  }
+  funlockfile(stream);
+  if(error != 0 && given + total == 0) {
+    errno = error;
+    return EOF;
+  }
+  return given + total;
+}
+
+//-----------------------------------------------------------------------------
+// fnextline
+// Finds the first line that starts at or after a file offset, reading
+// SPLITWINDOW-byte windows with pread( ) from there until a '\n' turns up
+//
+// @param  stream:    A pointer to an open FILE object
+// @param  offset:    The offset to search from
+// @param  end:       The end of the file
+// @param  window:    SPLITWINDOW bytes aligned to DIRECTALIGN, as O_DIRECT
+//                    needs
+// @returns:          The offset of the line, end if there is none, or EOF if
+//                    pread fails
+//-----------------------------------------------------------------------------
+long fnextline( FILE *stream, long offset, long end, char *window ) {
+  if(offset <= 0) {
+    return 0;
+  }
+  long at = offset - 1;   // a '\n' here means a line starts at offset
+  while(at < end) {
+    long block = at - at % DIRECTALIGN;
+    long bytesRead = pread(stream->fd, window, SPLITWINDOW, block);
+    stream->stats.reads++;
+    if(bytesRead < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return EOF;
+    }
+    if(bytesRead <= at - block) {
+      break;   // the file has shrunk
+    }
+    stream->stats.bytesread += bytesRead;
+    char *newline = (char *)memchr(&window[at - block], CR_LF,
+        bytesRead - (at - block));
+    if(newline != NULL) {
+      return block + (newline - window) + 1;
+    }
+    at = block + bytesRead;
+  }
+  return end;
+}
+
+//-----------------------------------------------------------------------------
+// fsplitlines
+// Splits the rest of a regular file, from the stream position to its end,
+// into chunks of about the same size that begin and end at line boundaries,
+// so that each can be given to a thread of its own: through a cursor of
+// fopen_shared( ) positioned with fseek, or as a range of what
+// fread_parallel( ) read from the same position. Only a window around each
+// boundary is read.
+//
+// @pre:   stream represents an open FILE on a regular file
+// @post:  bounds[0] is the stream position, bounds[chunks] the file size and
+//         chunk i is the lines from bounds[i] up to bounds[i + 1], which may
+//         be none if the lines are long
+// @param  stream:    A pointer to an open FILE object
+// @param  chunks:    The number of chunks to split into
+// @param  bounds:    Receives chunks + 1 file offsets
+// @returns:          chunks if successful, EOF otherwise
+//-----------------------------------------------------------------------------
+int fsplitlines( FILE *stream, int chunks, long *bounds ) {
+  if(stream == NULL || bounds == NULL || chunks <= 0 || stream->mem != NULL ||
+      stream->zip != NULL) {
+    errno = EINVAL;
+    printf("fsplitlines error: %s\n", strerror(errno));
+    return EOF;
+  }
+  flockfile(stream);
+  struct stat fileStat;
+  long position = ftell_unlocked(stream);
+  void *window = NULL;
+  if(position < 0 || fstat(stream->fd, &fileStat) != 0 ||
+      !S_ISREG(fileStat.st_mode) ||
+      posix_memalign(&window, DIRECTALIGN, SPLITWINDOW) != 0) {
+    funlockfile(stream);
+    errno = EINVAL;
+    printf("fsplitlines error: %s\n", strerror(errno));
+    return EOF;
+  }
+  long end = (fileStat.st_size > position) ? fileStat.st_size : position;
+  int result = chunks;
+  bounds[0] = position;
+  for(int i = 1; i < chunks && result != EOF; i++) {
+    long guess = position + (end - position) / chunks * i;
+    bounds[i] = fnextline(stream, (guess > bounds[i - 1]) ? guess :
+        bounds[i - 1], end, (char *)window);
+    if(bounds[i] == EOF) {
+      result = EOF;
+    }
+  }
+  bounds[chunks] = end;
+  free(window);
+  funlockfile(stream);
+  return result;
+}
+
+unsigned crc32cTable[8][256]; // crc32cTable[k][b]: byte b followed by k zeros
+bool crc32cHardware = false;  // true if the CPU has the SSE4.2 crc32
+static pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+
+//-----------------------------------------------------------------------------
+// fcrc32cinit
+// Builds the tables of the slicing-by-8 CRC32C and finds out whether the CPU
+// can compute it with the SSE4.2 crc32 instruction instead. Run once, by the
+// first fcrc32c( ).
+//-----------------------------------------------------------------------------
+void fcrc32cinit( ) {
+  for(unsigned i = 0; i < 256; i++) {
+    unsigned crc = i;
+    for(int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ ((crc & 1) ? CRC32CPOLY : 0);
+    }
+    crc32cTable[0][i] = crc;
+  }
+  for(unsigned i = 0; i < 256; i++) {
+    for(int k = 1; k < 8; k++) {
+      unsigned crc = crc32cTable[k - 1][i];
+      crc32cTable[k][i] = (crc >> 8) ^ crc32cTable[0][crc & 0xFF];
+    }
+  }
+#if defined(__x86_64__)
+  crc32cHardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// fcrc32csoft
+// Extends a CRC32C by data with the slicing-by-8 tables, eight bytes per
+// step. The words are read little endian.
+//
+// @param  crc:       The CRC so far, inverted
+// @param  data:      The bytes to add
+// @param  length:    The number of bytes
+// @returns:          The extended CRC, inverted
+//-----------------------------------------------------------------------------
+unsigned fcrc32csoft( unsigned crc, const char *data, size_t length ) {
+  const unsigned char *next = (const unsigned char *)data;
+  while(length > 0 && ((unsigned long)next & 7) != 0) {
+    crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *next++) & 0xFF];
+    length--;
+  }
+  while(length >= 8) {
+    unsigned low, high;
+    memcpy(&low, next, sizeof(low));
+    memcpy(&high, next + 4, sizeof(high));
+    low ^= crc;
+    crc = crc32cTable[7][low & 0xFF] ^ crc32cTable[6][(low >> 8) & 0xFF] ^
+        crc32cTable[5][(low >> 16) & 0xFF] ^ crc32cTable[4][low >> 24] ^
+        crc32cTable[3][high & 0xFF] ^ crc32cTable[2][(high >> 8) & 0xFF] ^
+        crc32cTable[1][(high >> 16) & 0xFF] ^ crc32cTable[0][high >> 24];
+    next += 8;
+    length -= 8;
+  }
+  while(length > 0) {
+    crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *next++) & 0xFF];
+    length--;
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+//-----------------------------------------------------------------------------
+// fcrc32chard
+// Extends a CRC32C by data with the SSE4.2 crc32 instruction, eight bytes
+// per instruction once data is aligned
+//
+// @pre:   crc32cHardware is true
+// @param  crc:       The CRC so far, inverted
+// @param  data:      The bytes to add
+// @param  length:    The number of bytes
+// @returns:          The extended CRC, inverted
+//-----------------------------------------------------------------------------
+__attribute__((target("sse4.2")))
+unsigned fcrc32chard( unsigned crc, const char *data, size_t length ) {
+  const unsigned char *next = (const unsigned char *)data;
+  while(length > 0 && ((unsigned long)next & 7) != 0) {
+    crc = __builtin_ia32_crc32qi(crc, *next++);
+    length--;
+  }
+  unsigned long long wide = crc;
+  while(length >= 8) {
+    unsigned long long word;
+    memcpy(&word, next, sizeof(word));
+    wide = __builtin_ia32_crc32di(wide, word);
+    next += 8;
+    length -= 8;
+  }
+  crc = (unsigned)wide;
+  while(length > 0) {
+    crc = __builtin_ia32_crc32qi(crc, *next++);
+    length--;
+  }
+  return crc;
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// fcrc32c
+// Extends a CRC32C (the Castagnoli CRC of iSCSI, ext4 and SCTP) by length
+// more bytes, in hardware where the CPU allows
+//
+// @param  crc:       The CRC of the bytes before data, 0 for none
+// @param  data:      The bytes to add
+// @param  length:    The number of bytes
+// @returns:          The CRC of the bytes before data followed by data
+//-----------------------------------------------------------------------------
+unsigned fcrc32c( unsigned crc, const char *data, size_t length ) {
+  pthread_once(&crc32cOnce, fcrc32cinit);
+#if defined(__x86_64__)
+  if(crc32cHardware) {
+    return ~fcrc32chard(~crc, data, length);
+  }
+#endif
+  return ~fcrc32csoft(~crc, data, length);
+}
+
+//-----------------------------------------------------------------------------
+// fcrcwindow
+// Adds the bytes of stream->buffer the stream has passed, read or written,
+// to its checksum. Called on each buffer as it is about to be dropped, so
+// the data is summed while it is still in the CPU cache.
+//
+// @pre:   stream has a checksum and buffer[0] follows the bytes in it
+// @post:  The caller sets stream->pos back to 0
+// @param  stream:    A pointer to an open FILE object
+//-----------------------------------------------------------------------------
+void fcrcwindow( FILE *stream ) {
+  stream->crc = fcrc32c(stream->crc, stream->buffer, stream->pos);
+}
+
+//-----------------------------------------------------------------------------
+// setchecksum
+// Turns the running CRC32C of a buffered stream on or off. With it on, every
+// byte read or written from the current position on is added to it, a
+// buffer at a time at each refill and flush, so a file is checksummed as it
+// is written or read without being read again. The bytes are taken in the
+// order the stream passes them, which is the file's own order when it is
+// read or written from start to end, so the checksum is only defined for
+// sequential use and fseek fails while it is on. Streams that share their
+// buffer with the file or with another mechanism (mapped, cached, memory,
+// O_DIRECT, write-behind, io_uring, cursors and update streams) cannot have
+// one.
+//
+// @pre:   stream represents an open, buffered FILE
+// @post:  The checksum starts over from 0 if on, or is no longer kept
+// @param  stream:    A pointer to an open FILE object
+// @param  on:        true to start the checksum, false to stop it
+// @returns:          0 if successful, EOF otherwise
+//-----------------------------------------------------------------------------
+int setchecksum( FILE *stream, bool on ) {
+  if(stream == NULL || stream->buffer == NULL || stream->update ||
+      !fbypass(stream)) {
+    errno = EINVAL;
+    printf("setchecksum error: %s\n", strerror(errno));
+    return EOF;
+  }
+  flockfile(stream);
+  // the checksum starts at a buffer boundary
+  if(on && stream->lastop != 0 && fflush_unlocked(stream) == EOF) {
+    funlockfile(stream);
+    return EOF;
+  }
+  stream->checksum = on;
+  stream->crc = 0;
+  funlockfile(stream);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fchecksum
+// Reports the CRC32C of the bytes a stream has read or written since
+// setchecksum, buffered ones included. Only sequential reads and writes are
+// summed, as fseek is refused on a stream with a checksum.
+//
+// @pre:   stream has a checksum
+// @param  stream:    A pointer to an open FILE object
+// @param  crc:       Receives the checksum
+// @returns:          0 if successful, EOF if stream has no checksum
+//-----------------------------------------------------------------------------
+int fchecksum( FILE *stream, unsigned *crc ) {
+  if(stream == NULL || crc == NULL || !stream->checksum) {
+    errno = EINVAL;
+    return EOF;
+  }
+  flockfile(stream);
+  *crc = fcrc32c(stream->crc, stream->buffer, stream->pos);
+  funlockfile(stream);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fclose_checksum
+// Closes a stream with a checksum, as fclose does, and reports the CRC32C of
+// everything it read or wrote since setchecksum
+//
+// @pre:   stream has a checksum
+// @post:  stream is closed unless it had no checksum
+// @param  stream:    A pointer to an open FILE object
+// @param  crc:       Receives the checksum
+// @returns:          0 if successful, EOF if the stream had no checksum or
+//                    the last of its data could not be written
+//-----------------------------------------------------------------------------
+int fclose_checksum( FILE *stream, unsigned *crc ) {
+  if(stream == NULL || crc == NULL || !stream->checksum) {
+    errno = EINVAL;
+    printf("fclose_checksum error: %s\n", strerror(errno));
+    return EOF;
+  }
+  flockfile(stream);
+  int flushed = fflush_unlocked(stream);
+  *crc = stream->crc;
+  funlockfile(stream);
+  int closed = fclose(stream);
+  return (flushed == EOF) ? EOF : closed;
+}
+
+//-----------------------------------------------------------------------------
+// fclose_verify
+// Closes a stream with a checksum, as fclose does, and checks that the
+// CRC32C of everything it read or wrote since setchecksum is the one
+// expected
+//
+// @pre:   stream has a checksum
+// @post:  stream is closed unless it had no checksum
+// @param  stream:    A pointer to an open FILE object
+// @param  expected:  The CRC32C the data should have
+// @returns:          0 if the data has it, EOF with errno EIO if not, or EOF
+//                    if fclose_checksum fails
+//-----------------------------------------------------------------------------
+int fclose_verify( FILE *stream, unsigned expected ) {
+  unsigned crc = 0;
+  if(fclose_checksum(stream, &crc) == EOF) {
+    return EOF;
+  }
+  if(crc != expected) {
+    errno = EIO;
+    printf("fclose_verify error: %s\n", strerror(errno));
+    return EOF;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Struct:        fzip
+//
+// Description:   The state of a stream opened with 'z'. The file is a run of
+//                frames, each a ZIPHEADER-byte header giving the length of
+//                the data it holds and of its compressed form, followed by
+//                that form: LZ77 sequences of literals and matches, or the
+//                data as is if it did not compress. The frames found so far
+//                are indexed, so fseek can step over frames by their headers
+//                alone and decompress only the one it lands in.
+//-----------------------------------------------------------------------------
+struct fzip {
+  char *frame;             // ZIPREAD bytes: file data read ahead, or the
+                           // frame being written
+  int *table;              // the compressor's hash table, or NULL
+  long bufstart;           // the file offset of frame[0] when reading
+  int buflen;              // the number of file bytes in frame
+  long current;            // the file offset of the frame in stream->buffer
+  long currentraw;         // the stream offset of its first byte
+  long next;               // the file offset of the frame after it
+  long nextraw;            // the stream offset of its first byte
+  long *filestarts;        // the file offset of each frame found so far
+  long *rawstarts;         // the stream offset of the first byte of each
+  int frames;              // the number of frames found so far
+  int capacity;            // the room in filestarts and rawstarts
+  long fileend;            // the file offset following the last frame found
+  long rawend;             // the stream offset following its data
+};
+
+//-----------------------------------------------------------------------------
+// fzipput
+// Stores a frame header field, least significant byte first
+//
+// @param  at:        Where the 4 bytes go
+// @param  value:     The value to store
+//-----------------------------------------------------------------------------
+void fzipput( char *at, unsigned value ) {
+  for(int i = 0; i < 4; i++) {
+    at[i] = (char)(value >> (8 * i));
+  }
+}
+
+//-----------------------------------------------------------------------------
+// fzipget
+// Loads a frame header field stored by fzipput
+//
+// @param  at:        The 4 bytes of the field
+// @returns:          Its value
+//-----------------------------------------------------------------------------
+unsigned fzipget( const char *at ) {
+  unsigned value = 0;
+  for(int i = 0; i < 4; i++) {
+    value |= (unsigned)(unsigned char)at[i] << (8 * i);
+  }
+  return value;
+}
+
+//-----------------------------------------------------------------------------
+// fzipsequence
+// Emits one sequence of the compressed form: a token whose high nibble is
+// the number of literals and low nibble the match length less ZIPMINMATCH,
+// each continued in bytes of 255 and a last byte below 255 when it is 15 or
+// more, then the literals, then the match offset in two bytes. The final
+// sequence has literals only and ends the compressed form.
+//
+// @param  out:       The next free byte of the output, moved past the sequence
+// @param  end:       The end of the output
+// @param  literals:  The bytes to copy as they are
+// @param  count:     The number of literals
+// @param  offset:    How far back the match starts
+// @param  match:     The length of the match, 0 for the final sequence
+// @returns:          false if the sequence does not fit
+//-----------------------------------------------------------------------------
+inline bool fzipsequence( unsigned char **out, unsigned char *end,
+    const unsigned char *literals, int count, int offset, int match ) {
+  unsigned char *next = *out;
+  if(end - next < 1 + count + count / 255 + 1 + 2 + match / 255 + 1) {
+    return false;
+  }
+  int code = (match > 0) ? match - ZIPMINMATCH : 0;
+  *next++ = (unsigned char)(((count < 15) ? count : 15) << 4 |
+      ((code < 15) ? code : 15));
+  if(count >= 15) {
+    int rest = count - 15;
+    for(; rest >= 255; rest -= 255) {
+      *next++ = 255;
+    }
+    *next++ = (unsigned char)rest;
+  }
+  memcpy(next, literals, count);
+  next += count;
+  if(match > 0) {
+    *next++ = (unsigned char)(offset & 0xFF);
+    *next++ = (unsigned char)(offset >> 8);
+    if(code >= 15) {
+      int rest = code - 15;
+      for(; rest >= 255; rest -= 255) {
+        *next++ = 255;
+      }
+      *next++ = (unsigned char)rest;
+    }
+  }
+  *out = next;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// fzipencode
+// Compresses a block with a greedy LZ77 parse: each 4-byte sequence is
+// looked up in a hash table of where it was last seen, within ZIPWINDOW
+// bytes back, and a match found there is extended both ways. Runs without
+// matches are stepped through faster the longer they get, so data that does
+// not compress costs little time.
+//
+// @param  src:       The block
+// @param  length:    Its length, at most ZIPBLOCK
+// @param  dst:       Where the compressed form goes
+// @param  capacity:  The most bytes it may take
+// @param  table:     1 << ZIPHASHBITS entries to work in
+// @returns:          The length of the compressed form, or -1 if it would
+//                    exceed capacity
+//-----------------------------------------------------------------------------
+int fzipencode( const char *src, int length, char *dst, int capacity,
+    int *table ) {
+  const unsigned char *in = (const unsigned char *)src;
+  unsigned char *out = (unsigned char *)dst;
+  unsigned char *end = out + capacity;
+  memset(table, 0, sizeof(int) << ZIPHASHBITS);  // positions + 1, 0 for none
+  int anchor = 0;   // the first byte not yet emitted
+  int at = 0;
+  while(at + ZIPMINMATCH <= length) {
+    unsigned sequence;
+    memcpy(&sequence, &in[at], sizeof(sequence));
+    unsigned hash = (sequence * 2654435761U) >> (32 - ZIPHASHBITS);
+    int candidate = table[hash] - 1;
+    table[hash] = at + 1;
+    unsigned found = ~sequence;
+    if(candidate >= 0 && at - candidate <= ZIPWINDOW) {
+      memcpy(&found, &in[candidate], sizeof(found));
+    }
+    if(found != sequence) {
+      at += 1 + ((at - anchor) >> 6);
+      continue;
+    }
+    int match = ZIPMINMATCH;
+    while(at + match + 8 <= length) {
+      unsigned long long ours, theirs;
+      memcpy(&ours, &in[at + match], sizeof(ours));
+      memcpy(&theirs, &in[candidate + match], sizeof(theirs));
+      if(ours != theirs) {
+        match += __builtin_ctzll(ours ^ theirs) / 8;   // little endian
+        break;
+      }
+      match += 8;
+    }
+    while(at + match < length && in[candidate + match] == in[at + match]) {
+      match++;
+    }
+    while(at > anchor && candidate > 0 && in[at - 1] == in[candidate - 1]) {
+      at--;
+      candidate--;
+      match++;
+    }
+    if(!fzipsequence(&out, end, &in[anchor], at - anchor, at - candidate,
+        match)) {
+      return -1;
+    }
+    at += match;
+    anchor = at;
+    if(at + ZIPMINMATCH <= length) {
+      // the end of the match is hashed too, so a repeat of it is found
+      memcpy(&sequence, &in[at - 2], sizeof(sequence));
+      table[(sequence * 2654435761U) >> (32 - ZIPHASHBITS)] = at - 1;
+    }
+  }
+  if(anchor < length &&
+      !fzipsequence(&out, end, &in[anchor], length - anchor, 0, 0)) {
+    return -1;
+  }
+  return out - (unsigned char *)dst;
+}
+
+//-----------------------------------------------------------------------------
+// fzipdecode
+// Decompresses the compressed form of a block, checking every length and
+// offset against the bounds of both buffers, so a damaged frame is reported
+// instead of overrunning them
+//
+// @param  src:       The compressed form
+// @param  length:    Its length
+// @param  dst:       Where the block goes
+// @param  capacity:  The most bytes it may take
+// @returns:          The length of the block, or -1 if src is damaged
+//-----------------------------------------------------------------------------
+int fzipdecode( const char *src, int length, char *dst, int capacity ) {
+  const unsigned char *in = (const unsigned char *)src;
+  const unsigned char *inEnd = in + length;
+  char *out = dst;
+  char *outEnd = dst + capacity;
+  while(in < inEnd) {
+    unsigned token = *in++;
+    long count = token >> 4;
+    if(count == 15) {
+      unsigned char more;
+      do {
+        if(in == inEnd) {
+          return -1;
+        }
+        more = *in++;
+        count += more;
+      } while(more == 255);
+    }
+    if(count > inEnd - in || count > outEnd - out) {
+      return -1;
+    }
+    if(count <= 16 && inEnd - in >= 16 && outEnd - out >= 16) {
+      memcpy(out, in, 16);   // one fixed copy, the excess overwritten later
+    }
+    else {
+      memcpy(out, in, count);
+    }
+    in += count;
+    out += count;
+    if(in == inEnd) {
+      break;   // the final sequence has no match
+    }
+    if(inEnd - in < 2) {
+      return -1;
+    }
+    long offset = in[0] | (in[1] << 8);
+    in += 2;
+    long match = token & 15;
+    if(match == 15) {
+      unsigned char more;
+      do {
+        if(in == inEnd) {
+          return -1;
+        }
+        more = *in++;
+        match += more;
+      } while(more == 255);
+    }
+    match += ZIPMINMATCH;
+    if(offset == 0 || offset > out - dst || match > outEnd - out) {
+      return -1;
+    }
+    const char *from = out - offset;
+    char *end = out + match;
+    if(offset >= 8 && outEnd - end >= 8) {
+      // 8 bytes at a time never read a byte this copy has yet to write, and
+      // may run up to 7 bytes past the match, to be overwritten later
+      for(; out < end; out += 8, from += 8) {
+        memcpy(out, from, 8);
+      }
+      out = end;
+    }
+    else {
+      for(; out < end; out++) {
+        *out = *from++;
+      }
+    }
+  }
+  return out - dst;
+}
+
+//-----------------------------------------------------------------------------
+// fzipbytes
+// Finds length bytes of a compressed file in the read-ahead of its stream,
+// reading them with pread( ) if they are not there, together with the
+// following bytes up to ZIPREAD if ahead is set
+//
+// @pre:   length <= ZIPREAD
+// @param  stream:    A pointer to a FILE opened with 'z'
+// @param  at:        The file offset of the bytes
+// @param  length:    The number of bytes
+// @param  ahead:     true to read ahead, false to read length bytes only
+// @param  data:      Receives where the bytes are
+// @returns:          The number of bytes found, fewer than length at the end
+//                    of the file, or -1 if pread fails
+//-----------------------------------------------------------------------------
+int fzipbytes( FILE *stream, long at, int length, bool ahead,
+    const char **data ) {
+  fzip *zip = stream->zip;
+  if(at < zip->bufstart || at + length > zip->bufstart + zip->buflen) {
+    int wanted = ahead ? ZIPREAD : length;
+    zip->bufstart = at;
+    zip->buflen = 0;
+    while(zip->buflen < length) {
+      long got = pread(stream->fd, &zip->frame[zip->buflen],
+          wanted - zip->buflen, at + zip->buflen);
+      stream->stats.reads++;
+      if(got < 0) {
+        if(errno == EINTR) {
+          continue;
+        }
+        return -1;
+      }
+      if(got == 0) {
+        break;
+      }
+      zip->buflen += got;
+      stream->stats.bytesread += got;
+    }
+  }
+  *data = &zip->frame[at - zip->bufstart];
+  long found = zip->bufstart + zip->buflen - at;
+  return (found < length) ? found : length;
+}
+
+//-----------------------------------------------------------------------------
+// fzipheader
+// Reads the header of the frame at a file offset
+//
+// @param  stream:    A pointer to a FILE opened with 'z'
+// @param  at:        The file offset of the frame
+// @param  ahead:     true to read the frame's data along with its header
+// @param  raw:       Receives the length of the data the frame holds
+// @param  packed:    Receives the length of its compressed form
+// @returns:          1 if there is a frame, 0 at the end of the file and EOF
+//                    if the header cannot be read or is damaged
+//-----------------------------------------------------------------------------
+int fzipheader( FILE *stream, long at, bool ahead, int *raw, int *packed ) {
+  const char *header;
+  int got = fzipbytes(stream, at, ZIPHEADER, ahead, &header);
+  if(got == 0) {
+    return 0;
+  }
+  if(got < ZIPHEADER) {
+    errno = (got < 0) ? errno : EIO;
+    return EOF;
+  }
+  unsigned rawLength = fzipget(header);
+  unsigned packedLength = fzipget(&header[4]);
+  if(rawLength == 0 || rawLength > (unsigned)ZIPBLOCK ||
+      packedLength > rawLength) {
+    errno = EIO;
+    return EOF;
+  }
+  *raw = rawLength;
+  *packed = packedLength;
+  return 1;
+}
+
+//-----------------------------------------------------------------------------
+// fzipindex
+// Adds a frame to the index if it is the one after the last frame found.
+// Frames are only ever found by moving forward from a frame already found,
+// so the index always holds every frame up to zip->fileend.
+//
+// @param  zip:       The state of a stream opened with 'z'
+// @param  at:        The file offset of the frame
+// @param  rawAt:     The stream offset of its first byte
+// @param  raw:       The length of its data
+// @param  packed:    The length of its compressed form
+//-----------------------------------------------------------------------------
+void fzipindex( fzip *zip, long at, long rawAt, int raw, int packed ) {
+  if(at != zip->fileend) {
+    return;
+  }
+  if(zip->frames == zip->capacity) {
+    zip->capacity = (zip->capacity > 0) ? zip->capacity * 2 : 64;
+    zip->filestarts = (long *)realloc(zip->filestarts,
+        zip->capacity * sizeof(long));
+    zip->rawstarts = (long *)realloc(zip->rawstarts,
+        zip->capacity * sizeof(long));
+  }
+  zip->filestarts[zip->frames] = at;
+  zip->rawstarts[zip->frames] = rawAt;
+  zip->frames++;
+  zip->fileend = at + ZIPHEADER + packed;
+  zip->rawend = rawAt + raw;
+}
+
+//-----------------------------------------------------------------------------
+// fzipwalk
+// Indexes the frames after the last one found, reading their headers only,
+// until one holds a stream offset or the end of the file is reached
+//
+// @param  stream:    A pointer to a FILE opened with 'z'
+// @param  target:    The stream offset to find
+// @returns:          The stream offset following the last frame found, or
+//                    EOF if a header cannot be read
+//-----------------------------------------------------------------------------
+long fzipwalk( FILE *stream, long target ) {
+  fzip *zip = stream->zip;
+  while(zip->rawend <= target) {
+    int raw, packed;
+    int found = fzipheader(stream, zip->fileend, false, &raw, &packed);
+    if(found == EOF) {
+      return EOF;
+    }
+    if(found == 0) {
+      break;
+    }
+    fzipindex(zip, zip->fileend, zip->rawend, raw, packed);
+  }
+  return zip->rawend;
+}
+
+//-----------------------------------------------------------------------------
+// fzipread
+// Refills a compressed stream: decompresses the frame holding the next
+// unread byte into stream->buffer, so that buffer, offset, pos and
+// actual_size describe the uncompressed data just as they would for a plain
+// file. Sequential reads find each frame in the read-ahead of the last.
+//
+// @pre:   stream was opened with 'z' and its buffer has been read
+// @post:  stream->buffer[stream->pos] is the next unread byte, if any
+// @param  stream:    A pointer to an open FILE object
+// @returns:          The number of bytes left in the buffer, 0 at the end of
+//                    the file, EOF on error or if a frame is damaged
+//-----------------------------------------------------------------------------
+int fzipread( FILE *stream ) {
+  fzip *zip = stream->zip;
+  long wanted = stream->offset + stream->actual_size;
+  if(wanted < zip->nextraw) {
+    zip->next = zip->current;   // the buffer was dropped before its end
+    zip->nextraw = zip->currentraw;
+  }
+  stream->offset = wanted;
+  stream->pos = stream->actual_size = 0;
+  int raw, packed;
+  while(true) {
+    int found = fzipheader(stream, zip->next, true, &raw, &packed);
+    if(found != 1) {
+      return found;
+    }
+    fzipindex(zip, zip->next, zip->nextraw, raw, packed);
+    if(wanted < zip->nextraw + raw) {
+      break;
+    }
+    zip->next += ZIPHEADER + packed;
+    zip->nextraw += raw;
+  }
+  const char *data;
+  if(fzipbytes(stream, zip->next + ZIPHEADER, packed, true, &data) < packed) {
+    errno = EIO;
+    return EOF;
+  }
+  if(packed == raw) {
+    memcpy(stream->buffer, data, raw);   // stored as it is
+  }
+  else if(fzipdecode(data, packed, stream->buffer, stream->size) != raw) {
+    errno = EIO;
+    return EOF;
+  }
+  zip->current = zip->next;
+  zip->currentraw = zip->nextraw;
+  zip->next += ZIPHEADER + packed;
+  zip->nextraw += raw;
+  stream->offset = zip->currentraw;
+  stream->actual_size = raw;
+  stream->pos = wanted - zip->currentraw;
+  return stream->actual_size - stream->pos;
+}
+
+//-----------------------------------------------------------------------------
+// fzipwrite
+// Flushes a compressed stream: compresses the buffered bytes into one frame
+// and writes it, storing them as they are if they do not compress
+//
+// @pre:   stream was opened with 'z' and was last written
+// @post:  stream->pos is 0 unless the write failed
+// @param  stream:    A pointer to an open FILE object
+// @returns:          0 if successful, EOF otherwise
+//-----------------------------------------------------------------------------
+int fzipwrite( FILE *stream ) {
+  if(stream->pos == 0) {
+    return 0;
+  }
+  fzip *zip = stream->zip;
+  char *frame = zip->frame;
+  int packed = fzipencode(stream->buffer, stream->pos, &frame[ZIPHEADER],
+      stream->pos - 1, zip->table);
+  if(packed < 0) {
+    packed = stream->pos;
+    memcpy(&frame[ZIPHEADER], stream->buffer, packed);
+  }
+  fzipput(frame, stream->pos);
+  fzipput(&frame[4], packed);
+  int length = ZIPHEADER + packed;
+  int written = 0;
+  while(written < length) {
+    int bytesWritten = write(stream->fd, &frame[written], length - written);
+    stream->stats.writes++;
+    if(bytesWritten < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return EOF;
+    }
+    written += bytesWritten;
+    stream->stats.byteswritten += bytesWritten;
+  }
+  if(stream->offset >= 0) {
+    stream->offset += stream->pos;
+  }
+  stream->pos = stream->actual_size = 0;
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fzipseek
+// Moves a compressed stream to a new position, counted in uncompressed
+// bytes. The frame holding it is found in the index, or by stepping over
+// the headers of the frames after the last one found; nothing is
+// decompressed until the next refill. A stream being written can only stay
+// where it is.
+//
+// @pre:   stream was opened with 'z' and is locked
+// @param  stream:    A pointer to an open FILE object
+// @param  offset:    The number of bytes to seek in the file
+// @param  whence:    The starting position before offset
+// @returns:          0 if seek is successful, EOF otherwise
+//-----------------------------------------------------------------------------
+int fzipseek( FILE *stream, long offset, int whence ) {
+  fzip *zip = stream->zip;
+  bool writing = (stream->flag & O_ACCMODE) != O_RDONLY;
+  long current = stream->offset + stream->pos;
+  long target = offset;
+  if(whence == SEEK_CUR) {
+    target += current;
+  }
+  else if(whence == SEEK_END) {
+    long end = writing ? current : fzipwalk(stream, LONG_MAX);
+    if(end == EOF) {
+      return EOF;
+    }
+    target += end;
+  }
+  if(target < 0 || (whence != SEEK_SET && whence != SEEK_CUR &&
+      whence != SEEK_END) || (writing && target != current)) {
+    errno = EINVAL;
+    return EOF;
+  }
+  if(writing) {
+    return 0;
+  }
+  if(target >= stream->offset &&
+      target <= stream->offset + stream->actual_size) {
+    stream->pos = target - stream->offset;
+    stream->stats.seekhits++;
+    return 0;
+  }
+  stream->stats.seekmisses++;
+  if(fzipwalk(stream, target) == EOF) {
+    return EOF;
+  }
+  // the last frame starting at or before target
+  int low = 0;
+  int high = zip->frames;
+  while(high - low > 1) {
+    int middle = (low + high) / 2;
+    if(zip->rawstarts[middle] <= target) {
+      low = middle;
+    }
+    else {
+      high = middle;
+    }
+  }
+  zip->current = zip->next = (zip->frames > 0) ? zip->filestarts[low] : 0;
+  zip->currentraw = zip->nextraw = (zip->frames > 0) ? zip->rawstarts[low] : 0;
+  stream->offset = target;
+  stream->pos = stream->actual_size = 0;
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// fzipopen
+// Sets up a newly opened stream to compress or decompress its file. The
+// buffer is replaced with one of ZIPBLOCK bytes, the most a frame holds. A
+// stream opened to append starts at the end of the data already in the file.
+// Frames are read with pread( ), so only regular files are accepted.
+//
+// @pre:   stream was just opened with 'z', for reading or for writing
+// @post:  stream->zip is set up
+// @param  stream:    A pointer to an open FILE object
+// @returns:          true if successful, false otherwise
+//-----------------------------------------------------------------------------
+bool fzipopen( FILE *stream ) {
+  struct stat fileStat;
+  if(fstat(stream->fd, &fileStat) != 0) {
+    return false;
+  }
+  if(!S_ISREG(fileStat.st_mode)) {
+    errno = ESPIPE;
+    return false;
+  }
+  char *buffer = fbufalloc(ZIPBLOCK);
+  if(buffer == NULL) {
+    return false;
+  }
+  fbuffree(stream->buffer, stream->size);
+  stream->buffer = buffer;
+  stream->size = ZIPBLOCK;
+  fzip *zip = new fzip( );
+  zip->frame = new char[ZIPREAD];
+  if((stream->flag & O_ACCMODE) != O_RDONLY) {
+    zip->table = new int[1 << ZIPHASHBITS];
+  }
+  stream->zip = zip;
+  stream->offset = 0;
+  stream->raoffset = -1;
+  if(stream->flag & O_APPEND) {
+    long end = fzipwalk(stream, LONG_MAX);
+    if(end == EOF) {
+      fzipfree(zip);
+      stream->zip = NULL;
+      return false;
+    }
+    stream->offset = end;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// fzipfree
+// Frees the state of a compressed stream
+//
+// @param  zip:       The state to free
+//-----------------------------------------------------------------------------
+void fzipfree( fzip *zip ) {
+  delete [] zip->frame;
+  delete [] zip->table;
+  free(zip->filestarts);
+  free(zip->rawstarts);
+  delete zip;
+}
@@ -12,7 +12,38 @@
 #define _IONBF 0    // unbuffered
 #define _IOLBF 1    // line buffered
 #define _IOFBF 2    // fully buffered
+#define _IOURING 4  // or'd into a buffered mode: refill and flush via io_uring
 #define EOF -1      // end of file
+#define MAPWIN 0x40000000 // window of a mapped file exposed through buffer
+#define BUFHISTORY 8      // buffer resizes remembered for fbufstat( )
+
+typedef long fpos_t; // a position stored by fgetpos( )
+
+//-----------------------------------------------------------------------------
+// Struct:        fiostats
+//
+// Description:   Counters of the work a FILE has done, see fstats( ) in
+//                stdio.cpp.
+//-----------------------------------------------------------------------------
+struct fiostats {
+  long reads;        // read, readv, pread, io_uring reads and kernel copies
+  long writes;       // write, writev, pwrite, io_uring writes and kernel copies
+  long seeks;        // lseek calls
+  long bytesread;    // bytes the kernel has delivered
+  long byteswritten; // bytes the kernel has taken
+  long refills;      // buffer refills, mapped windows and cached blocks included
+  long flushes;      // buffers with data in them flushed
+  long copied;       // bytes copied between the caller and the buffer
+  long seekhits;     // fseeks served from the data already at hand
+  long seekmisses;   // fseeks that had to drop the buffer
+};
+
+struct fasync;      // write-behind state, see setasync( ) in stdio.cpp
+struct furing;      // a thread's io_uring, see furingattach( ) in stdio.cpp
+struct fcache;      // a block cache, see setcache( ) in stdio.cpp
+struct fmem;        // the memory of a memory stream, see fmemopen( ) in stdio.cpp
+struct fshare;      // a file read by cursors, see fopen_shared( ) in stdio.cpp
+struct fzip;        // compressed frames, see fzipread( ) in stdio.cpp
 
 //-----------------------------------------------------------------------------
 // Class:         FILE
@@ -26,7 +57,14 @@ class FILE {
  public:
   FILE( ) :
     fd( 0 ), pos( 0 ), buffer( (char *)0 ), size( 0 ), actual_size( 0 ),
-    mode( _IONBF ), flag( 0 ), bufown( false ), lastop( 0 ), eof( false ) {}
+    mode( _IONBF ), flag( 0 ), bufown( false ), lastop( 0 ), eof( false ),
+    map( (char *)0 ), mapsize( 0 ), lock( 0 ), owner( 0 ), lockcount( 0 ),
+    async( (fasync *)0 ), offset( 0 ), raoffset( 0 ), raend( 0 ), rarun( 0 ),
+    ring( (furing *)0 ), urbuffer( (char *)0 ), urlength( 0 ), urresult( 0 ),
+    urop( 0 ), urbusy( false ), cache( (fcache *)0 ), bufbase( 0 ),
+    bufrun( 0 ), bufneed( 0 ), bufresizes( 0 ), stats( ), mem( (fmem *)0 ),
+    direct( 0 ), update( false ), dirtylo( 0 ), dirtyhi( 0 ),
+    share( (fshare *)0 ), checksum( false ), crc( 0 ), zip( (fzip *)0 ) {}
   int fd;          // a Unix file descriptor of an opened file
   int pos;         // the current file position in the buffer
   char *buffer;    // an input or output file stream buffer
@@ -42,8 +80,87 @@ class FILE {
   bool bufown;     // true if allocated by stdio.h or false by a user
   char lastop;     // 'r' or 'w'
   bool eof;        // true if EOF is reached
+  char *map;       // the whole file mapped read-only by fopen( "rm" ), or NULL;
+                   // buffer then points at a MAPWIN-sized window of map
+  long mapsize;    // the length of the mapped file
+  int lock;        // 0 unlocked, 1 locked, 2 locked with threads waiting
+  long owner;      // the thread holding lock, or 0
+  int lockcount;   // how many times owner has taken lock
+  fasync *async;   // write-behind buffers and thread, or NULL
+  long offset;     // the file offset of buffer[0], or -1 if not known
+  long raoffset;   // the file offset the next refill reads from, or -1
+  long raend;      // the end of the range the kernel was asked to read ahead
+  int rarun;       // the number of refills since the last seek
+  furing *ring;    // the io_uring refills and flushes go through, or NULL
+  char *urbuffer;  // the buffer io_uring is reading ahead into or writing
+  int urlength;    // the number of bytes asked of io_uring
+  int urresult;    // the result of the last io_uring operation
+  char urop;       // 'r' or 'w' for the last io_uring operation, or 0
+  bool urbusy;     // true until that operation completes
+  fcache *cache;   // recently read blocks of a read-only file, or NULL
+  int bufbase;     // the buffer size chosen at fopen, 0 if it never changes
+  int bufrun;      // full buffers refilled or flushed since the last seek
+  int bufneed;     // the largest request since the last resize
+  int bufresizes;  // the number of times the buffer was resized
+  int bufhistory[BUFHISTORY]; // the sizes given by the last resizes
+  fiostats stats;  // what the stream has done, see fstats( )
+  fmem *mem;       // the memory read and written instead of fd, or NULL
+  int direct;      // the alignment O_DIRECT transfers keep to, or 0
+  bool update;     // true if reads and writes share buffer, see fupdateturn( )
+  int dirtylo;     // the first byte of buffer written but not yet in the file
+  int dirtyhi;     // the byte after the last of them, dirtylo if there is none
+  fshare *share;   // the shared file a cursor reads, or NULL
+  bool checksum;   // true if crc is kept up, see setchecksum( )
+  unsigned crc;    // the CRC32C of the bytes passed before buffer[0]
+  fzip *zip;       // the frames of a file opened with fopen( "rz" ), or NULL;
+                   // offset and pos then count uncompressed bytes
 };
 
+extern FILE *stdin;   // standard input, fully buffered
+extern FILE *stdout;  // standard output, line buffered on a terminal
+extern FILE *stderr;  // standard error, unbuffered
+
+int _filbuf( FILE *stream );
+int _flsbuf( int c, FILE *stream );
+void flockfile( FILE *stream );
+void funlockfile( FILE *stream );
+int ftrylockfile( FILE *stream );
+
+//-----------------------------------------------------------------------------
+// getc_unlocked, putc_unlocked, getc, putc
+// Single-character fast paths; getc and putc also hold stream's lock, which
+// the _unlocked versions leave to the caller (see flockfile). While the buffer
+// still holds unread data (or free space) they only touch pos; _filbuf and _flsbuf in stdio.cpp take over
+// at buffer boundaries, on a read/write switch, at the end of a line of a line
+// buffered stream and for unbuffered streams.
+//-----------------------------------------------------------------------------
+inline int getc_unlocked( FILE *stream ) {
+  if ( stream->lastop == 'r' && stream->pos < stream->actual_size )
+    return (unsigned char)stream->buffer[stream->pos++];
+  return _filbuf( stream );
+}
+
+inline int putc_unlocked( int c, FILE *stream ) {
+  if ( stream->lastop == 'w' && stream->pos < stream->size &&
+       ( c != '\n' || stream->mode != _IOLBF ) )
+    return (unsigned char)( stream->buffer[stream->pos++] = c );
+  return _flsbuf( c, stream );
+}
+
+inline int getc( FILE *stream ) {
+  flockfile( stream );
+  int c = getc_unlocked( stream );
+  funlockfile( stream );
+  return c;
+}
+
+inline int putc( int c, FILE *stream ) {
+  flockfile( stream );
+  c = putc_unlocked( c, stream );
+  funlockfile( stream );
+  return c;
+}
+
 #include "stdio.cpp"
 
 #endif